@@ -0,0 +1,802 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <bitset>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iterator>
+#include <iomanip>
+#include <filesystem>
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+
+#include "chip8.h"
+#include "xxhash64.h"
+
+/*
+    What the ROM analyzer (RomAnalyzer below) worked out about a program, kept next to it as <rom>.c8meta so a run can use it
+    without analysing the ROM again. It's a little text file, one thing per line with the addresses in hex:
+
+        chip8-meta 2
+        rom 246 3f2a9c0d11e4b780    the ROM's size and xxHash64, so the file is ignored once the ROM changes
+        profile vip
+        ipf 15                      instructions per frame this ROM wants, only there if someone's put it there
+        block 200 212               code from 0x200 up to (not including) 0x212
+        idle 228 22e timer          a loop that can only be waiting for the delay timer, a key (key) or nothing (halt)
+        data 2f0 300 sprite         bytes that aren't code: sprite, audio, variables, table or unknown
+        smc 24a 2f0                 the instruction at 0x24a writes over code at 0x2f0
+
+    Lines it doesn't know are skipped so older builds can still read newer files. A run uses the profile instead of guessing
+    from the file's extension, and decodes every block into the decode cache before the first instruction (see Prewarm).
+    A ROM corpus (corpus.h) keeps the same lines for every ROM in it in one cache file, each one finished with "end".
+*/
+struct RomMetadata
+{
+    struct Range {
+        unsigned int start = 0;
+        unsigned int end = 0; // one past the last byte
+        std::string kind; // what sort of idle loop or data it is, empty for blocks
+    };
+
+    struct Write {
+        unsigned int at = 0; // the instruction doing the writing
+        unsigned int target = 0; // the first byte it writes
+    };
+
+    static constexpr unsigned int version = 2; // version 1 hashed the ROM with FNV-1a
+
+    unsigned int romSize = 0;
+    uint64_t romHash = 0;
+    Chip8Profile profile = Chip8Profile::Vip;
+    unsigned int instructionsPerFrame = 0; // 0 leaves it to --ipf
+    std::vector<Range> blocks;
+    std::vector<Range> idleLoops;
+    std::vector<Range> dataRegions;
+    std::vector<Write> selfModifying;
+
+    static std::string PathFor(const std::string& rom_path) {
+        return rom_path + ".c8meta";
+    };
+
+    static bool ReadRom(const std::string& rom_path, std::vector<unsigned char>& bytes) {
+        std::ifstream input(rom_path, std::ios::binary);
+        if (!input) {
+            return false;
+        }
+        bytes.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+        return !bytes.empty();
+    };
+
+    static uint64_t HashRom(const unsigned char* bytes, size_t length) {
+        return XxHash64::Hash(bytes, length);
+    };
+
+    void WriteTo(std::ostream& output) const {
+        output << "rom " << std::dec << romSize << " " << std::hex << romHash << "\n";
+        output << "profile " << Chip8ProfileName(profile) << "\n";
+        if (instructionsPerFrame > 0) {
+            output << "ipf " << std::dec << instructionsPerFrame << std::hex << "\n";
+        }
+        for (const Range& block : blocks) {
+            output << "block " << block.start << " " << block.end << "\n";
+        }
+        for (const Range& loop : idleLoops) {
+            output << "idle " << loop.start << " " << loop.end << " " << loop.kind << "\n";
+        }
+        for (const Range& data : dataRegions) {
+            output << "data " << data.start << " " << data.end << " " << data.kind << "\n";
+        }
+        for (const Write& write : selfModifying) {
+            output << "smc " << write.at << " " << write.target << "\n";
+        }
+        output << std::dec;
+    };
+
+    bool ReadFrom(std::istream& input) {
+        // everything up to an "end" line or the end of the file. false if it's broken or there was nothing there
+        *this = RomMetadata();
+        std::string line;
+        while (std::getline(input, line) && line != "end") {
+            std::istringstream fields(line);
+            std::string key;
+            fields >> key;
+            if (key == "rom") {
+                fields >> std::dec >> romSize >> std::hex >> romHash;
+            }
+            else if (key == "profile") {
+                std::string name;
+                fields >> name;
+                if (!ParseChip8Profile(name, profile)) {
+                    return false;
+                }
+            }
+            else if (key == "ipf") {
+                fields >> std::dec >> instructionsPerFrame;
+            }
+            else if (key == "block" || key == "idle" || key == "data") {
+                Range range;
+                fields >> std::hex >> range.start >> range.end >> range.kind;
+                std::vector<Range>& ranges = (key == "block") ? blocks : (key == "idle") ? idleLoops : dataRegions;
+                ranges.push_back(range);
+            }
+            else if (key == "smc") {
+                Write write;
+                fields >> std::hex >> write.at >> write.target;
+                selfModifying.push_back(write);
+            }
+            if (fields.bad()) {
+                return false;
+            }
+        }
+        return romSize > 0;
+    };
+
+    bool Save(const std::string& path) const {
+        std::ofstream output(path);
+        output << "chip8-meta " << version << "\n";
+        WriteTo(output);
+        output.flush();
+        return static_cast<bool>(output);
+    };
+
+    bool Load(const std::string& path) {
+        // false if it can't be read or isn't a version we understand
+        std::ifstream input(path);
+        std::string line;
+        return std::getline(input, line) && line == "chip8-meta " + std::to_string(version) && ReadFrom(input);
+    };
+
+    bool LoadFor(const std::string& rom_path) {
+        // the metadata next to a ROM, but only if there is some and it was made from exactly the bytes in the ROM now
+        std::error_code error;
+        std::string path = PathFor(rom_path);
+        if (!std::filesystem::is_regular_file(path, error) || !Load(path)) {
+            return false;
+        }
+        std::vector<unsigned char> bytes;
+        return ReadRom(rom_path, bytes) && bytes.size() == romSize && HashRom(bytes.data(), bytes.size()) == romHash;
+    };
+
+    template <typename Core>
+    void Prewarm(Core& chip8) const {
+        // call after LoadProgram. only the code gets decoded, running into data still decodes it the usual way
+        for (const Range& block : blocks) {
+            chip8.PrewarmDecodeCache(block.start, block.end);
+        }
+    };
+};
+
+inline Chip8Profile ProfileForRom(const std::string& rom_path) {
+    // the profile from the ROM's metadata if --analyze has been run on it, otherwise a guess from its name
+    RomMetadata metadata;
+    return metadata.LoadFor(rom_path) ? metadata.profile : GuessChip8Profile(rom_path);
+}
+
+/*
+    Looks at a ROM without running it. Starting from 0x200 it follows every way the program can go (jumps, calls, both sides
+    of every skip and the jump tables Bnnn goes through) and decodes everything it reaches with Chip8Core's own Decode, so it
+    always agrees with the interpreter about what an opcode is. Anything it never reaches is data.
+
+    On the way it keeps track of I wherever that's easy (Annn and F000 nnnn set it, Fx55 / Fx65 move it on), which is enough
+    to tell sprites (drawn with Dxyn) from variables (written with Fx33, Fx55 or 5xy2), and whether any of those writes land
+    on code. The code is split into basic blocks, straight runs with one way in at the top and every branch at the bottom,
+    and the edges between them make the control flow graph. Backward jumps are the loops, and the short ones that only read
+    the delay timer or the keys are the idle loops RunFor skips at run time.
+
+    It can't see everything. I is forgotten at every branch target and after anything that adds to it, Bnnn tables are only
+    followed while they're a run of jumps, and code copied somewhere else and run from there isn't seen at all. Writes
+    through an I it lost track of are counted so you know how far to trust "no self-modifying writes".
+
+    Unless it's told which profile to use it picks one from the instructions the code uses: any XO-CHIP only instruction (or
+    a ROM too big for 4 KB) means xochip, otherwise any SUPER-CHIP one means schip, otherwise it's vip.
+*/
+class RomAnalyzer
+{
+    public:
+
+        enum class Flow { Next, Jump, Call, Return, Skip, Indirect, Stop };
+
+        struct Instruction {
+            unsigned int address = 0;
+            unsigned int length = 2; // F000 nnnn is 4
+            std::string text;
+            Flow flow = Flow::Next;
+            std::vector<unsigned int> next; // every address it can go to next, including the one after it
+            std::string waitsOn; // "timer" or "key" for the instructions an idle loop waits with
+            bool idleSafe = false; // changes nothing but the program counter and the register it reads the timer into
+        };
+
+        struct Block {
+            unsigned int start = 0;
+            unsigned int end = 0;
+            size_t first = 0; // where its instructions are in `instructions`
+            size_t count = 0;
+            std::vector<unsigned int> successors; // the `next` of its last instruction
+        };
+
+        struct Loop {
+            unsigned int start = 0; // the jump target
+            unsigned int end = 0; // just past the jump back
+            unsigned int instructions = 0;
+            std::string idleKind; // empty unless it's an idle loop
+        };
+
+        RomMetadata metadata; // the part that gets saved
+        std::vector<Instruction> instructions; // everything reached, in address order
+        std::vector<Block> blocks;
+        std::vector<Loop> loops;
+        std::vector<unsigned int> subroutines; // 2nnn targets
+        std::vector<unsigned int> stopped; // things that aren't instructions, where a path gave up
+        std::vector<unsigned int> indirectJumps; // Bnnn
+        std::vector<unsigned int> leavesRom; // branches (or running off the end) to somewhere outside the ROM
+        unsigned int unknownStores = 0; // Fx33 / Fx55 / 5xy2 through an I it lost track of
+        std::string profileReason;
+
+        bool Analyze(const std::string& rom_path, bool forceProfile, Chip8Profile profile) {
+            std::vector<unsigned char> bytes;
+            return RomMetadata::ReadRom(rom_path, bytes) && Analyze(bytes.data(), bytes.size(), forceProfile, profile, GuessChip8Profile(rom_path));
+        };
+
+        bool Analyze(const unsigned char* bytes, size_t length, bool forceProfile, Chip8Profile profile, Chip8Profile named = Chip8Profile::Vip) {
+            // `named` is what the ROM's file name suggests (see GuessChip8Profile)
+            if (length == 0 || length > Chip8Core<XoChipQuirks>::maxProgramSize) {
+                return false;
+            }
+            rom.assign(bytes, bytes + length);
+            metadata.romSize = static_cast<unsigned int>(rom.size());
+            metadata.romHash = RomMetadata::HashRom(bytes, length);
+            if (forceProfile) {
+                profileReason = "picked with --quirks";
+            }
+            else {
+                // XO-CHIP decodes everything the others do, so one pass with it shows what the program uses
+                AnalyzeAs<XoChipQuirks>();
+                profile = Chip8Profile::Vip;
+                profileReason = "only plain chip8 instructions";
+                if (rom.size() > Chip8Core<VipQuirks>::maxProgramSize) {
+                    profile = Chip8Profile::XoChip;
+                    profileReason = "too big for 4 KB";
+                }
+                else if (usesXoChip) {
+                    profile = Chip8Profile::XoChip;
+                    profileReason = "uses XO-CHIP instructions";
+                }
+                else if (usesSuperChip) {
+                    profile = Chip8Profile::SuperChip;
+                    profileReason = "uses SUPER-CHIP instructions";
+                }
+                if (named > profile) {
+                    // the quirks don't show in the instructions, so a .sc8 that sticks to plain ones still wants SUPER-CHIP's
+                    profile = named;
+                    profileReason = std::string("named for ") + Chip8ProfileName(named);
+                }
+            }
+            switch (profile) {
+                case Chip8Profile::SuperChip: return AnalyzeAs<SuperChipQuirks>();
+                case Chip8Profile::XoChip: return AnalyzeAs<XoChipQuirks>();
+                default: return AnalyzeAs<VipQuirks>();
+            }
+        };
+
+        void PrintReport(std::ostream& out, const std::string& rom_path) const {
+            out << rom_path << ": " << rom.size() << " bytes, " << Chip8ProfileName(metadata.profile) << " (" << profileReason << ")" << std::endl;
+
+            unsigned int codeBytes = 0;
+            size_t edges = 0;
+            for (const Block& block : blocks) {
+                codeBytes += block.end - block.start;
+                edges += block.successors.size();
+            }
+            out << "  code: " << codeBytes << " bytes, " << instructions.size() << " instructions in " << blocks.size() << " blocks with "
+                << edges << " edges, " << subroutines.size() << " subroutines" << std::endl;
+
+            std::map<std::string, unsigned int> dataBytes;
+            unsigned int totalData = 0;
+            for (const RomMetadata::Range& data : metadata.dataRegions) {
+                dataBytes[data.kind] += data.end - data.start;
+                totalData += data.end - data.start;
+            }
+            out << "  data: " << totalData << " bytes";
+            const char* separator = " (";
+            for (const auto& [kind, bytes] : dataBytes) {
+                out << separator << kind << " " << bytes;
+                separator = ", ";
+            }
+            out << (dataBytes.empty() ? "" : ")") << std::endl;
+
+            // the loops are where a game spends its time, so they're worth knowing about even when they aren't idle
+            out << "  loops:" << (loops.empty() ? " none" : "") << std::endl;
+            for (const Loop& loop : loops) {
+                out << "    " << Hex(loop.start, 3) << " - " << Hex(loop.end, 3) << "  " << loop.instructions << (loop.instructions == 1 ? " instruction" : " instructions")
+                    << (loop.idleKind.empty() ? "" : ", idle (" + loop.idleKind + ")") << std::endl;
+            }
+            std::vector<unsigned int> keyWaits;
+            for (const Instruction& instruction : instructions) {
+                if (instruction.flow == Flow::Next && instruction.waitsOn == "key") {
+                    keyWaits.push_back(instruction.address);
+                }
+            }
+            PrintAddresses(out, "waits for a key (Fx0A)", keyWaits);
+
+            out << "  self-modifying writes:" << (metadata.selfModifying.empty() ? " none" : "") << std::endl;
+            for (const RomMetadata::Write& write : metadata.selfModifying) {
+                out << "    " << Hex(write.at, 3) << " " << Find(write.at)->text << " writes " << Hex(write.target, 3) << std::endl;
+            }
+            if (unknownStores > 0) {
+                out << "  writes through an I it lost track of: " << unknownStores << std::endl;
+            }
+            PrintAddresses(out, "indirect jumps (Bnnn)", indirectJumps);
+            PrintAddresses(out, "not instructions, where a path stopped", stopped);
+            PrintAddresses(out, "goes outside the ROM", leavesRom);
+        };
+
+        void PrintListing(std::ostream& out) const {
+            // every block with its instructions and where it goes afterwards, and the data in between, in address order
+            size_t data = 0;
+            const std::vector<RomMetadata::Range>& dataRegions = metadata.dataRegions;
+            for (size_t b = 0; b <= blocks.size(); b++) {
+                unsigned int upTo = (b < blocks.size()) ? blocks[b].start : 0x10000;
+                for (; data < dataRegions.size() && dataRegions[data].start < upTo; data++) {
+                    out << std::endl << Hex(dataRegions[data].start, 3) << ": data (" << dataRegions[data].kind << ")" << std::endl;
+                    for (unsigned int address = dataRegions[data].start; address < dataRegions[data].end; address += 8) {
+                        out << "    " << Hex(address, 4) << " ";
+                        for (unsigned int i = address; i < std::min(address + 8, dataRegions[data].end); i++) {
+                            out << " " << Hex(rom[i - 0x200], 2).substr(2);
+                        }
+                        out << std::endl;
+                    }
+                }
+                if (b == blocks.size()) {
+                    break;
+                }
+                const Block& block = blocks[b];
+                out << std::endl << Hex(block.start, 3) << ":" << std::endl;
+                for (size_t i = block.first; i < block.first + block.count; i++) {
+                    const Instruction& instruction = instructions[i];
+                    std::string bytes;
+                    for (unsigned int j = 0; j < instruction.length; j += 2) {
+                        bytes += Hex(rom[instruction.address + j - 0x200] << 8 | rom[instruction.address + j + 1 - 0x200], 4).substr(2) + " ";
+                    }
+                    bytes.resize(10, ' ');
+                    out << "    " << Hex(instruction.address, 4) << "  " << bytes << instruction.text << std::endl;
+                }
+                out << "    ->";
+                for (unsigned int successor : block.successors) {
+                    out << " " << Hex(successor, 3);
+                }
+                const Instruction& last = instructions[block.first + block.count - 1];
+                out << (last.flow == Flow::Return ? " (return)" : last.flow == Flow::Indirect ? " (and wherever else the register takes it)" : "")
+                    << (block.successors.empty() && last.flow != Flow::Return ? " (nowhere)" : "") << std::endl;
+            }
+        };
+
+    private:
+
+        std::vector<unsigned char> rom;
+        bool usesSuperChip = false;
+        bool usesXoChip = false;
+
+        static std::string Hex(unsigned int value, int digits) {
+            std::ostringstream text;
+            text << "0x" << std::hex << std::setw(digits) << std::setfill('0') << value;
+            return text.str();
+        };
+
+        const Instruction* Find(unsigned int address) const {
+            auto found = std::lower_bound(instructions.begin(), instructions.end(), address,
+                                          [](const Instruction& instruction, unsigned int value) { return instruction.address < value; });
+            return &*found;
+        };
+
+        static void PrintAddresses(std::ostream& out, const char* what, const std::vector<unsigned int>& addresses) {
+            if (addresses.empty()) {
+                return;
+            }
+            out << "  " << what << ":";
+            for (size_t i = 0; i < addresses.size() && i < 16; i++) {
+                out << " " << Hex(addresses[i], 3);
+            }
+            if (addresses.size() > 16) {
+                out << " and " << addresses.size() - 16 << " more";
+            }
+            out << std::endl;
+        };
+
+        template <typename Core>
+        static std::string Describe(const typename Core::DecodedInstruction& op, unsigned int longAddress) {
+            // the instruction written out like Cowgod's reference does. in the formats %x and %y are the registers, %n the
+            // low nibble, %p the second one as a number, %k the low byte, %a the address and %l the address after F000
+            typedef typename Core::OpcodeHandler Handler;
+            static const std::pair<Handler, const char*> formats[] = {
+                { Core::OpClearScreen, "CLS" }, { Core::OpReturn, "RET" }, { Core::OpJump, "JP %a" }, { Core::OpCall, "CALL %a" },
+                { Core::OpSkipEqualByte, "SE %x, %k" }, { Core::OpSkipNotEqualByte, "SNE %x, %k" }, { Core::OpSkipEqualRegister, "SE %x, %y" },
+                { Core::OpLoadByte, "LD %x, %k" }, { Core::OpAddByte, "ADD %x, %k" }, { Core::OpLoadRegister, "LD %x, %y" },
+                { Core::OpOr, "OR %x, %y" }, { Core::OpAnd, "AND %x, %y" }, { Core::OpXor, "XOR %x, %y" }, { Core::OpAddRegister, "ADD %x, %y" },
+                { Core::OpSub, "SUB %x, %y" }, { Core::OpShiftRight, "SHR %x, %y" }, { Core::OpSubN, "SUBN %x, %y" }, { Core::OpShiftLeft, "SHL %x, %y" },
+                { Core::OpSkipNotEqualRegister, "SNE %x, %y" }, { Core::OpLoadIndex, "LD I, %a" }, { Core::OpRandom, "RND %x, %k" },
+                { Core::OpDraw, "DRW %x, %y, %n" }, { Core::OpSkipKeyPressed, "SKP %x" }, { Core::OpSkipKeyNotPressed, "SKNP %x" },
+                { Core::OpLoadDelayTimer, "LD %x, DT" }, { Core::OpWaitForKey, "LD %x, K" }, { Core::OpSetDelayTimer, "LD DT, %x" },
+                { Core::OpSetSoundTimer, "LD ST, %x" }, { Core::OpAddIndex, "ADD I, %x" }, { Core::OpLoadFont, "LD F, %x" },
+                { Core::OpStoreBcd, "LD B, %x" }, { Core::OpStoreRegisters, "LD [I], %x" }, { Core::OpLoadRegisters, "LD %x, [I]" },
+                { Core::OpScrollDown, "SCD %n" }, { Core::OpScrollUp, "SCU %n" }, { Core::OpScrollRight, "SCR" }, { Core::OpScrollLeft, "SCL" },
+                { Core::OpExit, "EXIT" }, { Core::OpLowResolution, "LOW" }, { Core::OpHighResolution, "HIGH" },
+                { Core::OpStoreRegisterRange, "SAVE %x - %y" }, { Core::OpLoadRegisterRange, "LOAD %x - %y" }, { Core::OpLoadLongIndex, "LD I, long %l" },
+                { Core::OpSelectPlanes, "PLANE %p" }, { Core::OpLoadAudioPattern, "AUDIO" }, { Core::OpSetPitch, "PITCH %x" },
+                { Core::OpLoadBigFont, "LD HF, %x" }, { Core::OpSaveFlags, "LD R, %x" }, { Core::OpLoadFlags, "LD %x, R" },
+            };
+            const char* format = "DW %o";
+            if (op.handler == Core::OpNothing && (op.opcode >> 12) == 0x0 && op.opcode != 0x0000) {
+                format = "SYS %a";
+            }
+            else if (op.handler == Core::OpJumpV0) {
+                format = Core::Quirks::jumpUsesVx ? "JP %x, %a" : "JP V0, %a";
+            }
+            for (const auto& [handler, handlerFormat] : formats) {
+                if (op.handler == handler) {
+                    format = handlerFormat;
+                }
+            }
+
+            const char* registers = "0123456789ABCDEF";
+            std::string text;
+            for (const char* c = format; *c != '\0'; c++) {
+                if (*c != '%') {
+                    text += *c;
+                    continue;
+                }
+                switch (*++c) {
+                    case 'x': text += std::string("V") + registers[op.x]; break;
+                    case 'y': text += std::string("V") + registers[op.y]; break;
+                    case 'n': text += std::to_string(op.n); break;
+                    case 'p': text += std::to_string(op.x); break;
+                    case 'k': text += Hex(op.kk, 2); break;
+                    case 'a': text += Hex(op.nnn, 3); break;
+                    case 'l': text += Hex(longAddress, 4); break;
+                    case 'o': text += Hex(op.opcode, 4); break;
+                }
+            }
+            return text;
+        };
+
+        template <typename Quirks>
+        bool AnalyzeAs() {
+            typedef Chip8Core<Quirks> Core;
+            typedef typename Core::DecodedInstruction Decoded;
+            const unsigned int start = 0x200;
+            const unsigned int end = start + static_cast<unsigned int>(rom.size());
+            if (end > Core::memorySize) {
+                // too big for this profile's memory, LoadProgram would refuse it too
+                return false;
+            }
+
+            metadata.profile = std::is_same<Quirks, XoChipQuirks>::value ? Chip8Profile::XoChip
+                             : std::is_same<Quirks, SuperChipQuirks>::value ? Chip8Profile::SuperChip : Chip8Profile::Vip;
+            metadata.blocks.clear();
+            metadata.idleLoops.clear();
+            metadata.dataRegions.clear();
+            metadata.selfModifying.clear();
+            instructions.clear();
+            blocks.clear();
+            loops.clear();
+            subroutines.clear();
+            stopped.clear();
+            indirectJumps.clear();
+            leavesRom.clear();
+            unknownStores = 0;
+            usesSuperChip = false;
+            usesXoChip = false;
+
+            // what we know about each byte of the ROM
+            enum : unsigned char { codeByte = 1, instructionStart = 2, leader = 4, spriteByte = 8, storedByte = 16, loadedByte = 32, audioByte = 64 };
+            std::vector<unsigned char> flags(end, 0);
+            auto inRom = [&](unsigned int address, unsigned int length) {
+                return address >= start && address + length <= end;
+            };
+            auto mark = [&](unsigned int address, unsigned int length, unsigned char flag) {
+                for (unsigned int i = 0; i < length; i++) {
+                    unsigned int byte = (address + i) & Core::memoryMask;
+                    if (byte >= start && byte < end) {
+                        flags[byte] |= flag;
+                    }
+                }
+            };
+            auto opcodeAt = [&](unsigned int address) -> unsigned short {
+                return rom[address - start] << 8 | rom[address + 1 - start];
+            };
+
+            struct Store {
+                unsigned int at;
+                unsigned int target;
+                unsigned int length;
+            };
+            std::vector<Store> stores;
+            std::map<unsigned int, Instruction> found;
+            std::vector<unsigned int> pending = { start };
+            flags[start] |= leader;
+
+            auto branchTo = [&](Instruction& instruction, unsigned int target) {
+                if (!inRom(target, 2)) {
+                    leavesRom.push_back(instruction.address);
+                    return;
+                }
+                instruction.next.push_back(target);
+                flags[target] |= leader;
+                pending.push_back(target);
+            };
+
+            while (!pending.empty()) {
+                // follow one path in a straight line until it branches away or gets somewhere we've already been
+                unsigned int address = pending.back();
+                pending.pop_back();
+                bool indexKnown = false;
+                unsigned int index = 0;
+                unsigned int planes = 1;
+                bool afterSkip = false;
+                while (inRom(address, 2) && !(flags[address] & instructionStart)) {
+                    Decoded op = Core::Decode(opcodeAt(address));
+                    Instruction instruction;
+                    instruction.address = address;
+                    unsigned int longAddress = 0;
+                    bool cutShort = false; // F000 with the end of the ROM where its address should be
+                    if (op.handler == Core::OpLoadLongIndex) {
+                        cutShort = !inRom(address, 4);
+                        instruction.length = cutShort ? 2 : 4;
+                        longAddress = cutShort ? 0 : opcodeAt(address + 2);
+                    }
+                    instruction.text = Describe<Core>(op, longAddress);
+                    flags[address] |= instructionStart;
+                    mark(address, instruction.length, codeByte);
+                    unsigned int following = address + instruction.length;
+
+                    bool isReal = op.handler != Core::OpUnknown && op.opcode != 0x0000 && !(op.handler == Core::OpNothing && (op.opcode >> 12) == 0xF)
+                               && !cutShort;
+                    bool isSkip = op.handler == Core::OpSkipEqualByte || op.handler == Core::OpSkipNotEqualByte
+                               || op.handler == Core::OpSkipEqualRegister || op.handler == Core::OpSkipNotEqualRegister
+                               || op.handler == Core::OpSkipKeyPressed || op.handler == Core::OpSkipKeyNotPressed;
+                    bool movesIndex = false;
+                    usesXoChip = usesXoChip || op.handler == Core::OpScrollUp || op.handler == Core::OpStoreRegisterRange
+                              || op.handler == Core::OpLoadRegisterRange || op.handler == Core::OpLoadLongIndex
+                              || op.handler == Core::OpSelectPlanes || op.handler == Core::OpLoadAudioPattern || op.handler == Core::OpSetPitch;
+                    usesSuperChip = usesSuperChip || op.handler == Core::OpScrollDown || op.handler == Core::OpScrollRight
+                                 || op.handler == Core::OpScrollLeft || op.handler == Core::OpExit || op.handler == Core::OpLowResolution
+                                 || op.handler == Core::OpHighResolution || op.handler == Core::OpLoadBigFont
+                                 || op.handler == Core::OpSaveFlags || op.handler == Core::OpLoadFlags;
+
+                    // where the data is, from what gets done with I
+                    auto store = [&](unsigned int length) {
+                        if (!indexKnown) {
+                            unknownStores++;
+                            return;
+                        }
+                        stores.push_back({ address, index & Core::memoryMask, length });
+                        mark(index, length, storedByte);
+                    };
+                    if (op.handler == Core::OpLoadIndex) {
+                        indexKnown = true;
+                        index = op.nnn;
+                        movesIndex = true;
+                    }
+                    else if (op.handler == Core::OpLoadLongIndex) {
+                        indexKnown = true;
+                        index = longAddress;
+                        movesIndex = true;
+                    }
+                    else if (op.handler == Core::OpDraw && indexKnown) {
+                        // Dxy0 is a 16 x 16 sprite (two bytes a row) on SUPER-CHIP and nothing at all on a VIP
+                        unsigned int bytes = (op.n == 0) ? (Quirks::hasSuperChip ? 32 : 0) : op.n;
+                        mark(index, bytes * planes, spriteByte);
+                    }
+                    else if (op.handler == Core::OpStoreBcd) {
+                        store(3);
+                    }
+                    else if (op.handler == Core::OpStoreRegisters || op.handler == Core::OpLoadRegisters) {
+                        if (op.handler == Core::OpStoreRegisters) {
+                            store(op.x + 1);
+                        }
+                        else if (indexKnown) {
+                            mark(index, op.x + 1, loadedByte);
+                        }
+                        if (Quirks::loadStoreIncrementsI) {
+                            index += op.x + 1;
+                            movesIndex = true;
+                        }
+                    }
+                    else if (op.handler == Core::OpStoreRegisterRange) {
+                        store((op.x > op.y ? op.x - op.y : op.y - op.x) + 1);
+                    }
+                    else if (op.handler == Core::OpLoadRegisterRange && indexKnown) {
+                        mark(index, (op.x > op.y ? op.x - op.y : op.y - op.x) + 1, loadedByte);
+                    }
+                    else if (op.handler == Core::OpLoadAudioPattern && indexKnown) {
+                        mark(index, 16, audioByte);
+                    }
+                    else if (op.handler == Core::OpSelectPlanes) {
+                        planes = static_cast<unsigned int>(std::bitset<4>(op.x & 0x3).count());
+                    }
+                    else if (op.handler == Core::OpAddIndex || op.handler == Core::OpLoadFont || op.handler == Core::OpLoadBigFont) {
+                        indexKnown = false;
+                    }
+                    if (movesIndex && afterSkip) {
+                        // it might not have run, so either value of I could be the right one from here on
+                        indexKnown = false;
+                    }
+                    afterSkip = isSkip;
+
+                    // where it goes next
+                    bool carryOn = true;
+                    if (!isReal) {
+                        // nearly always data we've wandered into, so stop rather than decode a run of nonsense
+                        instruction.flow = Flow::Stop;
+                        stopped.push_back(address);
+                        carryOn = false;
+                    }
+                    else if (op.handler == Core::OpJump) {
+                        instruction.flow = Flow::Jump;
+                        branchTo(instruction, op.nnn);
+                        carryOn = false;
+                    }
+                    else if (op.handler == Core::OpCall) {
+                        instruction.flow = Flow::Call;
+                        branchTo(instruction, op.nnn);
+                        if (inRom(op.nnn, 2)) {
+                            subroutines.push_back(op.nnn);
+                        }
+                        // the subroutine might change I, so it's lost when we come back
+                        indexKnown = false;
+                    }
+                    else if (op.handler == Core::OpReturn || op.handler == Core::OpExit) {
+                        instruction.flow = Flow::Return;
+                        carryOn = false;
+                    }
+                    else if (op.handler == Core::OpJumpV0) {
+                        // nnn is the start of a table that a register picks from. if the table is a row of jumps follow them all,
+                        // otherwise just the first entry
+                        instruction.flow = Flow::Indirect;
+                        indirectJumps.push_back(address);
+                        unsigned int entry = op.nnn;
+                        branchTo(instruction, entry);
+                        while (inRom(entry, 2) && (opcodeAt(entry) >> 12) == 0x1 && inRom(entry + 2, 2) && (opcodeAt(entry + 2) >> 12) == 0x1) {
+                            entry += 2;
+                            branchTo(instruction, entry);
+                        }
+                        carryOn = false;
+                    }
+                    else if (isSkip) {
+                        // both the next instruction and the one after it. on XO-CHIP that one's further on if the next is F000 nnnn
+                        instruction.flow = Flow::Skip;
+                        unsigned int skipTo = following + 2;
+                        if (Quirks::hasXoChip && inRom(following, 2) && opcodeAt(following) == 0xF000) {
+                            skipTo += 2;
+                        }
+                        if (inRom(following, 2)) {
+                            instruction.next.push_back(following);
+                        }
+                        branchTo(instruction, skipTo);
+                    }
+
+                    if (carryOn && !inRom(following, 2)) {
+                        // runs off the end of the ROM into whatever's in memory after it
+                        leavesRom.push_back(address);
+                        carryOn = false;
+                    }
+                    else if (carryOn && instruction.flow != Flow::Skip) {
+                        instruction.next.push_back(following);
+                    }
+
+                    // the bits of an idle loop: reading the delay timer, looking at the keys, and skips and jumps that only
+                    // look at registers
+                    instruction.idleSafe = isSkip || op.handler == Core::OpJump || op.handler == Core::OpLoadDelayTimer || op.handler == Core::OpWaitForKey;
+                    if (op.handler == Core::OpLoadDelayTimer) {
+                        instruction.waitsOn = "timer";
+                    }
+                    else if (op.handler == Core::OpSkipKeyPressed || op.handler == Core::OpSkipKeyNotPressed || op.handler == Core::OpWaitForKey) {
+                        instruction.waitsOn = "key";
+                    }
+
+                    found[address] = std::move(instruction);
+                    if (!carryOn) {
+                        break;
+                    }
+                    address = following;
+                }
+            }
+
+            for (auto& [address, instruction] : found) {
+                instructions.push_back(std::move(instruction));
+            }
+
+            // basic blocks. one ends at a branch, just before a branch target, or where the code stops being one straight run
+            bool startBlock = true;
+            for (size_t i = 0; i < instructions.size(); i++) {
+                const Instruction& instruction = instructions[i];
+                if (startBlock) {
+                    blocks.push_back(Block());
+                    blocks.back().start = instruction.address;
+                    blocks.back().first = i;
+                }
+                Block& block = blocks.back();
+                block.count++;
+                startBlock = i + 1 == instructions.size() || instruction.flow != Flow::Next
+                          || instructions[i + 1].address != instruction.address + instruction.length
+                          || (flags[instructions[i + 1].address] & leader);
+                if (startBlock) {
+                    block.end = instruction.address + instruction.length;
+                    block.successors = instruction.next;
+                    metadata.blocks.push_back({ block.start, block.end, "" });
+                }
+            }
+
+            // loops are backward jumps. an idle one is a short straight run of nothing but the idle instructions
+            for (const Block& block : blocks) {
+                const Instruction& jump = instructions[block.first + block.count - 1];
+                if (jump.flow != Flow::Jump || jump.next.empty() || jump.next[0] > jump.address) {
+                    continue;
+                }
+                Loop loop;
+                loop.start = jump.next[0];
+                loop.end = jump.address + jump.length;
+                const Instruction* top = Find(loop.start);
+                bool straight = true;
+                bool idleSafe = true;
+                bool key = false;
+                bool timer = false;
+                for (const Instruction* at = top; at <= &jump; at++) {
+                    loop.instructions++;
+                    straight = straight && (at == &jump || (at + 1)->address == at->address + at->length);
+                    idleSafe = idleSafe && at->idleSafe;
+                    key = key || at->waitsOn == "key";
+                    timer = timer || at->waitsOn == "timer";
+                }
+                if (straight && idleSafe && loop.instructions <= 8) {
+                    loop.idleKind = key ? "key" : timer ? "timer" : "halt";
+                    metadata.idleLoops.push_back({ loop.start, loop.end, loop.idleKind });
+                }
+                loops.push_back(loop);
+            }
+            for (const Instruction& instruction : instructions) {
+                if (instruction.flow == Flow::Next && instruction.waitsOn == "key") {
+                    // Fx0A is an idle loop all on its own
+                    metadata.idleLoops.push_back({ instruction.address, instruction.address + instruction.length, "key" });
+                }
+            }
+            std::sort(metadata.idleLoops.begin(), metadata.idleLoops.end(),
+                      [](const RomMetadata::Range& a, const RomMetadata::Range& b) { return a.start < b.start; });
+
+            // everything that isn't code is data, named after the most telling thing done with it
+            for (unsigned int address = start; address < end; address++) {
+                if (flags[address] & codeByte) {
+                    continue;
+                }
+                const char* kind = (flags[address] & spriteByte) ? "sprite" : (flags[address] & audioByte) ? "audio"
+                                 : (flags[address] & storedByte) ? "variables" : (flags[address] & loadedByte) ? "table" : "unknown";
+                std::vector<RomMetadata::Range>& dataRegions = metadata.dataRegions;
+                if (!dataRegions.empty() && dataRegions.back().end == address && dataRegions.back().kind == kind) {
+                    dataRegions.back().end++;
+                }
+                else {
+                    dataRegions.push_back({ address, address + 1, kind });
+                }
+            }
+
+            // writes that land on code we found
+            for (const Store& write : stores) {
+                for (unsigned int i = 0; i < write.length; i++) {
+                    unsigned int byte = (write.target + i) & Core::memoryMask;
+                    if (byte >= start && byte < end && (flags[byte] & codeByte)) {
+                        metadata.selfModifying.push_back({ write.at, write.target });
+                        break;
+                    }
+                }
+            }
+
+            for (std::vector<unsigned int>* addresses : { &subroutines, &stopped, &indirectJumps, &leavesRom }) {
+                std::sort(addresses->begin(), addresses->end());
+                addresses->erase(std::unique(addresses->begin(), addresses->end()), addresses->end());
+            }
+            return true;
+        };
+};
@@ -0,0 +1,268 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <filesystem>
+#include <algorithm>
+
+#include "chip8.h"
+#include "jit_x64.h"
+#include "analyzer.h"
+
+/*
+    A very small work stealing thread pool for running a fixed list of jobs to completion.
+
+    Every worker gets its own queue and the jobs are dealt out between them up front. A worker takes jobs from the back of its
+    own queue and when that runs dry it goes round the other workers taking jobs from the front of theirs. That way nobody sits
+    idle while one thread is stuck with all the slow ROMs, and the workers hardly ever touch the same queue at the same time.
+*/
+class WorkStealingPool
+{
+    struct WorkerQueue {
+        std::mutex lock;
+        std::deque<std::function<void(unsigned int)>> jobs;
+    };
+
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+
+    public:
+
+        // runs every job and only returns once they've all finished. each job is told which worker is running it
+        // so it can use per worker scratch (a jit for example) without any locking
+        void RunAll(std::vector<std::function<void(unsigned int)>> jobs, unsigned int threadCount) {
+            threadCount = std::max(1u, threadCount);
+            queues.clear();
+            for (unsigned int i = 0; i < threadCount; i++) {
+                queues.push_back(std::make_unique<WorkerQueue>());
+            }
+            for (size_t i = 0; i < jobs.size(); i++) {
+                queues[i % threadCount]->jobs.push_back(std::move(jobs[i]));
+            }
+
+            std::vector<std::thread> workers;
+            for (unsigned int i = 0; i < threadCount; i++) {
+                workers.emplace_back([this, i]() { WorkerLoop(i); });
+            }
+            for (std::thread& worker : workers) {
+                worker.join();
+            }
+        };
+
+    private:
+
+        void WorkerLoop(unsigned int self) {
+            std::function<void(unsigned int)> job;
+            while (TakeOwn(self, job) || Steal(self, job)) {
+                job(self);
+            }
+            // nothing left anywhere. no new jobs ever get added once we've started so we can just stop
+        };
+
+        bool TakeOwn(unsigned int self, std::function<void(unsigned int)>& job) {
+            WorkerQueue& queue = *queues[self];
+            std::lock_guard<std::mutex> guard(queue.lock);
+            if (queue.jobs.empty()) {
+                return false;
+            }
+            job = std::move(queue.jobs.back());
+            queue.jobs.pop_back();
+            return true;
+        };
+
+        bool Steal(unsigned int self, std::function<void(unsigned int)>& job) {
+            for (size_t offset = 1; offset < queues.size(); offset++) {
+                WorkerQueue& victim = *queues[(self + offset) % queues.size()];
+                std::lock_guard<std::mutex> guard(victim.lock);
+                if (!victim.jobs.empty()) {
+                    job = std::move(victim.jobs.front());
+                    victim.jobs.pop_front();
+                    return true;
+                }
+            }
+            return false;
+        };
+};
+
+/*
+    Runs a whole set of ROMs headless, each in its own Chip8, spread over every core on the machine.
+
+    The ROM list is either a directory (every .ch8, .sc8, .schip and .xo8 in it) or a manifest file with one ROM per line,
+    optionally followed by how many instructions to run it for:
+
+        programs/snek.ch8 5000000
+        programs/IBM Logo.ch8
+
+    Lines starting with # are ignored and relative paths are relative to the manifest. Each ROM gets the quirk profile its
+    file extension suggests (see GuessChip8Profile) unless one is forced for the whole batch. A ROM that's been through
+    --analyze gets the profile (and instructions per frame, if it has one) from its metadata instead, and starts with all
+    of its code already in the decode cache. --batch itself goes through a RomCorpus (corpus.h), which hands every job its
+    ROM already in memory along with its metadata.
+*/
+class BatchRunner
+{
+    public:
+
+        struct Job {
+            std::string path;
+            unsigned long long cycles = 0;
+            // a ROM that's already in memory (see RomCorpus) is copied from here, and then the path is only its name
+            const unsigned char* data = nullptr;
+            size_t size = 0;
+            const RomMetadata* metadata = nullptr; // what the corpus knows about it
+        };
+
+        struct Result {
+            std::string path;
+            bool loaded = false;
+            unsigned long long instructions = 0;
+            double wallMs = 0;
+            uint64_t stateHash = 0;
+        };
+
+        unsigned long long defaultCycles = 10000000;
+        unsigned int instructionsPerFrame = 11;
+        bool forceInstructionsPerFrame = false; // use `instructionsPerFrame` even for ROMs whose metadata says otherwise
+        unsigned int threadCount = std::max(1u, std::thread::hardware_concurrency());
+        bool useJit = false;
+        uint64_t seed = 0; // every ROM gets the same random numbers so the state hashes can be compared between runs
+        bool forceProfile = false; // run every ROM with `profile` instead of guessing from its file name
+        Chip8Profile profile = Chip8Profile::Vip;
+        Chip8Dispatch dispatch = Chip8Dispatch::DecodeCache; // how the interpreter runs, when the jit isn't
+
+        static std::vector<Job> LoadJobs(const std::string& source, unsigned long long defaultCycles) {
+            std::vector<Job> jobs;
+            std::error_code error;
+            if (std::filesystem::is_directory(source, error)) {
+                for (const auto& entry : std::filesystem::directory_iterator(source, error)) {
+                    if (entry.is_regular_file() && IsChip8RomPath(entry.path().string())) {
+                        jobs.push_back({ entry.path().string(), defaultCycles });
+                    }
+                }
+                // directory order isn't guaranteed so sort to keep the output stable from run to run
+                std::sort(jobs.begin(), jobs.end(), [](const Job& a, const Job& b) { return a.path < b.path; });
+                return jobs;
+            }
+
+            std::ifstream manifest(source);
+            std::filesystem::path base = std::filesystem::path(source).parent_path();
+            std::string line;
+            while (std::getline(manifest, line)) {
+                if (line.empty() || line[0] == '#') {
+                    continue;
+                }
+                // the cycle count is optional and comes last, so anything before it is the path (which may have spaces in it)
+                Job job{ line, defaultCycles };
+                size_t lastSpace = line.find_last_of(' ');
+                if (lastSpace != std::string::npos && line.find_first_not_of("0123456789", lastSpace + 1) == std::string::npos
+                    && lastSpace + 1 < line.size()) {
+                    job.path = line.substr(0, lastSpace);
+                    job.cycles = std::stoull(line.substr(lastSpace + 1));
+                }
+                std::filesystem::path path = job.path;
+                if (path.is_relative()) {
+                    job.path = (base / path).string();
+                }
+                jobs.push_back(job);
+            }
+            return jobs;
+        };
+
+        std::vector<Result> Run(const std::vector<Job>& jobs) {
+            std::vector<Result> results(jobs.size());
+
+            // one jit per worker thread. the jit caches blocks by address so it gets flushed between ROMs
+            std::vector<std::unique_ptr<Chip8Jit>> jits;
+            if (useJit) {
+                for (unsigned int i = 0; i < threadCount; i++) {
+                    jits.push_back(std::make_unique<Chip8Jit>());
+                }
+            }
+
+            std::vector<std::function<void(unsigned int)>> work;
+            for (size_t i = 0; i < jobs.size(); i++) {
+                work.push_back([this, &jobs, &results, &jits, i](unsigned int worker) {
+                    Chip8Jit* jit = useJit ? jits[worker].get() : nullptr;
+                    results[i] = RunOne(jobs[i], jit);
+                });
+            }
+
+            WorkStealingPool pool;
+            pool.RunAll(std::move(work), threadCount);
+            return results;
+        };
+
+        static void PrintResults(const std::vector<Result>& results) {
+            // one line per ROM, comma separated so it drops straight into a spreadsheet or a diff
+            std::cout << "rom,status,instructions,wall_ms,state_hash" << std::endl;
+            for (const Result& result : results) {
+                std::cout << result.path << ","
+                          << (result.loaded ? "ok" : "load_failed") << ","
+                          << result.instructions << ","
+                          << std::fixed << std::setprecision(3) << result.wallMs << ","
+                          << std::hex << std::setw(16) << std::setfill('0') << result.stateHash
+                          << std::dec << std::setfill(' ') << std::endl;
+            }
+        };
+
+    private:
+
+        Result RunOne(const Job& job, Chip8Jit* jit) const {
+            Result result;
+            result.path = job.path;
+
+            auto start = std::chrono::steady_clock::now();
+            // a corpus hands us the metadata, a ROM on its own might have a .c8meta next to it
+            RomMetadata loaded;
+            const RomMetadata* metadata = job.metadata;
+            if (job.data == nullptr && loaded.LoadFor(job.path)) {
+                metadata = &loaded;
+            }
+            // the chip8 is too big to want lots of them on worker thread stacks so it goes on the heap
+            AnyChip8 chip8 = CreateChip8(forceProfile ? profile : (metadata != nullptr) ? metadata->profile : GuessChip8Profile(job.path));
+            std::visit([&](auto& core) { RunCore(*core, job, jit, metadata, result); }, chip8);
+            auto end = std::chrono::steady_clock::now();
+            result.wallMs = std::chrono::duration<double, std::milli>(end - start).count();
+            return result;
+        };
+
+        template <typename Core>
+        void RunCore(Core& chip8, const Job& job, Chip8Jit* jit, const RomMetadata* metadata, Result& result) const {
+            chip8.Initialize();
+            chip8.Seed(seed);
+            chip8.SetDispatch(dispatch);
+            result.loaded = (job.data != nullptr) ? chip8.LoadProgram(job.data, job.size) : chip8.LoadProgram(job.path);
+            if (result.loaded) {
+                if (jit != nullptr) {
+                    jit->Flush();
+                }
+                unsigned int framePace = instructionsPerFrame;
+                if (metadata != nullptr) {
+                    metadata->Prewarm(chip8);
+                    if (metadata->instructionsPerFrame > 0 && !forceInstructionsPerFrame) {
+                        framePace = metadata->instructionsPerFrame;
+                    }
+                }
+                unsigned long long nextTimerTick = framePace;
+                while (result.instructions < job.cycles) {
+                    unsigned long long chunk = std::min(nextTimerTick, job.cycles) - result.instructions;
+                    result.instructions += (jit != nullptr) ? jit->RunFor(chip8, chunk) : chip8.RunFor(chunk);
+                    while (result.instructions >= nextTimerTick) {
+                        chip8.TickTimers();
+                        nextTimerTick += framePace;
+                    }
+                }
+                result.stateHash = chip8.StateHash();
+            }
+        };
+};
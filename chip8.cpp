@@ -1,546 +1,711 @@
-#include <string>
-#include <SDL2/SDL.h>
-#include <filesystem>
-#include <vector>
-#include <iostream>
-#include <fstream>
-#include <random>
-
-// a class for our chip8
-class Chip8 
-{
-    // we need somewhere to store our current opcode. 
-    unsigned short currentOpcode = 0;
-
-    /*  
-        We need some memory allocated to our chip8
-        the chip 8 has 4096 bytes of memory. 
-        The memory  in location 0x000 to 0x1ff (0-511) is saved for the interpreter but in our case we shall use it for font storage
-        This will matter when we write the function to load our program. We need to make sure to load it into the correct bit of memory 
-    */
-    unsigned char memory[4096] = { 0 };
-
-    /*
-        The chip8 has a display of resolution 64 x 32 and is monochrome. 
-        THe way sprites are drawn to the display involves XORing the sprite with the current display buffer so need to pick a datatype that will play nicely with that.
-        Ideally I can just use a bit. perhaps there is a c++ option for that. Turns out you cannot work with single bits in c++ so smallest we can do is one byte. char will have to do. 
-    */
-    unsigned int display[64 * 32] = { 0 }; // 2048 bits stored as integers where 1 is on and 0 is off
-    SDL_Window* window = nullptr; // window to draw to
-    SDL_Renderer* renderer = nullptr; // renderer to draw with
-    
-    /*
-        The program counter which points to the currenty instruction in memory. This is then always just a memory address. i.e. an integer between 0 and 4095 (since that's the size memory we have)
-    */
-    unsigned short programCounter = 0;
-    
-    /*
-        The index register is a 16 bit register that is used for operations related to reading and writing memory. 
-    */
-    unsigned short indexRegister = 0;
-
-    /*
-        General purpose variable regsiters. Each 2 bytes long. There are 16 of them lablled V0 to VF with VF being used as a flag resister
-    */
-
-    unsigned short vRegister[16] = {0};
-
-    unsigned char delayTimer = 0;
-
-    unsigned char soundTimer = 0;
-
-    /*
-        We also need a stack so that we can enable subroutines and jumping
-    */
-
-    unsigned short stack[16] = { 0 };
-    unsigned short stackPointer = 0;
-
-    /*
-        And finally a variable to store which keys are currently being pressed. The chip8 has 16 keys labelled 0-F
-    */
-
-    unsigned char key[16] = { 0 };
-
-    unsigned int disp_index = 0;
-
-    // Chip 8 Methods
-    public:
-
-        void Initialize(){
-            // initialise all the registers and memory once the chip8 is created.
-            InitialiseGraphics();
-            InitialiseFont();            
-            programCounter = 0x200; // start at the beginning of the program memory
-
-        };
-
-        void LoadProgram(std::string program_path) {
-            // load the specified program into memory location 0x200
-            std::filesystem::path path = program_path;
-            auto length = std::filesystem::file_size(path);
-            if (length == 0 || length > 4096 - 512) {
-                // file is too big or too small
-                return;
-            }
-            std::vector<std::byte> buffer(length);
-            std::ifstream inputFile(program_path, std::ios::binary);
-            inputFile.read(reinterpret_cast<char*>(buffer.data()), length);
-            inputFile.close();
-
-            // load buffer into memory starting at 0x200
-            for (int i = 0; i < length; i++) {
-                memory[i + 0x200] = static_cast<unsigned char>(buffer[i]);
-            }
-        };
-
-        void Run() {
-            float gpu_update = 0;
-            float step_update = 0;
-            float previous_time = SDL_GetTicks();
-            
-            // main loop
-            while (true) {
-                //store key press state
-                std::cout << "Handling input" << std::endl;
-                HandleInput(true);
-                
-
-                // run the next instruction (this needs to happen 700 times a second)
-                if (step_update > 1.0f / 700.0f) {
-                    std::cout << "RUnning step" << std::endl;
-                    Step();
-                    step_update = 0;
-                    delayTimer = (delayTimer > 0) ? delayTimer - 1 : 0;
-                    soundTimer = (soundTimer > 0) ? soundTimer - 1 : 0;
-                }
-                
-                // draw the display (need to do this only 60 times a second)
-                if (gpu_update > 1.0f / 60.0f) {
-                    std::cout << "Drawing graphics" << std::endl;
-                    DrawGraphics();                    
-                    gpu_update = 0;
-                }
-                
-                // update timers
-                std::cout << "Updating timers" << std::endl;
-                float delta_t = (SDL_GetTicks() - previous_time) / 1000.0f;
-                
-                previous_time = SDL_GetTicks(); //update previous time for next tick
-                step_update += delta_t;
-                gpu_update += delta_t;
-                std::cout << "loop over" << std::endl;    
-            }
-        };
-        
-
-    private:
-
-        void HandleInput(bool debug=false) {
-            SDL_Event event;
-            while (SDL_PollEvent(&event)) {
-                if (event.type == SDL_QUIT) {
-                    exit(0);
-                }
-                else if (event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) {
-                    int isPressed = (event.type == SDL_KEYDOWN) ? 1 : 0;
-                    switch (event.key.keysym.sym) {
-                                    case SDLK_1: key[0x1] = isPressed; break;
-                                    case SDLK_2: key[0x2] = isPressed; break;
-                                    case SDLK_3: key[0x3] = isPressed; break;
-                                    case SDLK_4: key[0xC] = isPressed; break;
-                                    case SDLK_q: key[0x4] = isPressed; break;
-                                    case SDLK_w: key[0x5] = isPressed; break;
-                                    case SDLK_e: key[0x6] = isPressed; break;
-                                    case SDLK_r: key[0xD] = isPressed; break;
-                                    case SDLK_a: key[0x7] = isPressed; break;
-                                    case SDLK_s: key[0x8] = isPressed; break;
-                                    case SDLK_d: key[0x9] = isPressed; break;
-                                    case SDLK_f: key[0xE] = isPressed; break;
-                                    case SDLK_z: key[0xA] = isPressed; break;
-                                    case SDLK_x: key[0x0] = isPressed; break;
-                                    case SDLK_c: key[0xB] = isPressed; break;
-                                    case SDLK_v: key[0xF] = isPressed; break;
-                    }
-                }
-                if (debug) {
-                    // debug print the current key status
-                    char output[17];
-                    for (int i = 0; i < 16; i++) {
-                        output[i] = key[i] ? '1' : '0';
-                    }
-                    output[16] = '\0'; // null terminate the string so we don't get random crap   
-                    std::cout << output << std::endl;
-                }
-            }
-        }
-
-        // random byte generator function
-        unsigned char RandomByte() {
-            std::random_device rd;
-            std::mt19937 gen(rd()); // using the mt19937 generator
-             // generate a random number between 0 and 255
-             // remembering that a byte is effectively any number betwwen 0 and 255
-             // since 2^8 = 256
-            std::uniform_int_distribution<> dis(0, 255);
-            // generaqte a number and cast it to an unsigned char
-            return static_cast<unsigned char>(dis(gen));
-        }
-
-        void InitialiseGraphics() {
-            // draw empty display to the screen            
-            // initialise graphics and events
-            SDL_Init(SDL_INIT_VIDEO | SDL_INIT_EVENTS);
-            SDL_CreateWindowAndRenderer(64 * 10, 32 * 10, 0, &window, &renderer);
-            SDL_RenderSetScale(renderer, 10, 10);
-
-            // set draw color to black to clear screen
-            SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-            SDL_RenderClear(renderer);
-        };
-
-        void InitialiseFont() {
-            // load the font into memory
-            unsigned char font[80] = {
-                0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
-                0x20, 0x60, 0x20, 0x20, 0x70, // 1
-                0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
-                0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
-                0x90, 0x90, 0xF0, 0x10, 0x10, // 4
-                0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
-                0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
-                0xF0, 0x10, 0x20, 0x40, 0x40, // 7
-                0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
-                0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
-                0xF0, 0x90, 0xF0, 0x90, 0x90, // A
-                0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
-                0xF0, 0x80, 0x80, 0x80, 0xF0, // C
-                0xE0, 0x90, 0x90, 0x90, 0xE0, // D
-                0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
-                0xF0, 0x80, 0xF0, 0x80, 0x80  // F
-            };
-
-            // copy the font into memory (it is convention  to store the font in memory location 0x50)
-            for (int i = 0; i < 80; i++) {
-                memory[i + 0x050] = font[i];
-            }
-        }
-
-        void ClearGraphics() {
-            // clear the display
-            SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-            SDL_RenderClear(renderer);
-        };
-
-        void DrawGraphics() {
-            // clear screen
-            ClearGraphics();
-            // draw the display to the screen
-            SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-            for (int i = 0; i < 64 * 32; i++) {
-                // if the pixel is set to 1 draw it to the screen
-                if (display[i] == 1) {
-                    // i mod 64 for the x coord. #
-                    // i / 32 for the y coord which floors the result as per integer division.
-                    SDL_RenderDrawPoint(renderer, i % 64, i / 64);
-                }
-            }
-
-            SDL_RenderPresent(renderer);
-            
-        };
-
-        void RunOpcode(unsigned short opcode) {
-            // switch statement for all the opcodes
-            // The first 4 bits of the opcode tell us what the opcode is (one hexadecimal digit since 2^4 = 16)
-            // The last 12 bits tell us what to do with the opcode
-            
-            // grab all the various parts of the opcode up front so we don't have to do it multiple times
-            unsigned short nibble_1 = (opcode & 0xF000) >> 12;        
-            unsigned short nibble_2 = (opcode & 0x0F00) >> 8;
-            unsigned short nibble_3 = (opcode & 0x00F0) >> 4;
-            unsigned short nibble_4 = (opcode & 0x000F);
-            unsigned short second_byte = (opcode & 0x00FF);
-            unsigned short third_byte = (opcode & 0x0FFF);
-
-            switch (nibble_1) {
-                case 0x0: {
-                    switch (opcode) {
-                        case 0x00E0: {
-                            // clear the display
-                            for (int i = 0; i < 64 * 32; i++) {
-                                display[i] = 0;
-                            }
-                            break;
-                        }
-                        case 0x00EE: { // RET - return from subroutine. set PC to address at the top fot he stack and then subtract 1 from stack pointer
-                            programCounter = stack[stackPointer];
-                            stackPointer--;
-                            break;
-                        }
-                        default: {
-                            // call RCA 1802 program at address NNN
-                            // not implemented
-                            break;
-                        }
-                    }
-                    break;
-                }
-                case 0x1: { //jump opcode
-                    programCounter = third_byte;
-                    break;
-                }
-                case 0x2: { // Call addr call subroutine at nnn. increment stack pointer, put current PC on top. set PC to nnn
-                    stackPointer++;
-                    stack[stackPointer] = programCounter;
-                    programCounter = third_byte;
-                    break;
-                }
-                case 0x3: { // 3xkk - skip next instruction if Vc = kk
-                    if (vRegister[nibble_2]  == second_byte) {
-                        programCounter += 2;                        
-                    }
-                    break;
-                }
-                case 0x4: { // 4xkk - skip next instruction if Vx not equal to kk
-                    if (vRegister[nibble_2] != second_byte) {
-                        programCounter += 2;
-                    }
-                    break;
-                }
-                case 0x5: { // 5xy0 skip next instruction if vx == vy
-                    if (vRegister[nibble_2] == vRegister[nibble_3]) {
-                        programCounter += 2;
-                    }
-                    break;
-                }
-                case 0x6: { // Set instruction (6XNN where we set the VX register to value NN)
-                    vRegister[nibble_2] = second_byte;
-                    break;
-                }
-                case 0x7: {// 7xkk - set vx = vx + kk
-                    vRegister[nibble_2] += second_byte;
-                    break;
-                }
-                case 0x8: {// there are a few different instruction that begin 0x8 that vary depending on the fourth bit
-                    switch (nibble_4) {
-                        case 0x0: { // 8xy0 - sstore valu eof vy in vx
-                            vRegister[nibble_2] = vRegister[nibble_3];
-                            break;
-                        }
-                        case 0x1: { // 8xy1 perform bitwise OR on the values of Vx and Vy and then store result in Vx
-                            vRegister[nibble_2] |= vRegister[nibble_3];
-                            break;
-                        }
-                        case 0x2: { // 8xy2 perform bitwise AND much like above
-                            vRegister[nibble_2] &= vRegister[nibble_3];
-                            break;
-                        }
-                        case 0x3: { // same as above but for XOR
-                            vRegister[nibble_2] ^= vRegister[nibble_3];
-                            break;
-                        }
-                        case 0x4: { // ADD vx and vy and set Vx to answer.  Set VF to 1  if vx plus vy % 0xFF is 1
-                            unsigned short sum = (vRegister[nibble_2] + vRegister[nibble_3]);
-                            vRegister[0xF] = sum % 0xFF;
-                            vRegister[nibble_2] = sum;
-                            break;
-                        }
-                        case 0x5: {// SUB set Vx to Vx - Vy. if Vx > Vy set Vf to 1 
-                            vRegister[0xF] = (vRegister[nibble_2] > vRegister[nibble_3]) ? 1 : 0;
-                            vRegister[nibble_2] -= vRegister[nibble_3];
-                            break;
-                        }
-                        case 0x6: { //SHR shift Vx 1 bit to the right
-                            if (vRegister[nibble_2] & 0x1 == 1) {
-                                vRegister[0xF] = 1;
-                            } else {
-                                vRegister[0xF] = 0;
-                            } 
-                            vRegister[nibble_2] >>= 1;
-                            break;
-                        }
-                        case 0x7: { //  SUBN Set Vx = Vy - Vx, set VF = NOT borrow
-                            vRegister[0xF] = vRegister[nibble_3] > vRegister[nibble_2] ? 1 : 0;
-                            vRegister[nibble_2] = vRegister[nibble_3] - vRegister[nibble_2];
-                            break;
-                        }
-                        case 0xE: { // Shift Vx 1 bit to the left
-                            vRegister[0xF] = vRegister[nibble_2] & 0b10000000 ? 1 : 0; // done in binary because my brain is small and i couldn't think in hex :(
-                            vRegister[nibble_2] <<= 1;
-                            break;
-                        }
-                        default: {
-                            // this opcode doesn't exist
-                            std::cout << "Unknown opcode: " << std::hex << opcode << std::endl;
-                            break;
-                        }
-                    }
-                }
-                case 0x9: { // skip next instructuion if Vx != Vy
-                    programCounter += (vRegister[nibble_2] != vRegister[nibble_3]) ? 2 : 0;
-                }
-                case 0xA: { // OPcode ANNN: Sets index register to value NNN
-                    indexRegister = third_byte;
-                    break;
-                }
-                case 0xB: { // PMP to pocation nnn + V0
-                    programCounter = third_byte + vRegister[0];
-                    break;
-                }
-                case 0xC: { // Cxkk set Vx to random byte AND kk
-                    vRegister[nibble_2] = RandomByte() & second_byte;
-                    break;
-                }
-                case 0xD: { // opcode DXYN draw n pixels tall sprite to the display from position x in the Vx regiter ,y from the Vy register from memory location in the index register
-                    // get x and y from the registers
-                    unsigned int x = vRegister[nibble_2] % 64;
-                    unsigned int y = vRegister[nibble_3] % 32;
-                    unsigned int height = nibble_4;
-                    unsigned int carry = 0;
-                    // loop through the sprite
-                    for (int i=0; i < height; i++) {
-                        //  check we are not off the bottom of the screen
-                        if (y + i >= 32) {
-                            break;
-                        }
-                        // get the sprite row from memory
-                        unsigned char sprite_row = memory[indexRegister + i];
-                        for (int j = 0; j < 8; j ++) { // for each pixel in the row
-                            if (x + j >= 64) {
-                                // we have reached the end of the screeen
-                                break;
-                            }
-                            // xor the current pixel with the sprite pixel
-                            unsigned int pixel = (sprite_row >> (7 - j)) & 0x1;
-                            if (display[(y + i) * 64 + x + j] == 1 && pixel == 1) {
-                                carry = 1;
-                            };
-                            display[(y + i) * 64 + x + j] ^= pixel;
-                                                        
-                        }
-                    }
-                    // set the carry flag
-                    vRegister[0xF] = carry;
-                    break;
-                }
-                case 0xE: {
-                    // two possible instrctions here so we'll use an if statement to check which we need
-                    if (second_byte == 0x9E) {
-                        // skip next instruction if key with the value of Vx is pressed
-                        programCounter += (key[vRegister[nibble_2]] == 1) ? 2 : 0;
-                    }
-                    else if (second_byte == 0xA1)
-                    {
-                        // skip next instruction if key with the value of Vx is not pressed
-                        programCounter += (key[vRegister[nibble_2]] == 0) ? 2 : 0;
-                    }
-                    else {
-                        // invalid opcode
-                        std::cout << "Unknown opcode: " << std::hex << opcode << std::endl;                     
-                    }
-                    break;
-                }
-                case 0xF: {
-                    // quite  a few codes begin 0xF
-                    switch (second_byte){
-                        case 0x07: {
-                            vRegister[nibble_2] = delayTimer;
-                            break;
-                        }
-                        case 0x0A: {
-                            // pause until a key is pressed and then store the value of the key in Vx
-                            while (true) {
-                                // still need to handle input here so
-                                HandleInput();
-                                bool canBreak = false;
-                                for (int i = 0; i < 16; i++) {
-                                    if (key[i] == 1) {
-                                        vRegister[nibble_2] = i;
-                                        canBreak = true;
-                                        break;
-                                    }
-                                }
-                                if (canBreak) {
-                                    break;
-                                }
-                            }
-                        }
-                        case 0x15: {
-                            delayTimer = vRegister[nibble_2];
-                            break;
-                        }
-                        case 0x18: {
-                            soundTimer = vRegister[nibble_2];
-                            break;
-                        }
-                        case 0x1E: {
-                            indexRegister += vRegister[nibble_2];
-                            break;
-                        }
-                        case 0x29: {
-                            // memory location for font begins at 0x050 so we can
-                            // set the index register to 0x050 plus 5 times the value of Vx to find the beginning
-                            // of the sprite for the character held in Vx
-                            indexRegister = 0x050 + vRegister[nibble_2] * 5;
-                            break;
-                        }
-                        case 0x33: {
-                            // take the decimal value of Vx and place
-                            // the hundres digit in memory location in I, 
-                            //tens digit at location I+1 
-                            //and the ones at I+2
-                            unsigned char hundreds = vRegister[nibble_2] & 0b100;
-                            unsigned char tens = vRegister[nibble_2] & 0b010;
-                            unsigned char ones = vRegister[nibble_2] & 0b001;
-                            memory[indexRegister] = hundreds;
-                            memory[indexRegister + 1] = tens;
-                            memory[indexRegister + 2] = ones;
-                            break;
-                        }
-                        case 0x55: {
-                            // copy registers V0 through Vx into memory starting at memory[indexRegister]
-                            for (int i; i < vRegister[nibble_2]; i++) {
-                                memory[indexRegister + i] = vRegister[i];
-                            }
-                            break;
-                        }
-                        case 0x65: {
-                            // read registers V0 through Vx from memory starting at location I
-                            for (int i; i < vRegister[nibble_2]; i++) {
-                                vRegister[i] = memory[indexRegister + i];
-                            }
-                            break;
-                        }
-                    }
-                    break;
-                }
-            }
-            
-        };
-
-        int Step() {
-            // TODO: update pressed keys
-            
-            // fetch the opcode
-            currentOpcode = memory[programCounter] << 8 | memory[programCounter + 1];
-            programCounter += 2;
-
-            // decode and execute the opcode
-            RunOpcode(currentOpcode);
-
-            return 0;
-        };
-
-};
-
-int main () {
-
-    Chip8 myChip8;
-
-    myChip8.Initialize();
-    myChip8.LoadProgram("programs/snek.ch8");
-    myChip8.Run();    
-
-    return 0;
-};
\ No newline at end of file
+#include <string>
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <iomanip>
+#include <fstream>
+
+#include "chip8.h"
+#include "jit_x64.h"
+#include "batch.h"
+#include "lockstep.h"
+#include "savestate.h"
+#include "inputlog.h"
+#include "dispatchbench.h"
+#include "conformance.h"
+#include "videowriter.h"
+#include "analyzer.h"
+#include "corpus.h"
+
+// build with -DCHIP8_NO_SDL to get a headless only binary that doesn't need SDL at all
+#ifndef CHIP8_NO_SDL
+#include "sdl_frontend.h"
+#endif
+
+void PrintUsage() {
+    std::cout << "usage: chip8 [--headless] [--cycles N] [--ipf N] [--dispatch NAME] [--no-idle-skip] [--jit] [--jit-verify]" << std::endl;
+    std::cout << "             [--load-state FILE] [--save-state FILE] [--seed N] [--record FILE] [--quirks NAME]" << std::endl;
+    std::cout << "             [--mute] [--audio-buffer N] [--audio-sync] [program.ch8]" << std::endl;
+    std::cout << "       chip8 --replay FILE [--dispatch NAME] [--save-state FILE] [--y4m FILE] [--png-frames DIR] [program.ch8]" << std::endl;
+    std::cout << "       (instrumented builds) [--opcode-counts] [--trace N] [--callgrind FILE] [--collapsed FILE]" << std::endl;
+    std::cout << "       chip8 --lockstep N [--cycles N] [--ipf N] [program.ch8]" << std::endl;
+    std::cout << "       chip8 --batch <directory|manifest|pack> [--threads N] [--cycles N] [--ipf N] [--jit] [--dispatch NAME] [--quirks NAME]" << std::endl;
+    std::cout << "       chip8 --bench-dispatch <program|directory|manifest> [--cycles N] [--ipf N] [--repeat N] [--quirks NAME]" << std::endl;
+    std::cout << "       chip8 --conformance [--cases N] [--seed N] [--quirks NAME]" << std::endl;
+    std::cout << "       chip8 --conformance-rom <program|directory|manifest> [--cycles N] [--ipf N] [--seed N] [--quirks NAME]" << std::endl;
+    std::cout << "       chip8 --analyze <program|directory|manifest> [--disassemble] [--quirks NAME] [--ipf N]" << std::endl;
+    std::cout << "       chip8 --pack <directory|manifest> FILE" << std::endl;
+    std::cout << "  --headless   run without a window as fast as the host allows and report instructions/sec" << std::endl;
+    std::cout << "  --cycles N   number of instructions to run in headless mode (default 10000000)" << std::endl;
+    std::cout << "  --ipf N      instructions to run per 60 Hz frame (default 11, about 700 a second)" << std::endl;
+    std::cout << "  --dispatch NAME     how the interpreter gets to each instruction: switch, cache (the default), table or threaded" << std::endl;
+    std::cout << "  --no-decode-cache   the same as --dispatch switch, decode every instruction from memory each step" << std::endl;
+    std::cout << "  --no-idle-skip      run idle loops instruction by instruction instead of skipping to the end of the frame" << std::endl;
+    std::cout << "  --jit        translate straight line code to native x86-64 in headless mode" << std::endl;
+    std::cout << "  --jit-verify run the jit and the interpreter side by side for --cycles instructions and report the first difference" << std::endl;
+    std::cout << "  --y4m FILE   write every frame of a headless run or replay as Y4M video to FILE (a named pipe works, - is stdout)" << std::endl;
+    std::cout << "  --png-frames DIR    write every frame of a headless run or replay to DIR as frame_000000.png, frame_000001.png, ..." << std::endl;
+    std::cout << "  --load-state FILE   start from a savestate instead of the beginning of the program" << std::endl;
+    std::cout << "  --save-state FILE   write a savestate when a headless run finishes" << std::endl;
+    std::cout << "  --batch X    run every ROM in directory X (or listed in manifest X, or packed in X) headless, spread over all cores." << std::endl;
+    std::cout << "               what it works out about each ROM is cached in X.c8cache (corpus.c8cache in a directory) for next time" << std::endl;
+    std::cout << "  --pack X FILE       put every ROM in directory or manifest X into one pack file for --batch to map in one go" << std::endl;
+    std::cout << "  --bench-dispatch X  time every --dispatch and the jit on a ROM (or a directory or manifest like --batch) and" << std::endl;
+    std::cout << "                      report ns per instruction and host branch misses. idle skipping is off so everything runs" << std::endl;
+    std::cout << "  --repeat N   runs of each strategy in --bench-dispatch, the fastest is kept (default 3)" << std::endl;
+    std::cout << "  --conformance       check every instruction, run every way the core can run them, against a simple reference chip8" << std::endl;
+    std::cout << "                      (every profile unless --quirks picks one) and report the first one that disagrees" << std::endl;
+    std::cout << "  --cases N    random machines to try each instruction on in --conformance (default 2000, the maths ones try every input)" << std::endl;
+    std::cout << "  --conformance-rom X run ROMs against the reference one instruction at a time for --cycles and report where they part ways" << std::endl;
+    std::cout << "  --analyze X  work out the code, data, loops and profile of ROMs without running them and save it next to each" << std::endl;
+    std::cout << "               one as <rom>.c8meta, which later runs use to pick the profile and decode the code before it runs" << std::endl;
+    std::cout << "               --ipf with --analyze saves that as the ROM's own instructions per frame, used whenever --ipf isn't given" << std::endl;
+    std::cout << "  --disassemble       print every block and its edges, and the data, as well as the --analyze summary" << std::endl;
+    std::cout << "  --lockstep N run N copies of the program side by side (each holding different keys) for --cycles steps each" << std::endl;
+    std::cout << "  --threads N  worker threads for --batch (default: one per core)" << std::endl;
+    std::cout << "  --seed N     seed for the random numbers (headless, batch and lockstep runs use 0 unless told otherwise)" << std::endl;
+    std::cout << "  --mute       no sound" << std::endl;
+    std::cout << "  --audio-buffer N    samples the sound card asks for at a time, smaller is less delay but more likely to crackle (default 512)" << std::endl;
+    std::cout << "  --audio-sync        let the sound card set the pace instead of the clock, so sound and game can never drift apart" << std::endl;
+    std::cout << "  --record FILE       write every key press to FILE while playing so the run can be replayed" << std::endl;
+    std::cout << "  --replay FILE       play back a recording headless, as fast as possible, and report the final state" << std::endl;
+    std::cout << "  --quirks NAME       vip, schip or xochip. by default it's picked from the ROM's extension (.sc8, .xo8, otherwise vip)," << std::endl;
+    std::cout << "                      or from the ROM's .c8meta if --analyze has been run on it" << std::endl;
+    std::cout << "  these need a build with -DCHIP8_INSTRUMENT and are written out when the run finishes:" << std::endl;
+    std::cout << "  --opcode-counts     print how many of each kind of instruction ran" << std::endl;
+    std::cout << "  --trace N           print the last N instructions with the registers they changed" << std::endl;
+    std::cout << "  --callgrind FILE    write how often every address ran, grouped by subroutine, for kcachegrind" << std::endl;
+    std::cout << "  --collapsed FILE    write the same as collapsed call stacks for flamegraph.pl" << std::endl;
+}
+
+template <typename Quirks>
+int RunHeadless(Chip8Core<Quirks>& chip8, unsigned long long cycles, unsigned int instructionsPerFrame, Chip8Jit* jit, VideoWriter* video) {
+    // we keep the same number of instructions per 60 Hz timer tick as the windowed version even though we're not
+    // throttled, otherwise games that wait on the delay timer behave differently (or never get anywhere)
+    const unsigned long long cyclesPerTimerTick = instructionsPerFrame;
+
+    auto start = std::chrono::steady_clock::now();
+    unsigned long long executed = 0;
+    unsigned long long nextTimerTick = cyclesPerTimerTick;
+    while (executed < cycles) {
+        unsigned long long chunk = std::min(nextTimerTick, cycles) - executed;
+        executed += (jit != nullptr) ? jit->RunFor(chip8, chunk) : chip8.RunFor(chunk);
+        while (executed >= nextTimerTick) {
+            chip8.TickTimers();
+            if (video != nullptr) {
+                video->Submit(chip8);
+            }
+            nextTimerTick += cyclesPerTimerTick;
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    std::cout << "executed " << executed << " instructions in " << seconds << " s" << std::endl;
+    std::cout << "instructions/sec: " << (seconds > 0 ? executed / seconds : 0) << std::endl;
+    std::cout << "final pc: 0x" << std::hex << chip8.GetProgramCounter() << std::dec << std::endl;
+    std::cout << "idle instructions skipped: " << chip8.GetIdleInstructions() << std::endl;
+    return 0;
+}
+
+struct InstrumentationOutput {
+    bool opcodeCounts = false;
+    size_t traceLength = 0;
+    std::string callgrindPath;
+    std::string collapsedPath;
+
+    bool Wanted() const {
+        return opcodeCounts || traceLength > 0 || !callgrindPath.empty() || !collapsedPath.empty();
+    }
+};
+
+template <typename Quirks>
+int WriteInstrumentation(const Chip8Core<Quirks>& chip8, const InstrumentationOutput& output, const std::string& program_path) {
+#ifdef CHIP8_INSTRUMENT
+    const Instrumentation& instrumentation = chip8.GetInstrumentation();
+    if (output.opcodeCounts) {
+        instrumentation.WriteCounters(std::cout);
+    }
+    if (output.traceLength > 0) {
+        instrumentation.WriteTrace(std::cout, output.traceLength);
+    }
+    if (!output.callgrindPath.empty()) {
+        std::ofstream file(output.callgrindPath);
+        instrumentation.WriteCallgrind(file, program_path);
+        if (!file.good()) {
+            std::cerr << "could not write " << output.callgrindPath << std::endl;
+            return 1;
+        }
+    }
+    if (!output.collapsedPath.empty()) {
+        std::ofstream file(output.collapsedPath);
+        instrumentation.WriteCollapsed(file);
+        if (!file.good()) {
+            std::cerr << "could not write " << output.collapsedPath << std::endl;
+            return 1;
+        }
+    }
+#endif
+    return 0;
+}
+
+template <typename Quirks>
+int RunReplay(Chip8Core<Quirks>& chip8, const InputLog& log, VideoWriter* video) {
+    // the chip8 has to be freshly loaded and seeded from the log. runs exactly the frames that were recorded, with the
+    // keys changing on exactly the frames they changed on, so the end result is the same every time on every build
+    auto start = std::chrono::steady_clock::now();
+    unsigned long long executed = 0;
+    size_t nextEvent = 0;
+    for (uint64_t frame = 0; frame < log.endFrame; frame++) {
+        while (nextEvent < log.events.size() && log.events[nextEvent].frame <= frame) {
+            chip8.SetKeyMask(log.events[nextEvent].keys);
+            nextEvent++;
+        }
+        executed += chip8.RunFor(log.instructionsPerFrame);
+        chip8.TickTimers();
+        if (video != nullptr) {
+            video->Submit(chip8);
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    std::cout << "replayed " << log.endFrame << " frames (" << executed << " instructions) in " << seconds << " s" << std::endl;
+    std::cout << "instructions/sec: " << (seconds > 0 ? executed / seconds : 0) << std::endl;
+    std::cout << "idle instructions skipped: " << chip8.GetIdleInstructions() << std::endl;
+    std::cout << "final state hash: " << std::hex << std::setw(16) << std::setfill('0') << chip8.StateHash()
+              << std::dec << std::setfill(' ') << std::endl;
+    return 0;
+}
+
+int RunLockstep(const std::string& program_path, unsigned int laneCount, unsigned long long cycles, unsigned int instructionsPerFrame, uint64_t seed) {
+    LockstepEngine engine(laneCount);
+    if (!engine.LoadProgram(program_path)) {
+        std::cerr << "could not load program: " << program_path << std::endl;
+        return 1;
+    }
+    // give every lane a different set of keys held down so they have a reason to go their own ways
+    for (unsigned int lane = 0; lane < laneCount; lane++) {
+        engine.Seed(lane, seed + lane);
+        unsigned int keys = lane * 2654435761u;
+        for (int k = 0; k < 16; k++) {
+            engine.SetKey(lane, k, (keys >> (k + 8)) & 0x1);
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned long long step = 0; step < cycles; step++) {
+        engine.Step();
+        if ((step + 1) % instructionsPerFrame == 0) {
+            engine.TickTimers();
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    unsigned long long executed = cycles * laneCount;
+    std::cout << "executed " << executed << " instructions over " << laneCount << " lanes in " << seconds << " s" << std::endl;
+    std::cout << "instructions/sec: " << (seconds > 0 ? executed / seconds : 0) << std::endl;
+    std::cout << "shared: " << engine.vectorLaneSteps << " lane instructions, on their own: " << engine.scalarLaneSteps << std::endl;
+    return 0;
+}
+
+int main (int argc, char* argv[]) {
+
+    std::string program_path;
+    bool headless = false;
+    unsigned long long cycles = 10000000;
+    unsigned int instructionsPerFrame = 11;
+    bool instructionsPerFrameGiven = false;
+    Chip8Dispatch dispatch = Chip8Dispatch::DecodeCache;
+    bool idleSkip = true;
+    bool useJit = false;
+    bool verifyJit = false;
+    std::string batchSource;
+    std::string benchSource;
+    unsigned int repeats = 3;
+    bool conformance = false;
+    std::string conformanceSource;
+    unsigned int conformanceCases = 2000;
+    std::string analyzeSource;
+    std::string packSource;
+    std::string packPath;
+    bool disassemble = false;
+    unsigned int threads = 0;
+    unsigned int lockstepLanes = 0;
+    std::string loadStatePath;
+    std::string saveStatePath;
+    uint64_t seed = 0;
+    bool seedGiven = false;
+    std::string recordPath;
+    std::string y4mPath;
+#ifndef CHIP8_NO_SDL
+    bool mute = false;
+    unsigned int audioBuffer = 512;
+    bool audioSync = false;
+#endif
+    std::string pngFramesPath;
+    std::string replayPath;
+    Chip8Profile profile = Chip8Profile::Vip;
+    bool profileGiven = false;
+    InstrumentationOutput instrumentationOutput;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--headless") {
+            headless = true;
+        }
+        else if (arg == "--cycles" && i + 1 < argc) {
+            cycles = std::strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--ipf" && i + 1 < argc) {
+            instructionsPerFrame = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+            instructionsPerFrameGiven = true;
+        }
+        else if (arg == "--no-decode-cache") {
+            dispatch = Chip8Dispatch::Switch;
+        }
+        else if (arg == "--dispatch" && i + 1 < argc) {
+            if (!ParseChip8Dispatch(argv[++i], dispatch)) {
+                std::cerr << "unknown dispatch: " << argv[i] << " (expected switch, cache, table or threaded)" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--no-idle-skip") {
+            idleSkip = false;
+        }
+        else if (arg == "--jit") {
+            useJit = true;
+            headless = true;
+        }
+        else if (arg == "--batch" && i + 1 < argc) {
+            batchSource = argv[++i];
+        }
+        else if (arg == "--bench-dispatch" && i + 1 < argc) {
+            benchSource = argv[++i];
+        }
+        else if (arg == "--repeat" && i + 1 < argc) {
+            repeats = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+        }
+        else if (arg == "--conformance") {
+            conformance = true;
+        }
+        else if (arg == "--conformance-rom" && i + 1 < argc) {
+            conformanceSource = argv[++i];
+        }
+        else if (arg == "--cases" && i + 1 < argc) {
+            conformanceCases = std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--analyze" && i + 1 < argc) {
+            analyzeSource = argv[++i];
+        }
+        else if (arg == "--pack" && i + 2 < argc) {
+            packSource = argv[++i];
+            packPath = argv[++i];
+        }
+        else if (arg == "--disassemble") {
+            disassemble = true;
+        }
+#ifndef CHIP8_NO_SDL
+        else if (arg == "--mute") {
+            mute = true;
+        }
+        else if (arg == "--audio-buffer" && i + 1 < argc) {
+            audioBuffer = std::min(32768ul, std::max(16ul, std::strtoul(argv[++i], nullptr, 10)));
+        }
+        else if (arg == "--audio-sync") {
+            audioSync = true;
+        }
+#else
+        else if (arg == "--mute" || arg == "--audio-buffer" || arg == "--audio-sync") {
+            std::cerr << "this build has no sound, " << arg << " needs a build without -DCHIP8_NO_SDL" << std::endl;
+            return 1;
+        }
+#endif
+        else if (arg == "--y4m" && i + 1 < argc) {
+            y4mPath = argv[++i];
+            headless = true;
+        }
+        else if (arg == "--png-frames" && i + 1 < argc) {
+            pngFramesPath = argv[++i];
+            headless = true;
+        }
+        else if (arg == "--load-state" && i + 1 < argc) {
+            loadStatePath = argv[++i];
+        }
+        else if (arg == "--save-state" && i + 1 < argc) {
+            saveStatePath = argv[++i];
+        }
+        else if (arg == "--lockstep" && i + 1 < argc) {
+            lockstepLanes = std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--threads" && i + 1 < argc) {
+            threads = std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--seed" && i + 1 < argc) {
+            seed = std::strtoull(argv[++i], nullptr, 0);
+            seedGiven = true;
+        }
+        else if (arg == "--record" && i + 1 < argc) {
+            recordPath = argv[++i];
+        }
+        else if (arg == "--replay" && i + 1 < argc) {
+            replayPath = argv[++i];
+        }
+        else if (arg == "--quirks" && i + 1 < argc) {
+            if (!ParseChip8Profile(argv[++i], profile)) {
+                std::cerr << "unknown quirk profile: " << argv[i] << " (expected vip, schip or xochip)" << std::endl;
+                return 1;
+            }
+            profileGiven = true;
+        }
+        else if (arg == "--opcode-counts") {
+            instrumentationOutput.opcodeCounts = true;
+        }
+        else if (arg == "--trace" && i + 1 < argc) {
+            instrumentationOutput.traceLength = std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--callgrind" && i + 1 < argc) {
+            instrumentationOutput.callgrindPath = argv[++i];
+        }
+        else if (arg == "--collapsed" && i + 1 < argc) {
+            instrumentationOutput.collapsedPath = argv[++i];
+        }
+        else if (arg == "--jit-verify") {
+            verifyJit = true;
+        }
+        else if (arg == "--help" || arg == "-h") {
+            PrintUsage();
+            return 0;
+        }
+        else {
+            program_path = arg;
+        }
+    }
+
+#ifndef CHIP8_INSTRUMENT
+    if (instrumentationOutput.Wanted()) {
+        std::cerr << "this build has no instrumentation, rebuild with -DCHIP8_INSTRUMENT" << std::endl;
+        return 1;
+    }
+#endif
+
+    if (!packSource.empty()) {
+        RomCorpus corpus;
+        if (!corpus.Open(packSource, 0)) {
+            std::cerr << "no ROMs found in " << packSource << std::endl;
+            return 1;
+        }
+        if (!corpus.SavePack(packPath)) {
+            std::cerr << "could not write " << packPath << std::endl;
+            return 1;
+        }
+        std::cout << "packed " << corpus.Roms().size() << " ROMs into " << packPath << std::endl;
+        return 0;
+    }
+
+    if (!batchSource.empty()) {
+        // every ROM mapped in at once and looked up in the metadata cache by its hash, see corpus.h
+        auto openStart = std::chrono::steady_clock::now();
+        RomCorpus corpus;
+        if (!corpus.Open(batchSource, cycles)) {
+            std::cerr << "no ROMs found in " << batchSource << std::endl;
+            return 1;
+        }
+        std::string cachePath = RomCorpus::CachePathFor(batchSource);
+        corpus.LoadCache(cachePath);
+        unsigned int analyzed = corpus.AnalyzeMissing();
+        if (analyzed > 0 && !corpus.SaveCache(cachePath)) {
+            std::cerr << "could not write the metadata cache " << cachePath << std::endl;
+        }
+        std::cerr << corpus.Roms().size() << " ROMs ready in " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - openStart).count()
+                  << " ms (" << analyzed << " analysed, the rest from " << cachePath << ")" << std::endl;
+
+        BatchRunner runner;
+        runner.defaultCycles = cycles;
+        runner.instructionsPerFrame = instructionsPerFrame;
+        runner.forceInstructionsPerFrame = instructionsPerFrameGiven;
+        runner.useJit = useJit;
+        runner.seed = seed;
+        runner.forceProfile = profileGiven;
+        runner.profile = profile;
+        runner.dispatch = dispatch;
+        if (threads > 0) {
+            runner.threadCount = threads;
+        }
+        std::vector<BatchRunner::Job> jobs = corpus.Jobs();
+        auto start = std::chrono::steady_clock::now();
+        std::vector<BatchRunner::Result> results = runner.Run(jobs);
+        auto end = std::chrono::steady_clock::now();
+        BatchRunner::PrintResults(results);
+        std::cerr << jobs.size() << " ROMs on " << runner.threadCount << " threads in "
+                  << std::chrono::duration<double>(end - start).count() << " s" << std::endl;
+        return 0;
+    }
+
+    if (!benchSource.empty()) {
+        DispatchBenchmark bench;
+        bench.instructionsPerFrame = instructionsPerFrame;
+        bench.repeats = repeats;
+        bench.seed = seed;
+        bench.forceProfile = profileGiven;
+        bench.profile = profile;
+        std::vector<BatchRunner::Job> jobs = DispatchBenchmark::LoadJobs(benchSource, cycles);
+        if (jobs.empty()) {
+            std::cerr << "no ROMs found in " << benchSource << std::endl;
+            return 1;
+        }
+        if (!PerfCounters().Available()) {
+            std::cerr << "hardware branch counters aren't available here (not Linux, a VM, or perf_event_paranoid), only timing" << std::endl;
+        }
+        // different end states mean one of the strategies has a bug, which is worth failing on
+        return DispatchBenchmark::PrintResults(bench.Run(jobs)) ? 0 : 1;
+    }
+
+    if (conformance || !conformanceSource.empty()) {
+        ConformanceHarness harness;
+        harness.randomCases = conformanceCases;
+        harness.seed = seed;
+        // stops at the first thing that disagrees, there's no point piling more on top of a broken instruction
+        bool passed = true;
+        auto check = [&](Chip8Profile checkProfile, const std::string& path, unsigned long long checkCycles) {
+            AnyChip8 chip8 = CreateChip8(checkProfile);
+            return std::visit([&](auto& core) {
+                typedef typename std::decay_t<decltype(*core)>::Quirks Quirks;
+                return path.empty() ? harness.CheckOpcodes<Quirks>() && harness.CheckIdleSkip<Quirks>() && harness.CheckRewind<Quirks>() : harness.CheckProgram<Quirks>(path, checkCycles, instructionsPerFrame);
+            }, chip8);
+        };
+        if (!conformanceSource.empty()) {
+            std::vector<BatchRunner::Job> jobs = DispatchBenchmark::LoadJobs(conformanceSource, cycles);
+            if (jobs.empty()) {
+                std::cerr << "no ROMs found in " << conformanceSource << std::endl;
+                return 1;
+            }
+            for (size_t j = 0; j < jobs.size() && passed; j++) {
+                passed = check(profileGiven ? profile : ProfileForRom(jobs[j].path), jobs[j].path, jobs[j].cycles);
+            }
+        }
+        else {
+            const Chip8Profile everyProfile[] = { Chip8Profile::Vip, Chip8Profile::SuperChip, Chip8Profile::XoChip };
+            for (Chip8Profile checkProfile : everyProfile) {
+                if (passed && (!profileGiven || checkProfile == profile)) {
+                    passed = check(checkProfile, "", 0);
+                }
+            }
+        }
+        return passed ? 0 : 1;
+    }
+
+    if (!analyzeSource.empty()) {
+        std::vector<BatchRunner::Job> jobs = DispatchBenchmark::LoadJobs(analyzeSource, cycles);
+        if (jobs.empty()) {
+            std::cerr << "no ROMs found in " << analyzeSource << std::endl;
+            return 1;
+        }
+        bool allSaved = true;
+        for (const BatchRunner::Job& job : jobs) {
+            RomAnalyzer analyzer;
+            if (!analyzer.Analyze(job.path, profileGiven, profile)) {
+                std::cerr << "could not analyze " << job.path << " (missing, empty or too big)" << std::endl;
+                allSaved = false;
+                continue;
+            }
+            // a ROM's own instructions per frame is kept when it's analysed again, unless --ipf gives it a new one
+            RomMetadata previous;
+            if (instructionsPerFrameGiven) {
+                analyzer.metadata.instructionsPerFrame = instructionsPerFrame;
+            }
+            else if (previous.LoadFor(job.path)) {
+                analyzer.metadata.instructionsPerFrame = previous.instructionsPerFrame;
+            }
+            if (!analyzer.metadata.Save(RomMetadata::PathFor(job.path))) {
+                std::cerr << "could not write " << RomMetadata::PathFor(job.path) << std::endl;
+                allSaved = false;
+            }
+            analyzer.PrintReport(std::cout, job.path);
+            if (disassemble) {
+                analyzer.PrintListing(std::cout);
+                std::cout << std::endl;
+            }
+        }
+        return allSaved ? 0 : 1;
+    }
+
+    if (program_path.empty()) {
+        std::cerr << "no program given" << std::endl;
+        PrintUsage();
+        return 1;
+    }
+
+    // what --analyze found out about the program, if it's been run on it
+    RomMetadata metadata;
+    bool haveMetadata = metadata.LoadFor(program_path);
+    if (!profileGiven) {
+        profile = haveMetadata ? metadata.profile : GuessChip8Profile(program_path);
+    }
+    if (haveMetadata && metadata.instructionsPerFrame > 0 && !instructionsPerFrameGiven) {
+        instructionsPerFrame = metadata.instructionsPerFrame;
+    }
+
+    if (!y4mPath.empty() && !pngFramesPath.empty()) {
+        std::cerr << "pick one of --y4m and --png-frames" << std::endl;
+        return 1;
+    }
+    if (y4mPath == "-") {
+        // the video has stdout to itself, so everything we'd normally print there goes to stderr instead
+        std::cout.rdbuf(std::cerr.rdbuf());
+    }
+
+    if (lockstepLanes > 0) {
+        if (profile != Chip8Profile::Vip) {
+            // the shared vector code only knows the plain chip8 rules
+            std::cerr << "--lockstep only runs plain chip8 (vip) programs" << std::endl;
+            return 1;
+        }
+        return RunLockstep(program_path, lockstepLanes, cycles, instructionsPerFrame, seed);
+    }
+
+    InputLog replayLog;
+    if (!replayPath.empty() && !replayLog.LoadFromFile(replayPath)) {
+        std::cerr << "could not load input recording: " << replayPath << std::endl;
+        return 1;
+    }
+    if (!replayPath.empty()) {
+        // the same keys with different quirks would be a different game, so the recording decides
+        profile = static_cast<Chip8Profile>(replayLog.profile);
+    }
+
+#ifdef CHIP8_NO_SDL
+    headless = true;
+#endif
+
+    // anything run to be measured or compared is seeded so it does the same thing every time. played by hand it's random
+    // unless asked otherwise, but a recording still needs to know which seed it got
+    if (!replayPath.empty()) {
+        seed = replayLog.seed;
+    }
+    else if (!seedGiven && !headless && !verifyJit) {
+        std::random_device rd;
+        seed = (static_cast<uint64_t>(rd()) << 32) | rd();
+    }
+
+    // everything from here on is written once for every quirk profile and run on whichever one this program wants
+    AnyChip8 chip8 = CreateChip8(profile);
+    return std::visit([&](auto& core) -> int {
+        auto& myChip8 = *core;
+
+        myChip8.Initialize();
+        myChip8.Seed(seed);
+        myChip8.SetDispatch(dispatch);
+        myChip8.SetIdleSkipEnabled(idleSkip);
+        if (!myChip8.LoadProgram(program_path)) {
+            std::cerr << "could not load program: " << program_path << " (missing, empty or more than " << myChip8.maxProgramSize
+                      << " bytes for " << Chip8ProfileName(profile) << ")" << std::endl;
+            return 1;
+        }
+        if (haveMetadata) {
+            metadata.Prewarm(myChip8);
+        }
+
+        // frames for --y4m / --png-frames, from whichever of the headless runs below happens
+        typedef typename std::decay_t<decltype(myChip8)>::Quirks Quirks;
+        std::unique_ptr<VideoWriter> video;
+        if (!y4mPath.empty() || !pngFramesPath.empty()) {
+            video = std::make_unique<VideoWriter>();
+            bool opened = y4mPath.empty() ? video->Open<Quirks>(VideoWriter::Format::PngSequence, pngFramesPath)
+                                          : video->Open<Quirks>(VideoWriter::Format::Y4m, y4mPath);
+            if (!opened) {
+                std::cerr << "could not open video output: " << (y4mPath.empty() ? pngFramesPath : y4mPath) << std::endl;
+                return 1;
+            }
+        }
+        auto finishVideo = [&]() {
+            if (video == nullptr) {
+                return 0;
+            }
+            bool written = video->Close();
+            std::cerr << "video: " << video->FramesWritten() << " frames (" << video->RepeatsWritten() << " of them repeats), waited for the writer "
+                      << video->Waits() << " times" << std::endl;
+            if (!written) {
+                std::cerr << "could not write all of the video to " << (y4mPath.empty() ? pngFramesPath : y4mPath) << std::endl;
+                return 1;
+            }
+            return 0;
+        };
+
+        if (!replayPath.empty()) {
+            int result = RunReplay(myChip8, replayLog, video.get());
+            result |= finishVideo();
+            result |= WriteInstrumentation(myChip8, instrumentationOutput, program_path);
+            if (!saveStatePath.empty() && !Savestate::SaveToFile(myChip8, saveStatePath)) {
+                std::cerr << "could not write savestate: " << saveStatePath << std::endl;
+                return 1;
+            }
+            return result;
+        }
+
+        if (!loadStatePath.empty() && !recordPath.empty()) {
+            std::cerr << "recordings always start from the beginning of the program, so --record can't be used with --load-state" << std::endl;
+            return 1;
+        }
+        if (!loadStatePath.empty() && !Savestate::LoadFromFile(myChip8, loadStatePath)) {
+            std::cerr << "could not load savestate: " << loadStatePath << std::endl;
+            return 1;
+        }
+
+        if (verifyJit) {
+            Chip8Jit jit;
+            if (!jit.Available()) {
+                std::cerr << "the jit isn't available on this platform, falling back to the interpreter" << std::endl;
+            }
+            return jit.Verify(myChip8, cycles, instructionsPerFrame) ? 0 : 1;
+        }
+
+        if (headless) {
+            std::unique_ptr<Chip8Jit> jit;
+            if (useJit) {
+                jit = std::make_unique<Chip8Jit>();
+                if (!jit->Available()) {
+                    std::cerr << "the jit isn't available on this platform, falling back to the interpreter" << std::endl;
+                }
+            }
+            int result = RunHeadless(myChip8, cycles, instructionsPerFrame, jit.get(), video.get());
+            result |= finishVideo();
+            result |= WriteInstrumentation(myChip8, instrumentationOutput, program_path);
+            if (!saveStatePath.empty() && !Savestate::SaveToFile(myChip8, saveStatePath)) {
+                std::cerr << "could not write savestate: " << saveStatePath << std::endl;
+                return 1;
+            }
+            return result;
+        }
+
+#ifndef CHIP8_NO_SDL
+        SdlFrontend frontend;
+        frontend.InitialiseGraphics();
+        frontend.SetQuickSavePath(program_path + ".c8s");
+        if (!mute) {
+            frontend.InitialiseAudio(audioBuffer, audioSync);
+        }
+        if (!recordPath.empty()) {
+            InputLog recording;
+            recording.seed = seed;
+            recording.instructionsPerFrame = instructionsPerFrame;
+            recording.profile = static_cast<uint8_t>(profile);
+            frontend.Run(myChip8, instructionsPerFrame, &recording);
+            if (!recording.SaveToFile(recordPath)) {
+                std::cerr << "could not write input recording: " << recordPath << std::endl;
+                return 1;
+            }
+        }
+        else {
+            frontend.Run(myChip8, instructionsPerFrame);
+        }
+        return WriteInstrumentation(myChip8, instrumentationOutput, program_path);
+#endif
+
+        return 0;
+    }, chip8);
+};
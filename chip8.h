@@ -0,0 +1,1806 @@
+#pragma once
+
+#include <string>
+#include <filesystem>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <random>
+#include <algorithm>
+#include <iterator>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <memory>
+#include <variant>
+#include <cctype>
+
+#include "quirks.h"
+
+#ifdef CHIP8_INSTRUMENT
+#include "instrument.h"
+#endif
+
+/*
+    The different ways Step and RunFor can get from one instruction to the next. They all run exactly the same program to
+    exactly the same place, they just make different trade offs, and which one is quickest depends on the host CPU
+    (--bench-dispatch measures them all).
+
+        Switch       fetch the two bytes and walk RunOpcode's nested switch every time. the original interpreter
+        DecodeCache  decode once per address and keep it (see DecodedInstruction). writes to code throw slots away
+        Table        one decoded entry for every one of the 65536 possible opcodes, built once and shared by every chip8
+                     of the same profile. nothing to throw away when a program writes over itself
+        Threaded     the same table, but RunFor jumps from the end of each handler straight to the next one (computed goto)
+                     instead of going back round a loop. every handler gets its own indirect jump, so the branch predictor
+                     learns "what comes after a 7xkk" rather than having one jump that has to guess everything
+*/
+enum class Chip8Dispatch { Switch, DecodeCache, Table, Threaded };
+
+// computed goto is a GCC / Clang extension. anywhere else, and in instrumented builds where every step has to go through
+// Step to be counted, Threaded quietly runs as Table
+#if defined(__GNUC__) && !defined(CHIP8_INSTRUMENT)
+#define CHIP8_THREADED_DISPATCH 1
+#endif
+
+// every instruction handler the core has, in one list so the threaded interpreter can give each one its own label
+#define CHIP8_OPCODE_HANDLERS(X) \
+    X(OpNothing) X(OpUnknown) X(OpClearScreen) X(OpReturn) X(OpJump) X(OpCall) X(OpSkipEqualByte) \
+    X(OpSkipNotEqualByte) X(OpSkipEqualRegister) X(OpLoadByte) X(OpAddByte) X(OpLoadRegister) X(OpOr) X(OpAnd) \
+    X(OpXor) X(OpAddRegister) X(OpSub) X(OpShiftRight) X(OpSubN) X(OpShiftLeft) X(OpSkipNotEqualRegister) \
+    X(OpLoadIndex) X(OpJumpV0) X(OpRandom) X(OpDraw) X(OpSkipKeyPressed) X(OpSkipKeyNotPressed) \
+    X(OpLoadDelayTimer) X(OpWaitForKey) X(OpSetDelayTimer) X(OpSetSoundTimer) X(OpAddIndex) X(OpLoadFont) \
+    X(OpStoreBcd) X(OpStoreRegisters) X(OpLoadRegisters) X(OpScrollDown) X(OpScrollUp) X(OpScrollRight) \
+    X(OpScrollLeft) X(OpExit) X(OpLowResolution) X(OpHighResolution) X(OpStoreRegisterRange) \
+    X(OpLoadRegisterRange) X(OpLoadLongIndex) X(OpSelectPlanes) X(OpLoadAudioPattern) X(OpSetPitch) \
+    X(OpLoadBigFont) X(OpSaveFlags) X(OpLoadFlags)
+
+/*
+    The chip8 core. This is just the machine itself: memory, registers, timers and the display buffer.
+    It knows nothing about windows, keyboards or SDL so that it can be run headless (on a CI box with no display for example)
+    and as fast as the host will go. Whatever is driving it (see sdl_frontend.h for the interactive one) is responsible
+    for feeding it key presses, ticking the timers and putting the display on a screen.
+
+    The interpreters people have written over the years don't all agree on what some instructions do, so the core is a
+    template over a set of quirks (see quirks.h). Every quirk is a compile time constant so each profile gets its own
+    interpreter with the choices baked in, and nothing on the hot path ever checks which one it is. `Chip8` is the plain
+    COSMAC VIP flavour; CreateChip8 at the bottom of this file picks one at run time.
+*/
+template <typename QuirkSet>
+class Chip8Core
+{
+    public:
+
+        typedef QuirkSet Quirks;
+
+        /*
+            How big the machine is, which depends on the profile. SUPER-CHIP and XO-CHIP keep their screen at 128 x 64 all the
+            time and draw low resolution pixels as 2 x 2 blocks, so whoever shows it only ever has the one size to deal with.
+            The display is `displayPlanes` screens one after the other, each one `displayHeight` rows of `displayWordsPerRow` words.
+        */
+        static constexpr unsigned int memorySize = Quirks::hasXoChip ? 65536 : 4096;
+        static constexpr unsigned int memoryMask = memorySize - 1;
+        static constexpr unsigned int displayWidth = Quirks::hasSuperChip ? 128 : 64;
+        static constexpr unsigned int displayHeight = Quirks::hasSuperChip ? 64 : 32;
+        static constexpr unsigned int displayWordsPerRow = displayWidth / 64;
+        static constexpr unsigned int displayPlanes = Quirks::hasXoChip ? 2 : 1;
+        static constexpr unsigned int displayWords = displayPlanes * displayHeight * displayWordsPerRow;
+
+    private:
+
+    // we need somewhere to store our current opcode. 
+    unsigned short currentOpcode = 0;
+
+    /*  
+        We need some memory allocated to our chip8
+        the chip 8 has 4096 bytes of memory (XO-CHIP has 64 KB). 
+        The memory  in location 0x000 to 0x1ff (0-511) is saved for the interpreter but in our case we shall use it for font storage
+        This will matter when we write the function to load our program. We need to make sure to load it into the correct bit of memory 
+    */
+    unsigned char memory[memorySize] = { 0 };
+
+    /*
+        The chip8 has a display of resolution 64 x 32 and is monochrome. 
+        THe way sprites are drawn to the display involves XORing the sprite with the current display buffer so need to pick a datatype that will play nicely with that.
+        Ideally I can just use a bit. You can't address single bits in c++ but a row is exactly 64 pixels wide, so a whole row fits in one uint64_t
+        and we can work on all of its bits at once. The leftmost pixel (x = 0) is the top bit of the word and the rightmost (x = 63) is the bottom bit.
+        That makes drawing a sprite row one shift, one AND to spot collisions and one XOR, and the whole screen is only 256 bytes.
+        The 128 pixel wide screens are two words per row, left half first, and scrolling sideways is a shift across the pair.
+    */
+    uint64_t display[displayWords] = { 0 }; // one word per row (two when hi-res), 1 bits are on and 0 bits are off
+
+    // set whenever 00E0 or DXYN touch the display so the frontend knows it has something new to draw.
+    // starts off true so the very first frame always gets drawn
+    bool displayDirty = true;
+
+    /*
+        SUPER-CHIP and XO-CHIP state. The plain chip8 never touches any of it so it just sits at the defaults
+    */
+    bool hires = false; // 00FF turns high resolution on and 00FE turns it back off
+    unsigned char planeMask = 1; // which bitplanes drawing, clearing and scrolling work on (Fn01). plane 0 is bit 0
+    unsigned char rplFlags[16] = { 0 }; // the HP48's RPL user flags, which Fx75 / Fx85 use as a little save area
+    unsigned char audioPattern[16] = { 0 }; // 128 one bit samples that XO-CHIP plays on a loop while the sound timer runs (F002)
+    unsigned char pitch = 64; // how fast the pattern plays: 4000 * 2^((pitch - 64) / 48) samples a second (Fx3A)
+    
+    /*
+        The program counter which points to the currenty instruction in memory. This is then always just a memory address. i.e. an integer between 0 and 4095 (since that's the size memory we have)
+    */
+    unsigned short programCounter = 0;
+    
+    /*
+        The index register is a 16 bit register that is used for operations related to reading and writing memory. 
+    */
+    unsigned short indexRegister = 0;
+
+    /*
+        General purpose variable regsiters. Each 1 byte long. There are 16 of them lablled V0 to VF with VF being used as a flag resister
+        They have to be exactly 8 bits so that adding past 255 (or taking away past 0) wraps round the same way it did on the real thing
+    */
+
+    unsigned char vRegister[16] = {0};
+
+    unsigned char delayTimer = 0;
+
+    unsigned char soundTimer = 0;
+
+    /*
+        We also need a stack so that we can enable subroutines and jumping
+    */
+
+    unsigned short stack[16] = { 0 };
+    unsigned short stackPointer = 0;
+
+    /*
+        And finally a variable to store which keys are currently being pressed. The chip8 has 16 keys labelled 0-F,
+        so they all fit in one 16 bit number with bit n set while key n is held.
+        It's atomic because the frontend can set keys from a different thread to the one running the chip8. Copying a Chip8
+        copies whatever was held at the time.
+    */
+    struct KeyMask : std::atomic<uint16_t> {
+        KeyMask() : std::atomic<uint16_t>(0) {}
+        KeyMask(const KeyMask& other) : std::atomic<uint16_t>(other.load(std::memory_order_relaxed)) {}
+        KeyMask& operator=(const KeyMask& other) {
+            store(other.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            return *this;
+        }
+    };
+
+    KeyMask keys;
+
+    unsigned int disp_index = 0;
+
+    /*
+        State for Cxkk's random numbers. Every chip8 has its own xoshiro256** generator so runs can be repeated exactly by
+        seeding them the same way (see Seed), and getting a number is a few shifts and XORs instead of asking the OS for entropy.
+    */
+    uint64_t rngState[4] = { 0 };
+
+    /*
+        Decoded instruction cache. Fetching two bytes and picking the opcode apart nibble by nibble on every single step adds up,
+        so the first time we run the instruction at an address we decode it once and keep the result: which handler to call and
+        all of the operands already pulled out. Every address from 0x200 up gets its own slot.
+        If the program writes over its own code (Fx33 and Fx55 can do that) the slots it touched get thrown away and are decoded
+        again the next time we get there.
+    */
+    struct DecodedInstruction;
+    typedef void (*OpcodeHandler)(Chip8Core& chip8, const DecodedInstruction& op);
+
+    struct DecodedInstruction {
+        OpcodeHandler handler = nullptr; // nullptr means this slot hasn't been decoded yet
+        unsigned short opcode = 0;
+        unsigned short nnn = 0; // lowest 12 bits, an address
+        unsigned char x = 0; // second nibble
+        unsigned char y = 0; // third nibble
+        unsigned char n = 0; // fourth nibble
+        unsigned char kk = 0; // lowest byte
+    };
+
+    static const unsigned short decodeCacheStart = 0x200;
+    static const unsigned short decodeCacheSize = memorySize - 0x200;
+    DecodedInstruction decodeCache[decodeCacheSize];
+
+    Chip8Dispatch dispatch = Chip8Dispatch::DecodeCache;
+    const DecodedInstruction* opcodeTable = nullptr; // the shared 64K entry table, only looked up once Table or Threaded is picked
+
+    /*
+        Memory split into pages of 256 bytes, each with a counter that goes up whenever something writes into that page.
+        Anything that caches translated code (the JIT in jit_x64.h) remembers the counters it saw and knows to throw its work away when they change.
+    */
+    static const unsigned int codePageCount = memorySize / 256;
+    unsigned int codePageVersion[codePageCount] = { 0 };
+
+    /*
+        Idle loop skipping. Games spend most of their time going round little loops waiting for the delay timer to run out
+        (Fx07, 3x00, 1nnn) or for a key (Fx0A). Nothing in the machine can change while they do that apart from the timers and
+        the keys, and those only tick or change between calls to RunFor. So whenever we jump backwards we compare the registers
+        and the timers (the program can set those itself with Fx15 / Fx18) with the last time we jumped backwards: if they're
+        exactly the same and nothing was written to memory, the display, the stack or the random numbers in between, then the
+        same few instructions are just going to repeat until RunFor is done.
+        We skip every whole trip round the loop that would fit and run the few instructions left over, which ends up in exactly
+        the state running them all would have.
+    */
+    struct IdleCheck {
+        bool valid = false; // false until we've seen a backward jump in this RunFor
+        unsigned long long step = 0; // how far into RunFor the jump happened
+        unsigned long long writes = 0;
+        unsigned short programCounter = 0;
+        unsigned short indexRegister = 0;
+        unsigned short stackPointer = 0;
+        unsigned char delayTimer = 0;
+        unsigned char soundTimer = 0;
+        unsigned char vRegister[16] = { 0 };
+    };
+    IdleCheck idleCheck;
+    bool loopedBack = false; // set by a jump to the same or an earlier address, and by Fx0A waiting
+    unsigned long long stateWrites = 0; // goes up on every write to memory, the display, the stack or the random numbers
+    unsigned long long idleInstructions = 0; // instructions skipped over rather than run
+    bool useIdleSkip = true;
+
+#ifdef CHIP8_INSTRUMENT
+    // counters, address histogram and trace of everything Step runs (see instrument.h). only there in instrumented builds
+    Instrumentation instrumentation{ memorySize };
+
+    // looks at the registers when a step starts and hands the before and after to the instrumentation when it ends,
+    // however Step happens to return
+    struct InstrumentedStep {
+        Chip8Core& chip8;
+        Instrumentation::Before before;
+        explicit InstrumentedStep(Chip8Core& chip8)
+            : chip8(chip8), before(Instrumentation::Capture(chip8.programCounter, chip8.indexRegister, chip8.vRegister)) {}
+        ~InstrumentedStep() {
+            chip8.instrumentation.Record(before, chip8.currentOpcode, chip8.indexRegister, chip8.vRegister);
+        }
+    };
+#endif
+
+    friend class Chip8Jit;
+    friend class LockstepEngine;
+    friend class Savestate;
+    friend class ConformanceHarness;
+    friend class RomAnalyzer;
+
+    // Chip 8 Methods
+    public:
+
+        void Initialize(){
+            // initialise all the registers and memory once the chip8 is created.
+            // no graphics in here any more, the frontend sets up its own window if it wants one
+            InitialiseFont();            
+            programCounter = 0x200; // start at the beginning of the program memory
+
+            // a different game every time unless someone calls Seed afterwards
+            std::random_device rd;
+            Seed((static_cast<uint64_t>(rd()) << 32) | rd());
+
+        };
+
+        static constexpr unsigned int maxProgramSize = memorySize - 0x200; // everything from 0x200 to the end of memory
+
+        bool LoadProgram(std::string program_path) {
+            // load the specified program into memory location 0x200. false if the file is missing, empty or bigger than maxProgramSize
+            std::filesystem::path path = program_path;
+            std::error_code error;
+            auto length = std::filesystem::file_size(path, error);
+            if (error || length == 0 || length > maxProgramSize) {
+                return false;
+            }
+            // straight into memory, there's no need to go through a buffer of our own
+            std::ifstream inputFile(program_path, std::ios::binary);
+            bool loaded = static_cast<bool>(inputFile.read(reinterpret_cast<char*>(memory + 0x200), length));
+            // anything we decoded from a previous program is no good any more (even if the read stopped halfway)
+            InvalidateDecodeCache(decodeCacheStart, decodeCacheSize);
+            return loaded;
+        };
+
+        bool LoadProgram(const unsigned char* program, size_t length) {
+            // the same for a program that's already in memory, like one in a mapped ROM corpus (see corpus.h)
+            if (length == 0 || length > maxProgramSize) {
+                return false;
+            }
+            std::memcpy(memory + 0x200, program, length);
+            InvalidateDecodeCache(decodeCacheStart, decodeCacheSize);
+            return true;
+        };
+
+        int Step() {
+#ifdef CHIP8_INSTRUMENT
+            InstrumentedStep instrumented(*this);
+#endif
+            // fast path: anything in program memory goes through the decoded instruction cache
+            // (unsigned maths means a program counter below 0x200 wraps round and fails the size check too)
+            unsigned short slot = programCounter - decodeCacheStart;
+            if (dispatch == Chip8Dispatch::DecodeCache && slot < decodeCacheSize) {
+                DecodedInstruction& op = decodeCache[slot];
+                if (op.handler == nullptr) {
+                    op = Decode(memory[programCounter] << 8 | memory[(programCounter + 1) & memoryMask]);
+                }
+                currentOpcode = op.opcode;
+                programCounter += 2;
+                op.handler(*this, op);
+                return 0;
+            }
+
+            // fetch the opcode
+            currentOpcode = memory[programCounter & memoryMask] << 8 | memory[(programCounter + 1) & memoryMask];
+            programCounter += 2;
+
+            if (dispatch >= Chip8Dispatch::Table) {
+                // a single step has nothing to thread on to, so Threaded is just the table here
+                const DecodedInstruction& op = opcodeTable[currentOpcode];
+                op.handler(*this, op);
+                return 0;
+            }
+
+            // decode and execute the opcode
+            RunOpcode(currentOpcode);
+
+            return 0;
+        };
+
+        unsigned long long RunFor(unsigned long long cycles) {
+            // run a fixed number of instructions back to back with no throttling at all.
+            // instructions that would only go round an idle loop are skipped (see IdleCheck) but still count as run
+#ifdef CHIP8_THREADED_DISPATCH
+            if (dispatch == Chip8Dispatch::Threaded) {
+                return RunThreaded(cycles);
+            }
+#endif
+            idleCheck.valid = false;
+            for (unsigned long long i = 0; i < cycles; i++) {
+                Step();
+                if (loopedBack && useIdleSkip) {
+                    i += SkipIdleLoop(i + 1, cycles);
+                }
+                loopedBack = false;
+            }
+            return cycles;
+        };
+
+        template <typename Predicate>
+        unsigned long long RunUntil(Predicate done) {
+            // keep stepping until the predicate says we're done. it gets handed the chip8 so it can look at
+            // whatever it likes (the program counter, a register, the display...). returns how many instructions we ran
+            unsigned long long cycles = 0;
+            while (!done(*this)) {
+                Step();
+                cycles++;
+            }
+            return cycles;
+        };
+
+        void SetIdleSkipEnabled(bool enabled) {
+            // idle loop skipping never changes the result, this is just for measuring what it saves
+            useIdleSkip = enabled;
+        };
+
+        unsigned long long GetIdleInstructions() const {
+            // how many instructions RunFor has skipped over because they were going round an idle loop
+            return idleInstructions;
+        };
+
+        void SetDecodeCacheEnabled(bool enabled) {
+            // mostly useful for comparing the cached and uncached interpreters against each other
+            SetDispatch(enabled ? Chip8Dispatch::DecodeCache : Chip8Dispatch::Switch);
+        };
+
+        void SetDispatch(Chip8Dispatch strategy) {
+            // pick how instructions get run (see Chip8Dispatch). safe to change between any two steps
+            dispatch = strategy;
+            if (dispatch >= Chip8Dispatch::Table) {
+                opcodeTable = OpcodeTable();
+            }
+            InvalidateDecodeCache(decodeCacheStart, decodeCacheSize);
+        };
+
+        void PrewarmDecodeCache(unsigned int start, unsigned int end) {
+            // decode start .. end - 1 into the decode cache now rather than the first time each instruction runs. the ROM
+            // analyzer (analyzer.h) knows where the code is, so a run started from its metadata never stops to decode.
+            // the other dispatch strategies don't use the per-address slots so there's nothing to do for them
+            if (dispatch != Chip8Dispatch::DecodeCache) {
+                return;
+            }
+            start = std::max<unsigned int>(start, decodeCacheStart);
+            end = std::min<unsigned int>(end, decodeCacheStart + decodeCacheSize);
+            for (unsigned int address = start; address < end; address += 2) {
+                DecodedInstruction& op = decodeCache[address - decodeCacheStart];
+                if (op.handler == nullptr) {
+                    op = Decode(memory[address] << 8 | memory[(address + 1) & memoryMask]);
+                }
+            }
+        };
+
+        Chip8Dispatch GetDispatch() const {
+            return dispatch;
+        };
+
+        bool StateEquals(const Chip8Core& other) const {
+            // true if the two machines are in exactly the same state. used to check different ways of running
+            // the same program (interpreter, decoded cache, JIT) against each other
+            return programCounter == other.programCounter
+                && indexRegister == other.indexRegister
+                && stackPointer == other.stackPointer
+                && delayTimer == other.delayTimer
+                && soundTimer == other.soundTimer
+                && std::equal(std::begin(vRegister), std::end(vRegister), std::begin(other.vRegister))
+                && std::equal(std::begin(stack), std::end(stack), std::begin(other.stack))
+                && std::equal(std::begin(memory), std::end(memory), std::begin(other.memory))
+                && std::equal(std::begin(display), std::end(display), std::begin(other.display))
+                && hires == other.hires
+                && planeMask == other.planeMask
+                && pitch == other.pitch
+                && std::equal(std::begin(rplFlags), std::end(rplFlags), std::begin(other.rplFlags))
+                && std::equal(std::begin(audioPattern), std::end(audioPattern), std::begin(other.audioPattern));
+        };
+
+        uint64_t StateHash() const {
+            // a 64 bit FNV-1a hash of the registers, stack, timers and display. two runs that end up in the same place
+            // get the same hash so it's a cheap way to compare batch runs without keeping the whole machine around
+            uint64_t hash = 14695981039346656037ull;
+            auto mix = [&hash](const void* data, size_t length) {
+                const unsigned char* bytes = static_cast<const unsigned char*>(data);
+                for (size_t i = 0; i < length; i++) {
+                    hash ^= bytes[i];
+                    hash *= 1099511628211ull;
+                }
+            };
+            mix(vRegister, sizeof(vRegister));
+            mix(&indexRegister, sizeof(indexRegister));
+            mix(&programCounter, sizeof(programCounter));
+            mix(stack, sizeof(stack));
+            mix(&stackPointer, sizeof(stackPointer));
+            mix(&delayTimer, sizeof(delayTimer));
+            mix(&soundTimer, sizeof(soundTimer));
+            mix(display, sizeof(display));
+            if constexpr (Quirks::hasSuperChip) {
+                // only mixed in where they can change, so plain chip8 hashes are the same as they always were
+                mix(&hires, sizeof(hires));
+                mix(&planeMask, sizeof(planeMask));
+                mix(rplFlags, sizeof(rplFlags));
+                mix(audioPattern, sizeof(audioPattern));
+                mix(&pitch, sizeof(pitch));
+            }
+            return hash;
+        };
+
+#ifdef CHIP8_INSTRUMENT
+        const Instrumentation& GetInstrumentation() const {
+            return instrumentation;
+        };
+#endif
+
+        unsigned short GetCurrentOpcode() const {
+            return currentOpcode;
+        };
+
+        void TickTimers() {
+            // the delay and sound timers count down to zero. whoever is driving us decides how often this happens
+            delayTimer = (delayTimer > 0) ? delayTimer - 1 : 0;
+            soundTimer = (soundTimer > 0) ? soundTimer - 1 : 0;
+        };
+
+        void Seed(uint64_t seed) {
+            // fill the generator state from one number with splitmix64, which is what the xoshiro authors recommend
+            for (uint64_t& word : rngState) {
+                seed += 0x9E3779B97F4A7C15ull;
+                uint64_t z = seed;
+                z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+                z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+                word = z ^ (z >> 31);
+            }
+        };
+
+        uint16_t GetKeyMask() const {
+            // all 16 keys as one number, bit n set if key n is held
+            return keys.load(std::memory_order_relaxed);
+        };
+
+        void SetKeyMask(uint16_t mask) {
+            keys.store(mask, std::memory_order_relaxed);
+        };
+
+        void SetKey(unsigned char keyIndex, bool isPressed) {
+            uint16_t bit = 1 << (keyIndex & 0xF);
+            if (isPressed) {
+                keys.fetch_or(bit, std::memory_order_relaxed);
+            }
+            else {
+                keys.fetch_and(~bit, std::memory_order_relaxed);
+            }
+        };
+
+        bool IsKeyPressed(unsigned char keyIndex) const {
+            return (keys.load(std::memory_order_relaxed) >> (keyIndex & 0xF)) & 0x1;
+        };
+
+        const uint64_t* GetDisplay() const {
+            // displayWords words laid out as described at the top of the class, x = 0 in the top bit of a row's first word.
+            // see framebuffer.h for turning it into pixels
+            return display;
+        };
+
+        bool TakeDisplayDirty() {
+            // has the display changed since the last time anyone asked? asking resets it
+            bool wasDirty = displayDirty;
+            displayDirty = false;
+            return wasDirty;
+        };
+
+        bool GetPixel(unsigned int x, unsigned int y) const {
+            // plane 0 only, in screen pixels (so 128 x 64 on SUPER-CHIP whatever resolution the program is using)
+            x %= displayWidth;
+            y %= displayHeight;
+            return (display[y * displayWordsPerRow + x / 64] >> (63 - (x % 64))) & 0x1;
+        };
+
+        bool IsHighResolution() const {
+            return hires;
+        };
+
+        const unsigned char* GetAudioPattern() const {
+            // the 16 byte XO-CHIP sample pattern, first sample in the top bit of the first byte
+            return audioPattern;
+        };
+
+        unsigned char GetPitch() const {
+            return pitch;
+        };
+
+        unsigned short GetProgramCounter() const {
+            return programCounter;
+        };
+
+        unsigned short GetRegister(unsigned char index) const {
+            return vRegister[index & 0xF];
+        };
+
+        unsigned char GetSoundTimer() const {
+            return soundTimer;
+        };
+
+    private:
+
+        unsigned long long SkipIdleLoop(unsigned long long done, unsigned long long cycles) {
+            // we just jumped backwards, `done` instructions into a RunFor of `cycles`. returns how many more to skip
+            IdleCheck& last = idleCheck;
+            bool repeated = last.valid
+                && last.programCounter == programCounter
+                && last.writes == stateWrites
+                && last.indexRegister == indexRegister
+                && last.stackPointer == stackPointer
+                && last.delayTimer == delayTimer
+                && last.soundTimer == soundTimer
+                && std::equal(std::begin(vRegister), std::end(vRegister), std::begin(last.vRegister));
+            if (repeated) {
+                // the machine is right back where it was `period` instructions ago, so it will be again every `period`
+                unsigned long long period = done - last.step;
+                unsigned long long remaining = cycles - done;
+                unsigned long long skip = remaining - remaining % period;
+                idleInstructions += skip;
+                last.step = done + skip;
+                return skip;
+            }
+            last.valid = true;
+            last.step = done;
+            last.writes = stateWrites;
+            last.programCounter = programCounter;
+            last.indexRegister = indexRegister;
+            last.stackPointer = stackPointer;
+            last.delayTimer = delayTimer;
+            last.soundTimer = soundTimer;
+            std::copy(std::begin(vRegister), std::end(vRegister), std::begin(last.vRegister));
+            return 0;
+        }
+
+        // random byte generator function
+        unsigned char RandomByte() {
+            // one step of xoshiro256**. the top bits are the best ones so the byte comes from the top of the result
+            // remembering that a byte is effectively any number betwwen 0 and 255
+            // since 2^8 = 256
+            stateWrites++;
+            uint64_t result = RotateLeft(rngState[1] * 5, 7) * 9;
+            uint64_t t = rngState[1] << 17;
+            rngState[2] ^= rngState[0];
+            rngState[3] ^= rngState[1];
+            rngState[1] ^= rngState[2];
+            rngState[0] ^= rngState[3];
+            rngState[2] ^= t;
+            rngState[3] = RotateLeft(rngState[3], 45);
+            return static_cast<unsigned char>(result >> 56);
+        }
+
+        static uint64_t RotateLeft(uint64_t value, int amount) {
+            return (value << amount) | (value >> (64 - amount));
+        }
+
+        void SkipIf(bool condition) {
+            // the skip instructions. pc is already on the next instruction, which is normally 2 bytes long, but on XO-CHIP
+            // it might be F000 nnnn which is 4 and has to be skipped over as a whole
+            if (condition) {
+                programCounter += 2;
+                if constexpr (Quirks::hasXoChip) {
+                    if (memory[(programCounter - 2) & memoryMask] == 0xF0 && memory[(programCounter - 1) & memoryMask] == 0x00) {
+                        programCounter += 2;
+                    }
+                }
+            }
+        }
+
+        uint64_t* Plane(unsigned int plane) {
+            return display + plane * displayHeight * displayWordsPerRow;
+        }
+
+        void ClearDisplay() {
+            // the whole screen is 32 words so this is just a 256 byte clear. with bitplanes only the selected ones get cleared
+            if constexpr (displayPlanes > 1) {
+                for (unsigned int plane = 0; plane < displayPlanes; plane++) {
+                    if ((planeMask >> plane) & 0x1) {
+                        std::fill(Plane(plane), Plane(plane) + displayHeight * displayWordsPerRow, 0);
+                    }
+                }
+            }
+            else {
+                std::fill(std::begin(display), std::end(display), 0);
+            }
+            displayDirty = true;
+            stateWrites++;
+        }
+
+        void SetHighResolution(bool enabled) {
+            // 00FE / 00FF. the old picture would be the wrong size so the whole screen (every plane) starts again blank
+            hires = enabled;
+            std::fill(std::begin(display), std::end(display), 0);
+            displayDirty = true;
+            stateWrites++;
+        }
+
+        /*
+            Scrolling. Amounts are in the program's own pixels, so twice as many screen pixels in low resolution. Up and down
+            just move whole rows, and left and right shift each row's pair of words across by a few bits with the bits that
+            cross the middle carried from one word to the other, instead of moving pixels one at a time.
+            Only the SUPER-CHIP and XO-CHIP profiles use these so a row is always two words here.
+        */
+        void ScrollDown(unsigned int amount) {
+            unsigned int rows = std::min(amount * (hires ? 1 : 2), displayHeight);
+            for (unsigned int plane = 0; plane < displayPlanes; plane++) {
+                if ((planeMask >> plane) & 0x1) {
+                    uint64_t* rowsStart = Plane(plane);
+                    std::copy_backward(rowsStart, rowsStart + (displayHeight - rows) * 2, rowsStart + displayHeight * 2);
+                    std::fill(rowsStart, rowsStart + rows * 2, 0);
+                }
+            }
+            displayDirty = true;
+            stateWrites++;
+        }
+
+        void ScrollUp(unsigned int amount) {
+            unsigned int rows = std::min(amount * (hires ? 1 : 2), displayHeight);
+            for (unsigned int plane = 0; plane < displayPlanes; plane++) {
+                if ((planeMask >> plane) & 0x1) {
+                    uint64_t* rowsStart = Plane(plane);
+                    std::copy(rowsStart + rows * 2, rowsStart + displayHeight * 2, rowsStart);
+                    std::fill(rowsStart + (displayHeight - rows) * 2, rowsStart + displayHeight * 2, 0);
+                }
+            }
+            displayDirty = true;
+            stateWrites++;
+        }
+
+        void ScrollRight() {
+            // 00FB, always 4 pixels
+            const unsigned int bits = hires ? 4 : 8;
+            for (unsigned int plane = 0; plane < displayPlanes; plane++) {
+                if ((planeMask >> plane) & 0x1) {
+                    uint64_t* row = Plane(plane);
+                    for (unsigned int y = 0; y < displayHeight; y++, row += 2) {
+                        row[1] = (row[1] >> bits) | (row[0] << (64 - bits));
+                        row[0] >>= bits;
+                    }
+                }
+            }
+            displayDirty = true;
+            stateWrites++;
+        }
+
+        void ScrollLeft() {
+            // 00FC, always 4 pixels
+            const unsigned int bits = hires ? 4 : 8;
+            for (unsigned int plane = 0; plane < displayPlanes; plane++) {
+                if ((planeMask >> plane) & 0x1) {
+                    uint64_t* row = Plane(plane);
+                    for (unsigned int y = 0; y < displayHeight; y++, row += 2) {
+                        row[0] = (row[0] << bits) | (row[1] >> (64 - bits));
+                        row[1] <<= bits;
+                    }
+                }
+            }
+            displayDirty = true;
+            stateWrites++;
+        }
+
+        static uint32_t Widen(uint32_t bits) {
+            // double every bit of a 16 bit number (abcd -> aabbccdd) for drawing low resolution sprites on the big screen.
+            // spreads the bits out with a gap between each one, then fills the gaps with a copy
+            bits = (bits | (bits << 8)) & 0x00FF00FF;
+            bits = (bits | (bits << 4)) & 0x0F0F0F0F;
+            bits = (bits | (bits << 2)) & 0x33333333;
+            bits = (bits | (bits << 1)) & 0x55555555;
+            return bits | (bits << 1);
+        }
+
+        unsigned int DrawSpriteExtended(unsigned int vx, unsigned int vy, unsigned int height) {
+            // the SUPER-CHIP / XO-CHIP version of DrawSprite. Dxy0 draws 16 x 16, low resolution pixels are drawn 2 x 2, and
+            // every selected bitplane gets its own sprite, one after the other in memory starting at I
+            const unsigned int scale = hires ? 1 : 2;
+            const bool wide = (height == 0);
+            const unsigned int rows = wide ? 16 : height;
+            const unsigned int spriteWidth = (wide ? 16 : 8) * scale; // at most 32 so a sprite row never spans more than two words
+            const unsigned int x = (vx % (displayWidth / scale)) * scale;
+            const unsigned int y = (vy % (displayHeight / scale)) * scale;
+            unsigned int address = indexRegister;
+            uint64_t collision = 0;
+            for (unsigned int plane = 0; plane < displayPlanes; plane++) {
+                if (((planeMask >> plane) & 0x1) == 0) {
+                    continue;
+                }
+                uint64_t* planeRows = Plane(plane);
+                for (unsigned int i = 0; i < rows; i++) {
+                    uint32_t bits = memory[address & memoryMask];
+                    if (wide) {
+                        bits = (bits << 8) | memory[(address + 1) & memoryMask];
+                    }
+                    address += wide ? 2 : 1;
+                    if (scale == 2) {
+                        bits = Widen(bits);
+                    }
+
+                    // put the sprite row at the top of the left word then slide it across to column x, carrying whatever
+                    // goes past the middle into the right word. whatever goes past the right edge is either lost or, if
+                    // sprites wrap, comes back in on the left
+                    uint64_t left = static_cast<uint64_t>(bits) << (64 - spriteWidth);
+                    uint64_t right = 0;
+                    if (x >= 64) {
+                        right = left >> (x - 64);
+                        left = (Quirks::spritesWrap && x > 64) ? left << (128 - x) : 0;
+                    }
+                    else if (x > 0) {
+                        right = left << (64 - x);
+                        left >>= x;
+                    }
+
+                    for (unsigned int repeat = 0; repeat < scale; repeat++) {
+                        unsigned int screenY = y + i * scale + repeat;
+                        if (screenY >= displayHeight) {
+                            if constexpr (!Quirks::spritesWrap) {
+                                continue;
+                            }
+                            screenY -= displayHeight;
+                        }
+                        uint64_t* row = planeRows + screenY * 2;
+                        collision |= (row[0] & left) | (row[1] & right);
+                        row[0] ^= left;
+                        row[1] ^= right;
+                    }
+                }
+            }
+            displayDirty = true;
+            stateWrites++;
+            return collision != 0 ? 1 : 0;
+        }
+
+        unsigned int DrawSprite(unsigned int vx, unsigned int vy, unsigned int height) {
+            // XOR an 8 pixel wide, `height` tall sprite from memory[I] onto the screen at (vx, vy).
+            // the starting position wraps round the screen but the sprite itself gets clipped at the right and bottom edges.
+            // returns 1 if any pixel that was on got turned off (a collision) and 0 otherwise
+            if constexpr (Quirks::hasSuperChip) {
+                return DrawSpriteExtended(vx, vy, height);
+            }
+            unsigned int x = vx % 64;
+            unsigned int y = vy % 32;
+            uint64_t collision = 0;
+            if constexpr (Quirks::spritesWrap) {
+                // same again but anything that goes off the right or the bottom comes back in on the left or the top,
+                // which is a rotate instead of a shift
+                for (unsigned int i = 0; i < height; i++) {
+                    uint64_t sprite_byte = static_cast<uint64_t>(memory[(indexRegister + i) & memoryMask]) << 56;
+                    uint64_t sprite_row = (x == 0) ? sprite_byte : (sprite_byte >> x) | (sprite_byte << (64 - x));
+                    uint64_t& row = display[(y + i) % 32];
+                    collision |= row & sprite_row;
+                    row ^= sprite_row;
+                }
+            }
+            else {
+                for (unsigned int i = 0; i < height && y + i < 32; i++) {
+                    // put the sprite byte at the top of a word then slide it across to column x.
+                    // anything that would land past column 63 falls off the bottom of the word which does the clipping for us
+                    uint64_t sprite_row = (static_cast<uint64_t>(memory[(indexRegister + i) & memoryMask]) << 56) >> x;
+                    collision |= display[y + i] & sprite_row;
+                    display[y + i] ^= sprite_row;
+                }
+            }
+            displayDirty = true;
+            stateWrites++;
+            return collision != 0 ? 1 : 0;
+        }
+
+        void InitialiseFont() {
+            // load the font into memory
+            unsigned char font[80] = {
+                0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
+                0x20, 0x60, 0x20, 0x20, 0x70, // 1
+                0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
+                0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
+                0x90, 0x90, 0xF0, 0x10, 0x10, // 4
+                0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
+                0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
+                0xF0, 0x10, 0x20, 0x40, 0x40, // 7
+                0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
+                0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
+                0xF0, 0x90, 0xF0, 0x90, 0x90, // A
+                0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
+                0xF0, 0x80, 0x80, 0x80, 0xF0, // C
+                0xE0, 0x90, 0x90, 0x90, 0xE0, // D
+                0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
+                0xF0, 0x80, 0xF0, 0x80, 0x80  // F
+            };
+
+            // copy the font into memory (it is convention  to store the font in memory location 0x50)
+            for (int i = 0; i < 80; i++) {
+                memory[i + 0x050] = font[i];
+            }
+
+            if constexpr (Quirks::hasSuperChip) {
+                // SUPER-CHIP's big 8 x 10 digits for Fx30 go straight after the small ones, at 0x0A0
+                unsigned char bigFont[160] = {
+                    0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, // 0
+                    0x18, 0x78, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0xFF, 0xFF, // 1
+                    0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // 2
+                    0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 3
+                    0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0x03, 0x03, // 4
+                    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 5
+                    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 6
+                    0xFF, 0xFF, 0x03, 0x03, 0x06, 0x0C, 0x18, 0x18, 0x18, 0x18, // 7
+                    0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 8
+                    0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 9
+                    0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, // A
+                    0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, // B
+                    0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, // C
+                    0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+                    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // E
+                    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0  // F
+                };
+                for (int i = 0; i < 160; i++) {
+                    memory[i + 0x0A0] = bigFont[i];
+                }
+            }
+        }
+
+        void StoreRegisterRange(unsigned char x, unsigned char y) {
+            // XO-CHIP 5xy2: Vx to Vy (backwards if x > y) into memory at I. I doesn't move
+            int step = (x <= y) ? 1 : -1;
+            unsigned int count = (x <= y) ? y - x + 1 : x - y + 1;
+            for (unsigned int i = 0; i < count; i++) {
+                memory[(indexRegister + i) & memoryMask] = vRegister[x + step * static_cast<int>(i)];
+            }
+            InvalidateDecodeCache(indexRegister, count);
+        }
+
+        void LoadRegisterRange(unsigned char x, unsigned char y) {
+            // XO-CHIP 5xy3: the other way round
+            int step = (x <= y) ? 1 : -1;
+            unsigned int count = (x <= y) ? y - x + 1 : x - y + 1;
+            for (unsigned int i = 0; i < count; i++) {
+                vRegister[x + step * static_cast<int>(i)] = memory[(indexRegister + i) & memoryMask];
+            }
+        }
+
+        void LoadLongIndex() {
+            // XO-CHIP F000 nnnn: the address is the whole of the next two bytes, which then get stepped over
+            indexRegister = memory[programCounter & memoryMask] << 8 | memory[(programCounter + 1) & memoryMask];
+            programCounter += 2;
+        }
+
+        void SaveFlags(unsigned char x) {
+            // Fx75: V0 to Vx into the RPL flags. SUPER-CHIP only had 8 of them, XO-CHIP has 16
+            unsigned int last = std::min<unsigned int>(x, Quirks::hasXoChip ? 15 : 7);
+            for (unsigned int i = 0; i <= last; i++) {
+                rplFlags[i] = vRegister[i];
+            }
+            stateWrites++;
+        }
+
+        void LoadFlags(unsigned char x) {
+            // Fx85: and back again
+            unsigned int last = std::min<unsigned int>(x, Quirks::hasXoChip ? 15 : 7);
+            for (unsigned int i = 0; i <= last; i++) {
+                vRegister[i] = rplFlags[i];
+            }
+        }
+
+        void StoreBcd(unsigned char x) {
+            // Fx33: the hundreds, tens and ones of Vx as three bytes at I, I + 1 and I + 2
+            unsigned char value = vRegister[x];
+            memory[indexRegister & memoryMask] = value / 100;
+            memory[(indexRegister + 1) & memoryMask] = (value / 10) % 10;
+            memory[(indexRegister + 2) & memoryMask] = value % 10;
+            InvalidateDecodeCache(indexRegister, 3);
+        }
+
+        void StoreRegisters(unsigned char x) {
+            // Fx55: V0 to Vx inclusive go into memory from I. x is the register number from the opcode, not what's in Vx
+            for (unsigned int i = 0; i <= x; i++) {
+                memory[(indexRegister + i) & memoryMask] = vRegister[i];
+            }
+            InvalidateDecodeCache(indexRegister, x + 1);
+            if constexpr (Quirks::loadStoreIncrementsI) {
+                indexRegister += x + 1;
+            }
+        }
+
+        void LoadRegisters(unsigned char x) {
+            // Fx65: and back again
+            for (unsigned int i = 0; i <= x; i++) {
+                vRegister[i] = memory[(indexRegister + i) & memoryMask];
+            }
+            if constexpr (Quirks::loadStoreIncrementsI) {
+                indexRegister += x + 1;
+            }
+        }
+
+        void LoadAudioPattern() {
+            // XO-CHIP F002: 16 bytes from I become the sound the buzzer makes
+            for (unsigned int i = 0; i < 16; i++) {
+                audioPattern[i] = memory[(indexRegister + i) & memoryMask];
+            }
+            stateWrites++;
+        }
+
+        void InvalidateDecodeCache(unsigned int address, unsigned int length) {
+            // throw away every decoded slot that overlaps the bytes address .. address + length - 1.
+            // an instruction is two bytes long so the one starting the byte before address is affected too
+            // only the handler is cleared so a handler that overwrites its own slot can still read its operands
+            if (length == 0) {
+                return;
+            }
+            // I can point past the end of memory and the writes wrap round, so the bytes they really hit are the masked ones
+            address &= memoryMask;
+            if (address + length > memorySize) {
+                unsigned int beforeEnd = memorySize - address;
+                InvalidateDecodeCache(address, beforeEnd);
+                InvalidateDecodeCache(0, length - beforeEnd);
+                return;
+            }
+            stateWrites++;
+            unsigned int first = (address > decodeCacheStart) ? address - 1 : decodeCacheStart;
+            unsigned int last = address + length; // one past the end
+            if (last > decodeCacheStart + decodeCacheSize) {
+                last = decodeCacheStart + decodeCacheSize;
+            }
+            for (unsigned int i = first; i < last; i++) {
+                decodeCache[i - decodeCacheStart].handler = nullptr;
+            }
+
+            // the page versions track the bytes that were actually written
+            unsigned int firstPage = address >> 8;
+            unsigned int lastPage = (address + length - 1) >> 8;
+            for (unsigned int page = firstPage; page <= lastPage && page < codePageCount; page++) {
+                codePageVersion[page]++;
+            }
+        }
+
+        static const DecodedInstruction* OpcodeTable() {
+            // every opcode decoded up front, built the first time anyone asks for it. 64K entries of 16 bytes is a megabyte
+            // per profile, which sounds like a lot but a game only ever touches the few hundred entries for the opcodes it uses
+            static const std::vector<DecodedInstruction> table = [] {
+                std::vector<DecodedInstruction> decoded(65536);
+                for (unsigned int opcode = 0; opcode < 65536; opcode++) {
+                    decoded[opcode] = Decode(opcode);
+                }
+                return decoded;
+            }();
+            return table.data();
+        }
+
+#ifdef CHIP8_THREADED_DISPATCH
+        static const unsigned char* OpcodeLabels() {
+            // for every opcode, where its handler is in CHIP8_OPCODE_HANDLERS (which is also where its label is in RunThreaded).
+            // kept next to the table rather than in it so the decode cache entries don't get any bigger
+#define CHIP8_HANDLER_POINTER(handler) &handler,
+            static const OpcodeHandler handlers[] = { CHIP8_OPCODE_HANDLERS(CHIP8_HANDLER_POINTER) };
+#undef CHIP8_HANDLER_POINTER
+            static const std::vector<unsigned char> labels = [] {
+                const DecodedInstruction* table = OpcodeTable();
+                std::vector<unsigned char> found(65536);
+                for (unsigned int opcode = 0; opcode < 65536; opcode++) {
+                    found[opcode] = std::find(std::begin(handlers), std::end(handlers), table[opcode].handler) - std::begin(handlers);
+                }
+                return found;
+            }();
+            return labels.data();
+        }
+
+        unsigned long long RunThreaded(unsigned long long cycles) {
+            // RunFor for Threaded. exactly the same bookkeeping as the loop in RunFor, but written out at the end of every
+            // handler's label along with the fetch of the next instruction and a jump straight to its label
+#define CHIP8_LABEL_ADDRESS(handler) &&threaded_##handler,
+            static const void* const targets[] = { CHIP8_OPCODE_HANDLERS(CHIP8_LABEL_ADDRESS) };
+#undef CHIP8_LABEL_ADDRESS
+            const DecodedInstruction* table = opcodeTable;
+            const unsigned char* labels = OpcodeLabels();
+            const DecodedInstruction* op = nullptr;
+            unsigned long long i = 0;
+            idleCheck.valid = false;
+            if (cycles == 0) {
+                return 0;
+            }
+
+#define CHIP8_THREADED_NEXT() \
+            currentOpcode = memory[programCounter & memoryMask] << 8 | memory[(programCounter + 1) & memoryMask]; \
+            programCounter += 2; \
+            op = &table[currentOpcode]; \
+            goto *targets[labels[currentOpcode]];
+#define CHIP8_THREADED_HANDLER(handler) \
+        threaded_##handler: \
+            handler(*this, *op); \
+            i++; \
+            if (loopedBack) { \
+                if (useIdleSkip) { \
+                    i += SkipIdleLoop(i, cycles); \
+                } \
+                loopedBack = false; \
+            } \
+            if (i >= cycles) { \
+                return cycles; \
+            } \
+            CHIP8_THREADED_NEXT()
+
+            CHIP8_THREADED_NEXT()
+            CHIP8_OPCODE_HANDLERS(CHIP8_THREADED_HANDLER)
+
+#undef CHIP8_THREADED_HANDLER
+#undef CHIP8_THREADED_NEXT
+        }
+#endif
+
+        static DecodedInstruction Decode(unsigned short opcode) {
+            // work out which handler runs this opcode and pull all of the operands out up front.
+            // this is the same decision tree as RunOpcode but we only ever walk it once per address
+            DecodedInstruction op;
+            op.opcode = opcode;
+            op.x = (opcode & 0x0F00) >> 8;
+            op.y = (opcode & 0x00F0) >> 4;
+            op.n = (opcode & 0x000F);
+            op.kk = (opcode & 0x00FF);
+            op.nnn = (opcode & 0x0FFF);
+
+            switch (opcode >> 12) {
+                case 0x0: {
+                    op.handler = (opcode == 0x00E0) ? OpClearScreen : (opcode == 0x00EE) ? OpReturn : OpNothing;
+                    if constexpr (Quirks::hasSuperChip) {
+                        switch (opcode) {
+                            case 0x00FB: op.handler = OpScrollRight; break;
+                            case 0x00FC: op.handler = OpScrollLeft; break;
+                            case 0x00FD: op.handler = OpExit; break;
+                            case 0x00FE: op.handler = OpLowResolution; break;
+                            case 0x00FF: op.handler = OpHighResolution; break;
+                        }
+                        if ((opcode & 0xFFF0) == 0x00C0) {
+                            op.handler = OpScrollDown;
+                        }
+                        if (Quirks::hasXoChip && (opcode & 0xFFF0) == 0x00D0) {
+                            op.handler = OpScrollUp;
+                        }
+                    }
+                    break;
+                }
+                case 0x1: op.handler = OpJump; break;
+                case 0x2: op.handler = OpCall; break;
+                case 0x3: op.handler = OpSkipEqualByte; break;
+                case 0x4: op.handler = OpSkipNotEqualByte; break;
+                case 0x5: {
+                    op.handler = OpSkipEqualRegister;
+                    if constexpr (Quirks::hasXoChip) {
+                        op.handler = (op.n == 0x2) ? OpStoreRegisterRange : (op.n == 0x3) ? OpLoadRegisterRange : op.handler;
+                    }
+                    break;
+                }
+                case 0x6: op.handler = OpLoadByte; break;
+                case 0x7: op.handler = OpAddByte; break;
+                case 0x8: {
+                    switch (op.n) {
+                        case 0x0: op.handler = OpLoadRegister; break;
+                        case 0x1: op.handler = OpOr; break;
+                        case 0x2: op.handler = OpAnd; break;
+                        case 0x3: op.handler = OpXor; break;
+                        case 0x4: op.handler = OpAddRegister; break;
+                        case 0x5: op.handler = OpSub; break;
+                        case 0x6: op.handler = OpShiftRight; break;
+                        case 0x7: op.handler = OpSubN; break;
+                        case 0xE: op.handler = OpShiftLeft; break;
+                        default: op.handler = OpUnknown; break;
+                    }
+                    break;
+                }
+                case 0x9: op.handler = OpSkipNotEqualRegister; break;
+                case 0xA: op.handler = OpLoadIndex; break;
+                case 0xB: op.handler = OpJumpV0; break;
+                case 0xC: op.handler = OpRandom; break;
+                case 0xD: op.handler = OpDraw; break;
+                case 0xE: op.handler = (op.kk == 0x9E) ? OpSkipKeyPressed : (op.kk == 0xA1) ? OpSkipKeyNotPressed : OpUnknown; break;
+                case 0xF: {
+                    switch (op.kk) {
+                        case 0x07: op.handler = OpLoadDelayTimer; break;
+                        case 0x0A: op.handler = OpWaitForKey; break;
+                        case 0x15: op.handler = OpSetDelayTimer; break;
+                        case 0x18: op.handler = OpSetSoundTimer; break;
+                        case 0x1E: op.handler = OpAddIndex; break;
+                        case 0x29: op.handler = OpLoadFont; break;
+                        case 0x33: op.handler = OpStoreBcd; break;
+                        case 0x55: op.handler = OpStoreRegisters; break;
+                        case 0x65: op.handler = OpLoadRegisters; break;
+                        default: op.handler = OpNothing; break;
+                    }
+                    if constexpr (Quirks::hasSuperChip) {
+                        switch (op.kk) {
+                            case 0x30: op.handler = OpLoadBigFont; break;
+                            case 0x75: op.handler = OpSaveFlags; break;
+                            case 0x85: op.handler = OpLoadFlags; break;
+                        }
+                    }
+                    if constexpr (Quirks::hasXoChip) {
+                        switch (op.kk) {
+                            case 0x00: op.handler = (opcode == 0xF000) ? OpLoadLongIndex : op.handler; break;
+                            case 0x01: op.handler = OpSelectPlanes; break;
+                            case 0x02: op.handler = (opcode == 0xF002) ? OpLoadAudioPattern : op.handler; break;
+                            case 0x3A: op.handler = OpSetPitch; break;
+                        }
+                    }
+                    break;
+                }
+            }
+            return op;
+        }
+
+        /*
+            One handler per instruction for the decoded cache. Each of these does exactly what the matching case in RunOpcode does,
+            they just get their operands handed to them already pulled out of the opcode.
+        */
+        static void OpNothing(Chip8Core& chip8, const DecodedInstruction& op) {
+            // 0nnn (call RCA 1802 program) and friends, not implemented
+        }
+        static void OpUnknown(Chip8Core& chip8, const DecodedInstruction& op) {
+            // not a real instruction so it does nothing (an instrumented build counts these as "unknown")
+        }
+        static void OpClearScreen(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.ClearDisplay();
+        }
+        static void OpReturn(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.programCounter = chip8.stack[chip8.stackPointer];
+            chip8.stackPointer = (chip8.stackPointer - 1) & 0xF;
+        }
+        static void OpJump(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.loopedBack = op.nnn < chip8.programCounter;
+            chip8.programCounter = op.nnn;
+        }
+        static void OpCall(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.stateWrites++;
+            chip8.stackPointer = (chip8.stackPointer + 1) & 0xF;
+            chip8.stack[chip8.stackPointer] = chip8.programCounter;
+            chip8.programCounter = op.nnn;
+        }
+        static void OpSkipEqualByte(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.SkipIf(chip8.vRegister[op.x] == op.kk);
+        }
+        static void OpSkipNotEqualByte(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.SkipIf(chip8.vRegister[op.x] != op.kk);
+        }
+        static void OpSkipEqualRegister(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.SkipIf(chip8.vRegister[op.x] == chip8.vRegister[op.y]);
+        }
+        static void OpLoadByte(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.vRegister[op.x] = op.kk;
+        }
+        static void OpAddByte(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.vRegister[op.x] += op.kk;
+        }
+        static void OpLoadRegister(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.vRegister[op.x] = chip8.vRegister[op.y];
+        }
+        static void OpOr(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.vRegister[op.x] |= chip8.vRegister[op.y];
+            if constexpr (Quirks::logicResetsVf) {
+                chip8.vRegister[0xF] = 0;
+            }
+        }
+        static void OpAnd(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.vRegister[op.x] &= chip8.vRegister[op.y];
+            if constexpr (Quirks::logicResetsVf) {
+                chip8.vRegister[0xF] = 0;
+            }
+        }
+        static void OpXor(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.vRegister[op.x] ^= chip8.vRegister[op.y];
+            if constexpr (Quirks::logicResetsVf) {
+                chip8.vRegister[0xF] = 0;
+            }
+        }
+        // the flag is always worked out from the old values and written last, so when x is F the flag is what's left in VF
+        static void OpAddRegister(Chip8Core& chip8, const DecodedInstruction& op) {
+            unsigned short sum = chip8.vRegister[op.x] + chip8.vRegister[op.y];
+            chip8.vRegister[op.x] = sum;
+            chip8.vRegister[0xF] = sum >> 8;
+        }
+        static void OpSub(Chip8Core& chip8, const DecodedInstruction& op) {
+            unsigned char notBorrow = (chip8.vRegister[op.x] >= chip8.vRegister[op.y]) ? 1 : 0;
+            chip8.vRegister[op.x] -= chip8.vRegister[op.y];
+            chip8.vRegister[0xF] = notBorrow;
+        }
+        static void OpShiftRight(Chip8Core& chip8, const DecodedInstruction& op) {
+            const unsigned char source = Quirks::shiftUsesVy ? op.y : op.x;
+            unsigned char shiftedOut = chip8.vRegister[source] & 0x1;
+            chip8.vRegister[op.x] = chip8.vRegister[source] >> 1;
+            chip8.vRegister[0xF] = shiftedOut;
+        }
+        static void OpSubN(Chip8Core& chip8, const DecodedInstruction& op) {
+            unsigned char notBorrow = (chip8.vRegister[op.y] >= chip8.vRegister[op.x]) ? 1 : 0;
+            chip8.vRegister[op.x] = chip8.vRegister[op.y] - chip8.vRegister[op.x];
+            chip8.vRegister[0xF] = notBorrow;
+        }
+        static void OpShiftLeft(Chip8Core& chip8, const DecodedInstruction& op) {
+            const unsigned char source = Quirks::shiftUsesVy ? op.y : op.x;
+            unsigned char shiftedOut = chip8.vRegister[source] >> 7;
+            chip8.vRegister[op.x] = chip8.vRegister[source] << 1;
+            chip8.vRegister[0xF] = shiftedOut;
+        }
+        static void OpSkipNotEqualRegister(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.SkipIf(chip8.vRegister[op.x] != chip8.vRegister[op.y]);
+        }
+        static void OpLoadIndex(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.indexRegister = op.nnn;
+        }
+        static void OpJumpV0(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.programCounter = op.nnn + chip8.vRegister[Quirks::jumpUsesVx ? op.x : 0];
+        }
+        static void OpRandom(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.vRegister[op.x] = chip8.RandomByte() & op.kk;
+        }
+        static void OpDraw(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.vRegister[0xF] = chip8.DrawSprite(chip8.vRegister[op.x], chip8.vRegister[op.y], op.n);
+        }
+        static void OpSkipKeyPressed(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.SkipIf(chip8.IsKeyPressed(chip8.vRegister[op.x]));
+        }
+        static void OpSkipKeyNotPressed(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.SkipIf(!chip8.IsKeyPressed(chip8.vRegister[op.x]));
+        }
+        static void OpLoadDelayTimer(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.vRegister[op.x] = chip8.delayTimer;
+        }
+        static void OpWaitForKey(Chip8Core& chip8, const DecodedInstruction& op) {
+            uint16_t held = chip8.GetKeyMask();
+            for (int i = 0; i < 16; i++) {
+                if ((held >> i) & 0x1) {
+                    chip8.vRegister[op.x] = i;
+                    return;
+                }
+            }
+            // nothing pressed yet so come back to this instruction next step
+            chip8.programCounter -= 2;
+            chip8.loopedBack = true;
+        }
+        static void OpSetDelayTimer(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.delayTimer = chip8.vRegister[op.x];
+        }
+        static void OpSetSoundTimer(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.soundTimer = chip8.vRegister[op.x];
+        }
+        static void OpAddIndex(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.indexRegister += chip8.vRegister[op.x];
+        }
+        static void OpLoadFont(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.indexRegister = 0x050 + chip8.vRegister[op.x] * 5;
+        }
+        static void OpStoreBcd(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.StoreBcd(op.x);
+        }
+        static void OpStoreRegisters(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.StoreRegisters(op.x);
+        }
+        static void OpLoadRegisters(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.LoadRegisters(op.x);
+        }
+
+        // SUPER-CHIP and XO-CHIP. Decode only ever picks these for the profiles that have them
+        static void OpScrollDown(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.ScrollDown(op.n);
+        }
+        static void OpScrollUp(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.ScrollUp(op.n);
+        }
+        static void OpScrollRight(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.ScrollRight();
+        }
+        static void OpScrollLeft(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.ScrollLeft();
+        }
+        static void OpExit(Chip8Core& chip8, const DecodedInstruction& op) {
+            // there's no interpreter to go back to so just sit on this instruction for good (the idle skip makes that free)
+            chip8.programCounter -= 2;
+            chip8.loopedBack = true;
+        }
+        static void OpLowResolution(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.SetHighResolution(false);
+        }
+        static void OpHighResolution(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.SetHighResolution(true);
+        }
+        static void OpStoreRegisterRange(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.StoreRegisterRange(op.x, op.y);
+        }
+        static void OpLoadRegisterRange(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.LoadRegisterRange(op.x, op.y);
+        }
+        static void OpLoadLongIndex(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.LoadLongIndex();
+        }
+        static void OpSelectPlanes(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.planeMask = op.x & ((1 << displayPlanes) - 1);
+            chip8.stateWrites++;
+        }
+        static void OpLoadAudioPattern(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.LoadAudioPattern();
+        }
+        static void OpSetPitch(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.pitch = chip8.vRegister[op.x];
+            chip8.stateWrites++;
+        }
+        static void OpLoadBigFont(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.indexRegister = 0x0A0 + (chip8.vRegister[op.x] & 0xF) * 10;
+        }
+        static void OpSaveFlags(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.SaveFlags(op.x);
+        }
+        static void OpLoadFlags(Chip8Core& chip8, const DecodedInstruction& op) {
+            chip8.LoadFlags(op.x);
+        }
+
+        void RunOpcode(unsigned short opcode) {
+            // switch statement for all the opcodes
+            // The first 4 bits of the opcode tell us what the opcode is (one hexadecimal digit since 2^4 = 16)
+            // The last 12 bits tell us what to do with the opcode
+            
+            // grab all the various parts of the opcode up front so we don't have to do it multiple times
+            unsigned short nibble_1 = (opcode & 0xF000) >> 12;        
+            unsigned short nibble_2 = (opcode & 0x0F00) >> 8;
+            unsigned short nibble_3 = (opcode & 0x00F0) >> 4;
+            unsigned short nibble_4 = (opcode & 0x000F);
+            unsigned short second_byte = (opcode & 0x00FF);
+            unsigned short third_byte = (opcode & 0x0FFF);
+
+            switch (nibble_1) {
+                case 0x0: {
+                    switch (opcode) {
+                        case 0x00E0: {
+                            // clear the display
+                            ClearDisplay();
+                            break;
+                        }
+                        case 0x00EE: { // RET - return from subroutine. set PC to address at the top fot he stack and then subtract 1 from stack pointer
+                            programCounter = stack[stackPointer];
+                            // the stack only has 16 slots, so going past either end wraps round instead of wandering off into memory
+                            stackPointer = (stackPointer - 1) & 0xF;
+                            break;
+                        }
+                        case 0x00FB: { // SUPER-CHIP: scroll right 4 pixels
+                            if constexpr (Quirks::hasSuperChip) {
+                                ScrollRight();
+                            }
+                            break;
+                        }
+                        case 0x00FC: { // SUPER-CHIP: scroll left 4 pixels
+                            if constexpr (Quirks::hasSuperChip) {
+                                ScrollLeft();
+                            }
+                            break;
+                        }
+                        case 0x00FD: { // SUPER-CHIP: exit the interpreter, so stay here for good
+                            if constexpr (Quirks::hasSuperChip) {
+                                programCounter -= 2;
+                                loopedBack = true;
+                            }
+                            break;
+                        }
+                        case 0x00FE: { // SUPER-CHIP: low resolution
+                            if constexpr (Quirks::hasSuperChip) {
+                                SetHighResolution(false);
+                            }
+                            break;
+                        }
+                        case 0x00FF: { // SUPER-CHIP: high resolution
+                            if constexpr (Quirks::hasSuperChip) {
+                                SetHighResolution(true);
+                            }
+                            break;
+                        }
+                        default: {
+                            if constexpr (Quirks::hasSuperChip) {
+                                // 00Cn scroll down n pixels (SUPER-CHIP) and 00Dn scroll up n pixels (XO-CHIP)
+                                if ((opcode & 0xFFF0) == 0x00C0) {
+                                    ScrollDown(nibble_4);
+                                }
+                                else if (Quirks::hasXoChip && (opcode & 0xFFF0) == 0x00D0) {
+                                    ScrollUp(nibble_4);
+                                }
+                            }
+                            // otherwise it's call RCA 1802 program at address NNN
+                            // not implemented
+                            break;
+                        }
+                    }
+                    break;
+                }
+                case 0x1: { //jump opcode
+                    loopedBack = third_byte < programCounter;
+                    programCounter = third_byte;
+                    break;
+                }
+                case 0x2: { // Call addr call subroutine at nnn. increment stack pointer, put current PC on top. set PC to nnn
+                    stateWrites++;
+                    stackPointer = (stackPointer + 1) & 0xF;
+                    stack[stackPointer] = programCounter;
+                    programCounter = third_byte;
+                    break;
+                }
+                case 0x3: { // 3xkk - skip next instruction if Vc = kk
+                    SkipIf(vRegister[nibble_2] == second_byte);
+                    break;
+                }
+                case 0x4: { // 4xkk - skip next instruction if Vx not equal to kk
+                    SkipIf(vRegister[nibble_2] != second_byte);
+                    break;
+                }
+                case 0x5: { // 5xy0 skip next instruction if vx == vy
+                    if constexpr (Quirks::hasXoChip) {
+                        // XO-CHIP 5xy2 / 5xy3 save and load Vx to Vy
+                        if (nibble_4 == 0x2) {
+                            StoreRegisterRange(nibble_2, nibble_3);
+                            break;
+                        }
+                        if (nibble_4 == 0x3) {
+                            LoadRegisterRange(nibble_2, nibble_3);
+                            break;
+                        }
+                    }
+                    SkipIf(vRegister[nibble_2] == vRegister[nibble_3]);
+                    break;
+                }
+                case 0x6: { // Set instruction (6XNN where we set the VX register to value NN)
+                    vRegister[nibble_2] = second_byte;
+                    break;
+                }
+                case 0x7: {// 7xkk - set vx = vx + kk
+                    vRegister[nibble_2] += second_byte;
+                    break;
+                }
+                case 0x8: {// there are a few different instruction that begin 0x8 that vary depending on the fourth bit
+                    switch (nibble_4) {
+                        case 0x0: { // 8xy0 - sstore valu eof vy in vx
+                            vRegister[nibble_2] = vRegister[nibble_3];
+                            break;
+                        }
+                        case 0x1: { // 8xy1 perform bitwise OR on the values of Vx and Vy and then store result in Vx
+                            vRegister[nibble_2] |= vRegister[nibble_3];
+                            if constexpr (Quirks::logicResetsVf) {
+                                vRegister[0xF] = 0;
+                            }
+                            break;
+                        }
+                        case 0x2: { // 8xy2 perform bitwise AND much like above
+                            vRegister[nibble_2] &= vRegister[nibble_3];
+                            if constexpr (Quirks::logicResetsVf) {
+                                vRegister[0xF] = 0;
+                            }
+                            break;
+                        }
+                        case 0x3: { // same as above but for XOR
+                            vRegister[nibble_2] ^= vRegister[nibble_3];
+                            if constexpr (Quirks::logicResetsVf) {
+                                vRegister[0xF] = 0;
+                            }
+                            break;
+                        }
+                        // the flags below are worked out before Vx changes but written after it, so if x is F the flag wins
+                        case 0x4: { // ADD vx and vy and set Vx to answer. Set VF to 1 if it went over 255 (the carry)
+                            unsigned short sum = (vRegister[nibble_2] + vRegister[nibble_3]);
+                            vRegister[nibble_2] = sum;
+                            vRegister[0xF] = (sum > 0xFF) ? 1 : 0;
+                            break;
+                        }
+                        case 0x5: {// SUB set Vx to Vx - Vy. if Vx >= Vy (nothing borrowed) set Vf to 1 
+                            unsigned char notBorrow = (vRegister[nibble_2] >= vRegister[nibble_3]) ? 1 : 0;
+                            vRegister[nibble_2] -= vRegister[nibble_3];
+                            vRegister[0xF] = notBorrow;
+                            break;
+                        }
+                        case 0x6: { //SHR shift Vx 1 bit to the right (or Vy into Vx, depending on the quirks)
+                            const unsigned char source = Quirks::shiftUsesVy ? nibble_3 : nibble_2;
+                            unsigned char shiftedOut = vRegister[source] & 0x1;
+                            vRegister[nibble_2] = vRegister[source] >> 1;
+                            vRegister[0xF] = shiftedOut;
+                            break;
+                        }
+                        case 0x7: { //  SUBN Set Vx = Vy - Vx, set VF = NOT borrow
+                            unsigned char notBorrow = (vRegister[nibble_3] >= vRegister[nibble_2]) ? 1 : 0;
+                            vRegister[nibble_2] = vRegister[nibble_3] - vRegister[nibble_2];
+                            vRegister[0xF] = notBorrow;
+                            break;
+                        }
+                        case 0xE: { // Shift Vx 1 bit to the left (or Vy into Vx, depending on the quirks)
+                            const unsigned char source = Quirks::shiftUsesVy ? nibble_3 : nibble_2;
+                            unsigned char shiftedOut = vRegister[source] & 0b10000000 ? 1 : 0; // done in binary because my brain is small and i couldn't think in hex :(
+                            vRegister[nibble_2] = vRegister[source] << 1;
+                            vRegister[0xF] = shiftedOut;
+                            break;
+                        }
+                        default: {
+                            // this opcode doesn't exist so it does nothing (an instrumented build counts these as "unknown")
+                            break;
+                        }
+                    }
+                    break;
+                }
+                case 0x9: { // skip next instructuion if Vx != Vy
+                    SkipIf(vRegister[nibble_2] != vRegister[nibble_3]);
+                    break;
+                }
+                case 0xA: { // OPcode ANNN: Sets index register to value NNN
+                    indexRegister = third_byte;
+                    break;
+                }
+                case 0xB: { // PMP to pocation nnn + V0 (or nnn + Vx on SUPER-CHIP)
+                    programCounter = third_byte + vRegister[Quirks::jumpUsesVx ? nibble_2 : 0];
+                    break;
+                }
+                case 0xC: { // Cxkk set Vx to random byte AND kk
+                    vRegister[nibble_2] = RandomByte() & second_byte;
+                    break;
+                }
+                case 0xD: { // opcode DXYN draw n pixels tall sprite to the display from position x in the Vx regiter ,y from the Vy register from memory location in the index register
+                    // set the carry flag if any pixel got turned off
+                    vRegister[0xF] = DrawSprite(vRegister[nibble_2], vRegister[nibble_3], nibble_4);
+                    break;
+                }
+                case 0xE: {
+                    // two possible instrctions here so we'll use an if statement to check which we need
+                    if (second_byte == 0x9E) {
+                        // skip next instruction if key with the value of Vx is pressed
+                        SkipIf(IsKeyPressed(vRegister[nibble_2]));
+                    }
+                    else if (second_byte == 0xA1)
+                    {
+                        // skip next instruction if key with the value of Vx is not pressed
+                        SkipIf(!IsKeyPressed(vRegister[nibble_2]));
+                    }
+                    else {
+                        // invalid opcode, does nothing (an instrumented build counts these as "unknown")
+                    }
+                    break;
+                }
+                case 0xF: {
+                    // quite  a few codes begin 0xF
+                    switch (second_byte){
+                        case 0x00: { // XO-CHIP F000 nnnn: I = nnnn
+                            if constexpr (Quirks::hasXoChip) {
+                                if (opcode == 0xF000) {
+                                    LoadLongIndex();
+                                }
+                            }
+                            break;
+                        }
+                        case 0x01: { // XO-CHIP Fn01: draw on planes n
+                            if constexpr (Quirks::hasXoChip) {
+                                planeMask = nibble_2 & ((1 << displayPlanes) - 1);
+                                stateWrites++;
+                            }
+                            break;
+                        }
+                        case 0x02: { // XO-CHIP F002: load the audio pattern from I
+                            if constexpr (Quirks::hasXoChip) {
+                                if (opcode == 0xF002) {
+                                    LoadAudioPattern();
+                                }
+                            }
+                            break;
+                        }
+                        case 0x30: { // SUPER-CHIP Fx30: I = big font digit Vx
+                            if constexpr (Quirks::hasSuperChip) {
+                                indexRegister = 0x0A0 + (vRegister[nibble_2] & 0xF) * 10;
+                            }
+                            break;
+                        }
+                        case 0x3A: { // XO-CHIP Fx3A: pitch = Vx
+                            if constexpr (Quirks::hasXoChip) {
+                                pitch = vRegister[nibble_2];
+                                stateWrites++;
+                            }
+                            break;
+                        }
+                        case 0x75: { // SUPER-CHIP Fx75: save V0 to Vx in the RPL flags
+                            if constexpr (Quirks::hasSuperChip) {
+                                SaveFlags(nibble_2);
+                            }
+                            break;
+                        }
+                        case 0x85: { // SUPER-CHIP Fx85: load them back
+                            if constexpr (Quirks::hasSuperChip) {
+                                LoadFlags(nibble_2);
+                            }
+                            break;
+                        }
+                        case 0x07: {
+                            vRegister[nibble_2] = delayTimer;
+                            break;
+                        }
+                        case 0x0A: {
+                            // pause until a key is pressed and then store the value of the key in Vx
+                            // the core doesn't own the keyboard any more so rather than spinning here we wind
+                            // the program counter back and run this instruction again on the next step until
+                            // whoever is driving us reports a key press
+                            bool keyFound = false;
+                            uint16_t held = GetKeyMask();
+                            for (int i = 0; i < 16; i++) {
+                                if ((held >> i) & 0x1) {
+                                    vRegister[nibble_2] = i;
+                                    keyFound = true;
+                                    break;
+                                }
+                            }
+                            if (!keyFound) {
+                                programCounter -= 2;
+                                loopedBack = true;
+                            }
+                            break;
+                        }
+                        case 0x15: {
+                            delayTimer = vRegister[nibble_2];
+                            break;
+                        }
+                        case 0x18: {
+                            soundTimer = vRegister[nibble_2];
+                            break;
+                        }
+                        case 0x1E: {
+                            indexRegister += vRegister[nibble_2];
+                            break;
+                        }
+                        case 0x29: {
+                            // memory location for font begins at 0x050 so we can
+                            // set the index register to 0x050 plus 5 times the value of Vx to find the beginning
+                            // of the sprite for the character held in Vx
+                            indexRegister = 0x050 + vRegister[nibble_2] * 5;
+                            break;
+                        }
+                        case 0x33: {
+                            // take the decimal value of Vx and place
+                            // the hundres digit in memory location in I, 
+                            //tens digit at location I+1 
+                            //and the ones at I+2
+                            StoreBcd(nibble_2);
+                            break;
+                        }
+                        case 0x55: {
+                            // copy registers V0 through Vx into memory starting at memory[indexRegister]
+                            StoreRegisters(nibble_2);
+                            break;
+                        }
+                        case 0x65: {
+                            // read registers V0 through Vx from memory starting at location I
+                            LoadRegisters(nibble_2);
+                            break;
+                        }
+                    }
+                    break;
+                }
+            }
+            
+        };
+
+};
+
+// plain chip8 as the COSMAC VIP ran it, which is what most ROMs expect
+typedef Chip8Core<VipQuirks> Chip8;
+
+/*
+    Picking a profile at run time. Each profile is a different type, so a chip8 of "whichever profile this ROM wants" is a
+    variant of the three, and the code that drives it is written as a template and handed the right one with std::visit.
+    They live on the heap because the decoded instruction cache makes them too big to want to copy around.
+*/
+enum class Chip8Profile { Vip, SuperChip, XoChip };
+
+typedef std::variant<std::unique_ptr<Chip8Core<VipQuirks>>,
+                     std::unique_ptr<Chip8Core<SuperChipQuirks>>,
+                     std::unique_ptr<Chip8Core<XoChipQuirks>>> AnyChip8;
+
+inline AnyChip8 CreateChip8(Chip8Profile profile) {
+    switch (profile) {
+        case Chip8Profile::SuperChip: return std::make_unique<Chip8Core<SuperChipQuirks>>();
+        case Chip8Profile::XoChip: return std::make_unique<Chip8Core<XoChipQuirks>>();
+        default: return std::make_unique<Chip8Core<VipQuirks>>();
+    }
+}
+
+inline bool ParseChip8Profile(const std::string& name, Chip8Profile& profile) {
+    // the names --quirks takes. returns false for anything it doesn't know
+    if (name == VipQuirks::name) {
+        profile = Chip8Profile::Vip;
+    }
+    else if (name == SuperChipQuirks::name) {
+        profile = Chip8Profile::SuperChip;
+    }
+    else if (name == XoChipQuirks::name) {
+        profile = Chip8Profile::XoChip;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+inline bool ParseChip8Dispatch(const std::string& name, Chip8Dispatch& dispatch) {
+    // the names --dispatch takes
+    if (name == "switch") {
+        dispatch = Chip8Dispatch::Switch;
+    }
+    else if (name == "cache") {
+        dispatch = Chip8Dispatch::DecodeCache;
+    }
+    else if (name == "table") {
+        dispatch = Chip8Dispatch::Table;
+    }
+    else if (name == "threaded") {
+        dispatch = Chip8Dispatch::Threaded;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+inline const char* Chip8DispatchName(Chip8Dispatch dispatch) {
+    switch (dispatch) {
+        case Chip8Dispatch::Switch: return "switch";
+        case Chip8Dispatch::Table: return "table";
+        case Chip8Dispatch::Threaded: return "threaded";
+        default: return "cache";
+    }
+}
+
+inline const char* Chip8ProfileName(Chip8Profile profile) {
+    switch (profile) {
+        case Chip8Profile::SuperChip: return SuperChipQuirks::name;
+        case Chip8Profile::XoChip: return XoChipQuirks::name;
+        default: return VipQuirks::name;
+    }
+}
+
+inline std::string Chip8RomExtension(const std::string& program_path) {
+    std::string extension = std::filesystem::path(program_path).extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return std::tolower(c); });
+    return extension;
+}
+
+inline bool IsChip8RomPath(const std::string& program_path) {
+    // every extension GuessChip8Profile knows, plus plain .ch8. what --batch and friends pick up from a directory
+    std::string extension = Chip8RomExtension(program_path);
+    return extension == ".ch8" || extension == ".sc8" || extension == ".schip" || extension == ".xo8";
+}
+
+inline Chip8Profile GuessChip8Profile(const std::string& program_path) {
+    // ROMs for the later machines are usually named after them, anything else is taken to be plain chip8
+    std::string extension = Chip8RomExtension(program_path);
+    if (extension == ".sc8" || extension == ".schip") {
+        return Chip8Profile::SuperChip;
+    }
+    if (extension == ".xo8") {
+        return Chip8Profile::XoChip;
+    }
+    return Chip8Profile::Vip;
+}
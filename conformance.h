@@ -0,0 +1,1040 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <deque>
+#include <random>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+
+#include "chip8.h"
+#include "jit_x64.h"
+#include "savestate.h"
+
+/*
+    A second chip8, written to be obviously right rather than fast, for checking the real one against.
+
+    Everything here is done the slow and simple way: the screen is one bool per pixel, sprites are drawn a pixel at a time,
+    scrolling moves pixels one by one and every instruction is a case in one big switch. It deliberately shares no code with
+    chip8.h (not even the decoding), so a mistake in the fast core can't hide by being made in both places. The only things
+    it takes from Chip8Core are the sizes of the machine for each profile and the quirks.
+
+    Everything is public because the conformance harness below sets it up directly for every test.
+*/
+template <typename QuirkSet>
+class ReferenceChip8
+{
+    public:
+
+        typedef QuirkSet Quirks;
+        typedef Chip8Core<Quirks> Core;
+        static constexpr unsigned int width = Core::displayWidth;
+        static constexpr unsigned int height = Core::displayHeight;
+        static constexpr unsigned int planes = Core::displayPlanes;
+
+        std::vector<unsigned char> memory = std::vector<unsigned char>(Core::memorySize, 0);
+        unsigned char v[16] = { 0 };
+        unsigned short i = 0;
+        unsigned short pc = 0x200;
+        unsigned short stack[16] = { 0 };
+        unsigned short sp = 0;
+        unsigned char delay = 0;
+        unsigned char sound = 0;
+        uint16_t keys = 0;
+        uint64_t rng[4] = { 0 };
+        bool hires = false;
+        unsigned char planeMask = 1;
+        unsigned char rpl[16] = { 0 };
+        unsigned char audio[16] = { 0 };
+        unsigned char pitch = 64;
+
+        unsigned char Read(unsigned int address) const {
+            return memory[address % Core::memorySize];
+        };
+
+        void Write(unsigned int address, unsigned char value) {
+            memory[address % Core::memorySize] = value;
+        };
+
+        bool GetPixel(unsigned int plane, unsigned int x, unsigned int y) const {
+            return pixels[(plane * height + y) * width + x];
+        };
+
+        void SetPixel(unsigned int plane, unsigned int x, unsigned int y, bool on) {
+            pixels[(plane * height + y) * width + x] = on;
+            displayChanged = true;
+        };
+
+        const std::vector<uint64_t>& DisplayWords() {
+            // the pixels packed up the same way as Chip8Core::display so the two can be compared. only redone after a change
+            if (displayChanged) {
+                words.assign(Core::displayWords, 0);
+                for (unsigned int plane = 0; plane < planes; plane++) {
+                    for (unsigned int y = 0; y < height; y++) {
+                        for (unsigned int x = 0; x < width; x++) {
+                            if (GetPixel(plane, x, y)) {
+                                words[(plane * height + y) * Core::displayWordsPerRow + x / 64] |= 1ull << (63 - x % 64);
+                            }
+                        }
+                    }
+                }
+                displayChanged = false;
+            }
+            return words;
+        };
+
+        void SetDisplayWords(const uint64_t* source) {
+            for (unsigned int plane = 0; plane < planes; plane++) {
+                for (unsigned int y = 0; y < height; y++) {
+                    for (unsigned int x = 0; x < width; x++) {
+                        uint64_t word = source[(plane * height + y) * Core::displayWordsPerRow + x / 64];
+                        SetPixel(plane, x, y, (word >> (63 - x % 64)) & 0x1);
+                    }
+                }
+            }
+        };
+
+        void TickTimers() {
+            if (delay > 0) {
+                delay--;
+            }
+            if (sound > 0) {
+                sound--;
+            }
+        };
+
+        void Execute() {
+            // run the one instruction at pc
+            unsigned short opcode = Read(pc) << 8 | Read(pc + 1);
+            pc += 2;
+            unsigned int x = (opcode >> 8) & 0xF;
+            unsigned int y = (opcode >> 4) & 0xF;
+            unsigned int n = opcode & 0xF;
+            unsigned int kk = opcode & 0xFF;
+            unsigned int nnn = opcode & 0xFFF;
+
+            switch (opcode >> 12) {
+                case 0x0: {
+                    if (opcode == 0x00E0) { // clear the selected planes
+                        Clear(planeMask);
+                    }
+                    else if (opcode == 0x00EE) { // return. the stack pointer wraps round if it goes past either end
+                        pc = stack[sp];
+                        sp = (sp + 15) % 16;
+                    }
+                    else if (Quirks::hasSuperChip && (opcode & 0xFFF0) == 0x00C0) { // scroll down n
+                        Scroll(0, n * Scale());
+                    }
+                    else if (Quirks::hasXoChip && (opcode & 0xFFF0) == 0x00D0) { // scroll up n
+                        Scroll(0, -static_cast<int>(n * Scale()));
+                    }
+                    else if (Quirks::hasSuperChip && opcode == 0x00FB) { // scroll right 4
+                        Scroll(4 * Scale(), 0);
+                    }
+                    else if (Quirks::hasSuperChip && opcode == 0x00FC) { // scroll left 4
+                        Scroll(-4 * static_cast<int>(Scale()), 0);
+                    }
+                    else if (Quirks::hasSuperChip && opcode == 0x00FD) { // exit, which just means staying put
+                        pc -= 2;
+                    }
+                    else if (Quirks::hasSuperChip && (opcode == 0x00FE || opcode == 0x00FF)) { // resolution change, clears everything
+                        hires = (opcode == 0x00FF);
+                        Clear(0xFF);
+                    }
+                    // anything else is a machine code call, which does nothing
+                    break;
+                }
+                case 0x1: pc = nnn; break;
+                case 0x2: {
+                    sp = (sp + 1) % 16;
+                    stack[sp] = pc;
+                    pc = nnn;
+                    break;
+                }
+                case 0x3: Skip(v[x] == kk); break;
+                case 0x4: Skip(v[x] != kk); break;
+                case 0x5: {
+                    if (Quirks::hasXoChip && n == 0x2) { // Vx..Vy into memory, counting down if x > y. I stays put
+                        for (unsigned int k = 0; k <= Distance(x, y); k++) {
+                            Write(i + k, v[Towards(x, y, k)]);
+                        }
+                    }
+                    else if (Quirks::hasXoChip && n == 0x3) {
+                        for (unsigned int k = 0; k <= Distance(x, y); k++) {
+                            v[Towards(x, y, k)] = Read(i + k);
+                        }
+                    }
+                    else { // the bottom nibble isn't looked at
+                        Skip(v[x] == v[y]);
+                    }
+                    break;
+                }
+                case 0x6: v[x] = kk; break;
+                case 0x7: v[x] = (v[x] + kk) % 256; break;
+                case 0x8: {
+                    // the flag is always worked out from the values before the instruction and written last
+                    unsigned int vx = v[x];
+                    unsigned int vy = v[y];
+                    unsigned int shifted = Quirks::shiftUsesVy ? vy : vx;
+                    switch (n) {
+                        case 0x0: v[x] = vy; break;
+                        case 0x1: v[x] = vx | vy; ResetFlagAfterLogic(); break;
+                        case 0x2: v[x] = vx & vy; ResetFlagAfterLogic(); break;
+                        case 0x3: v[x] = vx ^ vy; ResetFlagAfterLogic(); break;
+                        case 0x4: v[x] = (vx + vy) % 256; v[0xF] = (vx + vy > 255) ? 1 : 0; break;
+                        case 0x5: v[x] = (vx + 256 - vy) % 256; v[0xF] = (vx >= vy) ? 1 : 0; break;
+                        case 0x6: v[x] = shifted / 2; v[0xF] = shifted % 2; break;
+                        case 0x7: v[x] = (vy + 256 - vx) % 256; v[0xF] = (vy >= vx) ? 1 : 0; break;
+                        case 0xE: v[x] = (shifted * 2) % 256; v[0xF] = shifted / 128; break;
+                        // the others don't exist and do nothing
+                    }
+                    break;
+                }
+                case 0x9: Skip(v[x] != v[y]); break;
+                case 0xA: i = nnn; break;
+                case 0xB: pc = nnn + v[Quirks::jumpUsesVx ? x : 0]; break;
+                case 0xC: v[x] = NextRandom() & kk; break;
+                case 0xD: v[0xF] = Draw(v[x], v[y], n); break;
+                case 0xE: {
+                    bool held = (keys >> (v[x] % 16)) & 0x1;
+                    if (kk == 0x9E) {
+                        Skip(held);
+                    }
+                    else if (kk == 0xA1) {
+                        Skip(!held);
+                    }
+                    break;
+                }
+                case 0xF: {
+                    switch (kk) {
+                        case 0x07: v[x] = delay; break;
+                        case 0x0A: {
+                            // lowest numbered key that's held, or wait here until there is one
+                            bool found = false;
+                            for (unsigned int key = 0; key < 16 && !found; key++) {
+                                if ((keys >> key) & 0x1) {
+                                    v[x] = key;
+                                    found = true;
+                                }
+                            }
+                            if (!found) {
+                                pc -= 2;
+                            }
+                            break;
+                        }
+                        case 0x15: delay = v[x]; break;
+                        case 0x18: sound = v[x]; break;
+                        case 0x1E: i += v[x]; break;
+                        case 0x29: i = 0x50 + v[x] * 5; break;
+                        case 0x33: {
+                            Write(i, v[x] / 100);
+                            Write(i + 1, (v[x] / 10) % 10);
+                            Write(i + 2, v[x] % 10);
+                            break;
+                        }
+                        case 0x55: {
+                            for (unsigned int k = 0; k <= x; k++) {
+                                Write(i + k, v[k]);
+                            }
+                            if (Quirks::loadStoreIncrementsI) {
+                                i += x + 1;
+                            }
+                            break;
+                        }
+                        case 0x65: {
+                            for (unsigned int k = 0; k <= x; k++) {
+                                v[k] = Read(i + k);
+                            }
+                            if (Quirks::loadStoreIncrementsI) {
+                                i += x + 1;
+                            }
+                            break;
+                        }
+                        case 0x30: {
+                            if (Quirks::hasSuperChip) {
+                                i = 0xA0 + (v[x] % 16) * 10;
+                            }
+                            break;
+                        }
+                        case 0x75:
+                        case 0x85: {
+                            if (Quirks::hasSuperChip) {
+                                unsigned int last = std::min(x, Quirks::hasXoChip ? 15u : 7u);
+                                for (unsigned int k = 0; k <= last; k++) {
+                                    if (kk == 0x75) {
+                                        rpl[k] = v[k];
+                                    }
+                                    else {
+                                        v[k] = rpl[k];
+                                    }
+                                }
+                            }
+                            break;
+                        }
+                        case 0x00: {
+                            if (Quirks::hasXoChip && opcode == 0xF000) { // I = the next two bytes, which get stepped over
+                                i = Read(pc) << 8 | Read(pc + 1);
+                                pc += 2;
+                            }
+                            break;
+                        }
+                        case 0x01: {
+                            if (Quirks::hasXoChip) {
+                                planeMask = x % 4;
+                            }
+                            break;
+                        }
+                        case 0x02: {
+                            if (Quirks::hasXoChip && opcode == 0xF002) {
+                                for (unsigned int k = 0; k < 16; k++) {
+                                    audio[k] = Read(i + k);
+                                }
+                            }
+                            break;
+                        }
+                        case 0x3A: {
+                            if (Quirks::hasXoChip) {
+                                pitch = v[x];
+                            }
+                            break;
+                        }
+                    }
+                    break;
+                }
+            }
+        };
+
+    private:
+
+        std::vector<bool> pixels = std::vector<bool>(planes * width * height, false);
+        std::vector<uint64_t> words;
+        bool displayChanged = true;
+
+        unsigned int Scale() const {
+            // low resolution pixels on the big screen are 2 x 2
+            return (Quirks::hasSuperChip && !hires) ? 2 : 1;
+        };
+
+        void Skip(bool condition) {
+            if (condition) {
+                // on XO-CHIP the instruction being skipped might be the 4 byte F000 nnnn
+                bool longInstruction = Quirks::hasXoChip && Read(pc) == 0xF0 && Read(pc + 1) == 0x00;
+                pc += longInstruction ? 4 : 2;
+            }
+        };
+
+        void ResetFlagAfterLogic() {
+            if (Quirks::logicResetsVf) {
+                v[0xF] = 0;
+            }
+        };
+
+        static unsigned int Distance(unsigned int x, unsigned int y) {
+            return (x <= y) ? y - x : x - y;
+        };
+
+        static unsigned int Towards(unsigned int x, unsigned int y, unsigned int k) {
+            return (x <= y) ? x + k : x - k;
+        };
+
+        unsigned char NextRandom() {
+            // xoshiro256**, straight from the paper, with the top byte of each result
+            uint64_t result = RotateLeft(rng[1] * 5, 7) * 9;
+            uint64_t t = rng[1] << 17;
+            rng[2] ^= rng[0];
+            rng[3] ^= rng[1];
+            rng[1] ^= rng[2];
+            rng[0] ^= rng[3];
+            rng[2] ^= t;
+            rng[3] = RotateLeft(rng[3], 45);
+            return result >> 56;
+        };
+
+        static uint64_t RotateLeft(uint64_t value, int amount) {
+            return (value << amount) | (value >> (64 - amount));
+        };
+
+        void Clear(unsigned char mask) {
+            for (unsigned int plane = 0; plane < planes; plane++) {
+                if ((mask >> plane) & 0x1) {
+                    for (unsigned int y = 0; y < height; y++) {
+                        for (unsigned int x = 0; x < width; x++) {
+                            SetPixel(plane, x, y, false);
+                        }
+                    }
+                }
+            }
+        };
+
+        void Scroll(int right, int down) {
+            // move every pixel of the selected planes, with blanks coming in from the edge
+            for (unsigned int plane = 0; plane < planes; plane++) {
+                if (((planeMask >> plane) & 0x1) == 0) {
+                    continue;
+                }
+                std::vector<bool> moved(width * height, false);
+                for (int y = 0; y < static_cast<int>(height); y++) {
+                    for (int x = 0; x < static_cast<int>(width); x++) {
+                        int fromX = x - right;
+                        int fromY = y - down;
+                        if (fromX >= 0 && fromX < static_cast<int>(width) && fromY >= 0 && fromY < static_cast<int>(height)) {
+                            moved[y * width + x] = GetPixel(plane, fromX, fromY);
+                        }
+                    }
+                }
+                for (unsigned int y = 0; y < height; y++) {
+                    for (unsigned int x = 0; x < width; x++) {
+                        SetPixel(plane, x, y, moved[y * width + x]);
+                    }
+                }
+            }
+        };
+
+        unsigned char Draw(unsigned int vx, unsigned int vy, unsigned int rows) {
+            // XOR a sprite on a pixel at a time, in the program's own pixels. returns 1 if anything got turned off
+            const unsigned int scale = Scale();
+            const unsigned int programWidth = width / scale;
+            const unsigned int programHeight = height / scale;
+            const bool big = Quirks::hasSuperChip && rows == 0;
+            const unsigned int spriteWidth = big ? 16 : 8;
+            const unsigned int spriteHeight = big ? 16 : rows;
+            const unsigned int bytesPerRow = spriteWidth / 8;
+            unsigned int address = i;
+            bool collision = false;
+            for (unsigned int plane = 0; plane < planes; plane++) {
+                if (((planeMask >> plane) & 0x1) == 0) {
+                    continue;
+                }
+                for (unsigned int row = 0; row < spriteHeight; row++) {
+                    for (unsigned int column = 0; column < spriteWidth; column++) {
+                        unsigned char byte = Read(address + row * bytesPerRow + column / 8);
+                        if (((byte >> (7 - column % 8)) & 0x1) == 0) {
+                            continue;
+                        }
+                        unsigned int x = vx % programWidth + column;
+                        unsigned int y = vy % programHeight + row;
+                        if (x >= programWidth || y >= programHeight) {
+                            if (!Quirks::spritesWrap) {
+                                continue;
+                            }
+                            x %= programWidth;
+                            y %= programHeight;
+                        }
+                        for (unsigned int dy = 0; dy < scale; dy++) {
+                            for (unsigned int dx = 0; dx < scale; dx++) {
+                                bool on = GetPixel(plane, x * scale + dx, y * scale + dy);
+                                collision = collision || on;
+                                SetPixel(plane, x * scale + dx, y * scale + dy, !on);
+                            }
+                        }
+                    }
+                }
+                address += spriteHeight * bytesPerRow;
+            }
+            return collision ? 1 : 0;
+        };
+};
+
+/*
+    Checks the real core, every way it can run, against ReferenceChip8.
+
+    CheckOpcodes goes down a table of every instruction. The register maths ones are tried with every possible pair of
+    inputs (all 65536 of them), everything else with `randomCases` random machines. Each case sets up the reference and
+    every variant of the core identically (registers, timers, keys, stack, the code at pc, the bytes around I, and now and
+    then the whole screen) then runs one instruction on all of them and compares. CheckProgram does the same with a whole
+    ROM, one instruction at a time, ticking the timers and changing the keys now and then.
+
+    The variants are the four --dispatch strategies and the JIT (one instruction per block, so it can be compared after
+    every step). Either check stops at the first difference and says which variant, which instruction and what was wrong.
+    Memory is compared around pc and I after every instruction (nothing else can write to it) and all of it every so often.
+
+    CheckIdleSkip runs a few little loops that look idle (and some that only nearly are) for a number of frames on every
+    dispatch strategy, once with idle loop skipping and once without, and checks both end up in the same state.
+
+    CheckRewind pushes thousands of frames of all sorts of sizes through small RewindBuffers, so the arena wraps round
+    many times, rewinds by random amounts in between and checks every frame it gets back is exactly the one pushed.
+*/
+class ConformanceHarness
+{
+    public:
+
+        unsigned int randomCases = 2000; // cases per instruction that doesn't get every input tried
+        uint64_t seed = 0;
+
+        template <typename Quirks>
+        bool CheckOpcodes() {
+            typedef Chip8Core<Quirks> Core;
+            std::vector<Variant<Core>> variants = MakeVariants<Core>();
+            auto reference = std::make_unique<ReferenceChip8<Quirks>>();
+            std::mt19937_64 random(seed);
+
+            // a random machine to start from: fonts where the core puts them and noise everywhere else
+            PullAll(*reference, *variants[0].core);
+            for (unsigned int address = 0x200; address < Core::memorySize; address++) {
+                reference->memory[address] = random() & 0xFF;
+            }
+            PushAll(*reference, variants);
+
+            unsigned long long total = 0;
+            for (const OpcodeTest& test : Tests()) {
+                if ((test.machine == SuperChipAndLater && !Quirks::hasSuperChip) || (test.machine == XoChipOnly && !Quirks::hasXoChip)) {
+                    continue;
+                }
+                unsigned int cases = (test.inputs == Inputs::EveryVxVy || test.inputs == Inputs::EveryVxKk) ? 65536 : randomCases;
+                uint16_t opcode = 0;
+                unsigned short pc = 0;
+                for (unsigned int c = 0; c < cases; c++) {
+                    bool newScreen = (c % 64) == 0;
+                    bool newCode = cases != 65536 || c % 256 == 0;
+                    if (newCode) {
+                        // the every-input ones keep one instruction at one address for 256 cases at a time,
+                        // otherwise the jit spends all its time recompiling
+                        opcode = test.pattern | (random() & ~test.fixed);
+                        pc = random() % Core::memorySize;
+                        if (random() % 8 != 0) {
+                            pc &= ~1u; // mostly even, like real programs
+                        }
+                    }
+                    unsigned int x = (opcode >> 8) & 0xF;
+                    unsigned int y = (opcode >> 4) & 0xF;
+                    Randomize(*reference, random, pc, newCode, test.inputs == Inputs::StoreThenRun, newScreen);
+                    if (test.inputs == Inputs::EveryVxVy) {
+                        reference->v[x] = c >> 8;
+                        reference->v[y] = c & 0xFF;
+                    }
+                    else if (test.inputs == Inputs::EveryVxKk) {
+                        opcode = (opcode & 0xFF00) | (c >> 8);
+                        reference->v[x] = c & 0xFF;
+                    }
+                    reference->Write(pc, opcode >> 8);
+                    reference->Write(pc + 1, opcode & 0xFF);
+                    PushCase(*reference, variants, newScreen);
+
+                    // usually just the one instruction. the store-then-run ones run the instruction after it first (so the
+                    // decode cache and the jit have it), then the store that writes over it, then it again
+                    std::vector<unsigned short> starts = { pc };
+                    if (test.inputs == Inputs::StoreThenRun) {
+                        starts = { static_cast<unsigned short>(pc + 2), pc, static_cast<unsigned short>(pc + 2) };
+                    }
+                    for (size_t s = 0; s < starts.size(); s++) {
+                        reference->pc = starts[s];
+                        unsigned short i = reference->i;
+                        unsigned short running = reference->Read(starts[s]) << 8 | reference->Read(starts[s] + 1);
+                        std::string before = Describe(*reference, running);
+                        reference->Execute();
+                        for (Variant<Core>& variant : variants) {
+                            variant.core->programCounter = starts[s];
+                            variant.Step();
+                            std::string difference;
+                            bool wholeMemory = (c % 1024) == 1023 || c + 1 == cases;
+                            if (!Compare(*reference, *variant.core, starts[s], i, wholeMemory, difference)) {
+                                std::cout << Quirks::name << ": " << variant.name << " got " << test.name << " wrong. " << difference
+                                          << " (" << before << ")" << std::endl;
+                                return false;
+                            }
+                        }
+                    }
+                }
+                total += cases;
+                std::cout << Quirks::name << ": " << std::left << std::setw(32) << test.name << std::right << std::setw(7) << cases
+                          << " cases ok" << std::endl;
+            }
+            std::cout << Quirks::name << ": every instruction matched the reference in " << total << " cases on "
+                      << variants.size() << " variants" << std::endl;
+            return true;
+        };
+
+        template <typename Quirks>
+        bool CheckProgram(const std::string& path, unsigned long long cycles, unsigned int instructionsPerFrame) {
+            typedef Chip8Core<Quirks> Core;
+            std::vector<Variant<Core>> variants = MakeVariants<Core>();
+            for (Variant<Core>& variant : variants) {
+                if (!variant.core->LoadProgram(path)) {
+                    std::cout << "could not load program: " << path << std::endl;
+                    return false;
+                }
+            }
+            auto reference = std::make_unique<ReferenceChip8<Quirks>>();
+            PullAll(*reference, *variants[0].core);
+            std::mt19937_64 random(seed);
+
+            for (unsigned long long step = 0; step < cycles; step++) {
+                bool frameStart = (step % instructionsPerFrame) == 0;
+                if (frameStart && step > 0) {
+                    reference->TickTimers();
+                    if (random() % 16 == 0) {
+                        // someone presses or lets go of something now and then. usually just one key
+                        reference->keys = (random() % 4 == 0) ? 0 : (1 << (random() % 16));
+                    }
+                    for (Variant<Core>& variant : variants) {
+                        variant.core->TickTimers();
+                        variant.core->SetKeyMask(reference->keys);
+                    }
+                }
+
+                unsigned short pc = reference->pc;
+                unsigned short i = reference->i;
+                unsigned short opcode = reference->Read(pc) << 8 | reference->Read(pc + 1);
+                std::string before = Describe(*reference, opcode);
+                reference->Execute();
+                for (Variant<Core>& variant : variants) {
+                    variant.Step();
+                    std::string difference;
+                    if (!Compare(*reference, *variant.core, pc, i, frameStart, difference)) {
+                        std::cout << path << " (" << Quirks::name << "): " << variant.name << " diverged from the reference at instruction "
+                                  << step << ". " << difference << " (" << before << ")" << std::endl;
+                        return false;
+                    }
+                }
+            }
+            std::cout << path << " (" << Quirks::name << "): " << variants.size() << " variants matched the reference for "
+                      << cycles << " instructions" << std::endl;
+            return true;
+        };
+
+        template <typename Quirks>
+        bool CheckIdleSkip() {
+            typedef Chip8Core<Quirks> Core;
+            struct IdleTest {
+                const char* name;
+                std::vector<unsigned char> program;
+            };
+            // every one starts with V1 = 0x90 and the delay timer set from it, then goes round the loop from 0x204
+            const std::vector<IdleTest> tests = {
+                { "waits for the delay timer", { 0x61, 0x90, 0xF1, 0x15, 0xF1, 0x07, 0x31, 0x00, 0x12, 0x04 } },
+                { "counts the delay timer down itself", { 0x61, 0x90, 0xF1, 0x15, 0xF1, 0x07, 0x71, 0xFF, 0xF1, 0x15, 0x61, 0x00, 0x12, 0x04 } },
+                { "counts the sound timer down itself", { 0x61, 0x90, 0xF1, 0x15, 0xF1, 0x07, 0x71, 0xFF, 0xF1, 0x18, 0xF1, 0x15, 0x61, 0x00, 0x12, 0x04 } },
+                { "sets the sound timer from the delay timer", { 0x61, 0x90, 0xF1, 0x15, 0xF1, 0x07, 0xF1, 0x18, 0x61, 0x00, 0x12, 0x04 } },
+            };
+            const unsigned int instructionsPerFrame = 100;
+            const unsigned int frames = 20;
+            const Chip8Dispatch strategies[] = { Chip8Dispatch::Switch, Chip8Dispatch::DecodeCache, Chip8Dispatch::Table, Chip8Dispatch::Threaded };
+
+            for (const IdleTest& test : tests) {
+                unsigned long long skipped = 0;
+                for (Chip8Dispatch strategy : strategies) {
+                    uint64_t hashes[2] = { 0, 0 };
+                    for (int skip = 0; skip < 2; skip++) {
+                        auto core = std::make_unique<Core>();
+                        core->Initialize();
+                        core->Seed(seed);
+                        core->SetDispatch(strategy);
+                        core->SetIdleSkipEnabled(skip == 1);
+                        core->LoadProgram(test.program.data(), test.program.size());
+                        for (unsigned int frame = 0; frame < frames; frame++) {
+                            core->RunFor(instructionsPerFrame);
+                            core->TickTimers();
+                        }
+                        hashes[skip] = core->StateHash();
+                        skipped += core->GetIdleInstructions();
+                    }
+                    if (hashes[0] != hashes[1]) {
+                        std::cout << Quirks::name << ": " << Chip8DispatchName(strategy) << " ends up somewhere else with idle skipping when the loop "
+                                  << test.name << std::endl;
+                        return false;
+                    }
+                }
+                std::cout << Quirks::name << ": idle skip, " << std::left << std::setw(42) << test.name << std::right
+                          << " same state (" << skipped << " instructions skipped)" << std::endl;
+            }
+            return true;
+        };
+
+        template <typename Quirks>
+        bool CheckRewind() {
+            typedef Chip8Core<Quirks> Core;
+            struct RewindTest {
+                size_t arenaBytes;
+                size_t maxFrames;
+            };
+            // one where the arena runs out long before the record ring does and one where it's the other way round
+            const RewindTest tests[] = { { 2000, 64 }, { 1 << 16, 600 } };
+            const unsigned long long frames = 3000;
+            const size_t memoryStart = 4 + 2 + 4 + 2; // where the memory starts in a savestate
+
+            for (const RewindTest& test : tests) {
+                std::mt19937_64 random(seed);
+                auto core = std::make_unique<Core>();
+                core->Initialize();
+                core->Seed(seed);
+                std::vector<unsigned char> program(512);
+                for (unsigned char& byte : program) {
+                    byte = random() & 0xFF;
+                }
+                core->LoadProgram(program.data(), program.size());
+
+                RewindBuffer rewind(test.arenaBytes, test.maxFrames);
+                std::deque<std::vector<unsigned char>> history; // the whole state of every frame the buffer should still have
+                unsigned long long pushed = 0;
+                unsigned long long rewound = 0;
+                while (pushed < frames) {
+                    unsigned int run = 1 + random() % 200;
+                    for (unsigned int f = 0; f < run; f++, pushed++) {
+                        // a frame of whatever the random program does, then anything from none to a few hundred bytes of
+                        // memory changed on top so the deltas come in every size
+                        core->RunFor(11);
+                        std::vector<unsigned char> state = Savestate::Save(*core);
+                        unsigned int changes = random() % 300;
+                        for (unsigned int c = 0; c < changes; c++) {
+                            state[memoryStart + random() % Core::memorySize] = random() & 0xFF;
+                        }
+                        Savestate::Read(*core, state.data(), state.size());
+                        rewind.Push(*core);
+                        history.push_back(state);
+                        while (history.size() > rewind.FrameCount()) {
+                            history.pop_front();
+                        }
+                    }
+                    unsigned int back = random() % 100;
+                    for (unsigned int b = 0; b < back; b++) {
+                        bool went = rewind.Rewind(*core);
+                        if (went != (history.size() > 1)) {
+                            std::cout << Quirks::name << ": rewind with a " << test.arenaBytes << " byte arena " << (went ? "went" : "didn't go")
+                                      << " back with " << history.size() << " frames kept" << std::endl;
+                            return false;
+                        }
+                        if (!went) {
+                            break;
+                        }
+                        history.pop_back();
+                        rewound++;
+                        if (Savestate::Save(*core) != history.back()) {
+                            std::cout << Quirks::name << ": rewind with a " << test.arenaBytes << " byte arena got back the wrong frame after "
+                                      << pushed << " pushed and " << rewound << " rewound" << std::endl;
+                            return false;
+                        }
+                    }
+                }
+                std::cout << Quirks::name << ": rewind, " << pushed << " frames through a " << test.arenaBytes << " byte arena, "
+                          << rewound << " rewound and all matched" << std::endl;
+            }
+            return true;
+        };
+
+    private:
+
+        enum class Inputs { Random, EveryVxVy, EveryVxKk, StoreThenRun };
+        enum Machine { AnyMachine, SuperChipAndLater, XoChipOnly };
+
+        struct OpcodeTest {
+            const char* name;
+            uint16_t pattern; // the bits that make it this instruction
+            uint16_t fixed; // which bits of pattern are fixed. the rest are operands and get filled in at random
+            Inputs inputs;
+            Machine machine;
+        };
+
+        static const std::vector<OpcodeTest>& Tests() {
+            static const std::vector<OpcodeTest> tests = {
+                { "00E0 clear", 0x00E0, 0xFFFF, Inputs::Random, AnyMachine },
+                { "00EE return", 0x00EE, 0xFFFF, Inputs::Random, AnyMachine },
+                { "0nnn machine code (ignored)", 0x0000, 0xF000, Inputs::Random, AnyMachine },
+                { "1nnn jump", 0x1000, 0xF000, Inputs::Random, AnyMachine },
+                { "2nnn call", 0x2000, 0xF000, Inputs::Random, AnyMachine },
+                { "3xkk skip if Vx == kk", 0x3000, 0xF000, Inputs::EveryVxKk, AnyMachine },
+                { "4xkk skip if Vx != kk", 0x4000, 0xF000, Inputs::EveryVxKk, AnyMachine },
+                { "5xy0 skip if Vx == Vy", 0x5000, 0xF00F, Inputs::EveryVxVy, AnyMachine },
+                { "5xyn any n", 0x5000, 0xF000, Inputs::Random, AnyMachine },
+                { "6xkk Vx = kk", 0x6000, 0xF000, Inputs::EveryVxKk, AnyMachine },
+                { "7xkk Vx += kk", 0x7000, 0xF000, Inputs::EveryVxKk, AnyMachine },
+                { "8xy0 Vx = Vy", 0x8000, 0xF00F, Inputs::EveryVxVy, AnyMachine },
+                { "8xy1 or", 0x8001, 0xF00F, Inputs::EveryVxVy, AnyMachine },
+                { "8xy2 and", 0x8002, 0xF00F, Inputs::EveryVxVy, AnyMachine },
+                { "8xy3 xor", 0x8003, 0xF00F, Inputs::EveryVxVy, AnyMachine },
+                { "8xy4 add, VF = carry", 0x8004, 0xF00F, Inputs::EveryVxVy, AnyMachine },
+                { "8xy5 sub, VF = no borrow", 0x8005, 0xF00F, Inputs::EveryVxVy, AnyMachine },
+                { "8xy6 shift right", 0x8006, 0xF00F, Inputs::EveryVxVy, AnyMachine },
+                { "8xy7 subn, VF = no borrow", 0x8007, 0xF00F, Inputs::EveryVxVy, AnyMachine },
+                { "8xyE shift left", 0x800E, 0xF00F, Inputs::EveryVxVy, AnyMachine },
+                { "8xyn any n", 0x8000, 0xF000, Inputs::Random, AnyMachine },
+                { "9xy0 skip if Vx != Vy", 0x9000, 0xF00F, Inputs::EveryVxVy, AnyMachine },
+                { "Annn I = nnn", 0xA000, 0xF000, Inputs::Random, AnyMachine },
+                { "Bnnn jump with offset", 0xB000, 0xF000, Inputs::EveryVxKk, AnyMachine },
+                { "Cxkk random & kk", 0xC000, 0xF000, Inputs::EveryVxKk, AnyMachine },
+                { "Dxyn draw", 0xD000, 0xF000, Inputs::Random, AnyMachine },
+                { "Ex9E skip if key", 0xE09E, 0xF0FF, Inputs::Random, AnyMachine },
+                { "ExA1 skip if not key", 0xE0A1, 0xF0FF, Inputs::Random, AnyMachine },
+                { "Fx07 Vx = delay", 0xF007, 0xF0FF, Inputs::Random, AnyMachine },
+                { "Fx0A wait for key", 0xF00A, 0xF0FF, Inputs::Random, AnyMachine },
+                { "Fx15 delay = Vx", 0xF015, 0xF0FF, Inputs::Random, AnyMachine },
+                { "Fx18 sound = Vx", 0xF018, 0xF0FF, Inputs::Random, AnyMachine },
+                { "Fx1E I += Vx", 0xF01E, 0xF0FF, Inputs::Random, AnyMachine },
+                { "Fx29 I = font digit", 0xF029, 0xF0FF, Inputs::Random, AnyMachine },
+                { "Fx33 decimal digits", 0xF033, 0xF0FF, Inputs::Random, AnyMachine },
+                { "Fx55 store V0..Vx", 0xF055, 0xF0FF, Inputs::Random, AnyMachine },
+                { "Fx65 load V0..Vx", 0xF065, 0xF0FF, Inputs::Random, AnyMachine },
+                { "Fx55 then run what it stored", 0xF055, 0xF0FF, Inputs::StoreThenRun, AnyMachine },
+                { "Fx33 then run what it stored", 0xF033, 0xF0FF, Inputs::StoreThenRun, AnyMachine },
+                { "Dxy0 16 x 16 draw", 0xD000, 0xF00F, Inputs::Random, SuperChipAndLater },
+                { "00Cn scroll down", 0x00C0, 0xFFF0, Inputs::Random, SuperChipAndLater },
+                { "00FB scroll right", 0x00FB, 0xFFFF, Inputs::Random, SuperChipAndLater },
+                { "00FC scroll left", 0x00FC, 0xFFFF, Inputs::Random, SuperChipAndLater },
+                { "00FD exit", 0x00FD, 0xFFFF, Inputs::Random, SuperChipAndLater },
+                { "00FE low resolution", 0x00FE, 0xFFFF, Inputs::Random, SuperChipAndLater },
+                { "00FF high resolution", 0x00FF, 0xFFFF, Inputs::Random, SuperChipAndLater },
+                { "Fx30 I = big font digit", 0xF030, 0xF0FF, Inputs::Random, SuperChipAndLater },
+                { "Fx75 save flags", 0xF075, 0xF0FF, Inputs::Random, SuperChipAndLater },
+                { "Fx85 load flags", 0xF085, 0xF0FF, Inputs::Random, SuperChipAndLater },
+                { "00Dn scroll up", 0x00D0, 0xFFF0, Inputs::Random, XoChipOnly },
+                { "5xy2 store Vx..Vy", 0x5002, 0xF00F, Inputs::Random, XoChipOnly },
+                { "5xy3 load Vx..Vy", 0x5003, 0xF00F, Inputs::Random, XoChipOnly },
+                { "F000 nnnn long I", 0xF000, 0xFFFF, Inputs::Random, XoChipOnly },
+                { "Fn01 select planes", 0xF001, 0xF0FF, Inputs::Random, XoChipOnly },
+                { "F002 audio pattern", 0xF002, 0xFFFF, Inputs::Random, XoChipOnly },
+                { "Fx3A pitch", 0xF03A, 0xF0FF, Inputs::Random, XoChipOnly },
+                { "5xy2 then run what it stored", 0x5002, 0xF00F, Inputs::StoreThenRun, XoChipOnly },
+                { "any opcode at all", 0x0000, 0x0000, Inputs::Random, AnyMachine },
+            };
+            return tests;
+        };
+
+        template <typename Core>
+        struct Variant {
+            std::string name;
+            std::unique_ptr<Core> core;
+            std::unique_ptr<Chip8Jit> jit;
+
+            void Step() {
+                if (jit != nullptr) {
+                    jit->RunFor(*core, 1);
+                }
+                else {
+                    core->RunFor(1);
+                }
+            };
+        };
+
+        template <typename Core>
+        std::vector<Variant<Core>> MakeVariants() const {
+            std::vector<Variant<Core>> variants;
+            const Chip8Dispatch strategies[] = { Chip8Dispatch::Switch, Chip8Dispatch::DecodeCache, Chip8Dispatch::Table, Chip8Dispatch::Threaded };
+            for (Chip8Dispatch strategy : strategies) {
+                variants.push_back({ Chip8DispatchName(strategy), std::make_unique<Core>(), nullptr });
+                variants.back().core->SetDispatch(strategy);
+            }
+            auto jit = std::make_unique<Chip8Jit>();
+            if (jit->Available()) {
+                jit->SetMaxBlockLength(1);
+                variants.push_back({ "jit", std::make_unique<Core>(), std::move(jit) });
+            }
+            for (Variant<Core>& variant : variants) {
+                variant.core->Initialize();
+                variant.core->Seed(seed);
+            }
+            return variants;
+        };
+
+        template <typename Quirks>
+        static void Randomize(ReferenceChip8<Quirks>& reference, std::mt19937_64& random, unsigned short pc, bool newCode, bool storeOverNext,
+                              bool newScreen) {
+            // everything an instruction could look at gets a new random value, apart from where it is
+            typedef Chip8Core<Quirks> Core;
+            for (unsigned char& value : reference.v) {
+                value = random() & 0xFF;
+            }
+            reference.pc = pc;
+            reference.i = random() & 0xFFFF;
+            if (storeOverNext) {
+                // I points at the next instruction, sometimes by way of an address past the end of memory that wraps round to it
+                reference.i = pc + 2 + (random() % 4) * Core::memorySize;
+            }
+            for (unsigned short& value : reference.stack) {
+                value = random() & 0xFFFF;
+            }
+            reference.sp = random() % 16;
+            reference.delay = random() & 0xFF;
+            reference.sound = random() & 0xFF;
+            reference.keys = (random() % 4 == 0) ? 0 : random() & 0xFFFF;
+            for (unsigned int k = 0; k < 32; k++) {
+                reference.Write(reference.i + k, random() & 0xFF);
+            }
+            // the instruction after this one, which is what a skip skips. on XO-CHIP sometimes the 4 byte F000 nnnn
+            if (newCode) {
+                bool longNext = Quirks::hasXoChip && random() % 4 == 0;
+                reference.Write(pc + 2, longNext ? 0xF0 : random() & 0xFF);
+                reference.Write(pc + 3, longNext ? 0x00 : random() & 0xFF);
+            }
+            if constexpr (Quirks::hasSuperChip) {
+                for (unsigned int k = 0; k < 16; k++) {
+                    reference.rpl[k] = random() & 0xFF;
+                    reference.audio[k] = random() & 0xFF;
+                }
+                reference.pitch = random() & 0xFF;
+                if (newScreen) {
+                    reference.hires = random() % 2;
+                }
+            }
+            if constexpr (Quirks::hasXoChip) {
+                reference.planeMask = random() % 4;
+            }
+            if (newScreen) {
+                // anything from nearly empty to nearly full so draws hit and miss
+                unsigned int density = random() % 8;
+                std::vector<uint64_t> words(Core::displayWords);
+                for (uint64_t& word : words) {
+                    word = random();
+                    for (unsigned int k = 0; k < density; k++) {
+                        word &= random();
+                    }
+                }
+                reference.SetDisplayWords(words.data());
+            }
+        };
+
+        template <typename Quirks>
+        static void PullAll(ReferenceChip8<Quirks>& reference, const Chip8Core<Quirks>& core) {
+            // the reference starts off as an exact copy of a core
+            std::copy(std::begin(core.memory), std::end(core.memory), reference.memory.begin());
+            std::copy(std::begin(core.vRegister), std::end(core.vRegister), reference.v);
+            std::copy(std::begin(core.stack), std::end(core.stack), reference.stack);
+            std::copy(std::begin(core.rngState), std::end(core.rngState), reference.rng);
+            std::copy(std::begin(core.rplFlags), std::end(core.rplFlags), reference.rpl);
+            std::copy(std::begin(core.audioPattern), std::end(core.audioPattern), reference.audio);
+            reference.i = core.indexRegister;
+            reference.pc = core.programCounter;
+            reference.sp = core.stackPointer;
+            reference.delay = core.delayTimer;
+            reference.sound = core.soundTimer;
+            reference.keys = core.GetKeyMask();
+            reference.hires = core.hires;
+            reference.planeMask = core.planeMask;
+            reference.pitch = core.pitch;
+            reference.SetDisplayWords(core.display);
+        };
+
+        template <typename Quirks, typename Core>
+        static void PushAll(ReferenceChip8<Quirks>& reference, std::vector<Variant<Core>>& variants) {
+            // and the other way round, all of memory
+            for (Variant<Core>& variant : variants) {
+                std::copy(reference.memory.begin(), reference.memory.end(), variant.core->memory);
+                variant.core->InvalidateDecodeCache(0, Core::memorySize);
+            }
+            PushCase(reference, variants, true);
+        };
+
+        template <typename Quirks, typename Core>
+        static void PushCase(ReferenceChip8<Quirks>& reference, std::vector<Variant<Core>>& variants, bool newScreen) {
+            // just what Randomize changes: the registers and the bytes at pc and I
+            for (Variant<Core>& variant : variants) {
+                Core& core = *variant.core;
+                std::copy(std::begin(reference.v), std::end(reference.v), core.vRegister);
+                std::copy(std::begin(reference.stack), std::end(reference.stack), core.stack);
+                std::copy(std::begin(reference.rng), std::end(reference.rng), core.rngState);
+                std::copy(std::begin(reference.rpl), std::end(reference.rpl), core.rplFlags);
+                std::copy(std::begin(reference.audio), std::end(reference.audio), core.audioPattern);
+                core.indexRegister = reference.i;
+                core.programCounter = reference.pc;
+                core.stackPointer = reference.sp;
+                core.delayTimer = reference.delay;
+                core.soundTimer = reference.sound;
+                core.SetKeyMask(reference.keys);
+                core.hires = reference.hires;
+                core.planeMask = reference.planeMask;
+                core.pitch = reference.pitch;
+                PushMemory(reference, core, reference.pc, 4);
+                PushMemory(reference, core, reference.i, 32);
+                if (newScreen) {
+                    const std::vector<uint64_t>& words = reference.DisplayWords();
+                    std::copy(words.begin(), words.end(), core.display);
+                }
+            }
+        };
+
+        template <typename Quirks>
+        static void PushMemory(const ReferenceChip8<Quirks>& reference, Chip8Core<Quirks>& core, unsigned int address, unsigned int length) {
+            // through InvalidateDecodeCache like any other write, so the decode cache and the jit notice the new code.
+            // bytes that haven't changed are left alone so the jit can keep a block that's still good
+            for (unsigned int k = 0; k < length; k++) {
+                unsigned int target = (address + k) & Chip8Core<Quirks>::memoryMask;
+                if (core.memory[target] != reference.Read(address + k)) {
+                    core.memory[target] = reference.Read(address + k);
+                    core.InvalidateDecodeCache(target, 1);
+                }
+            }
+        };
+
+        template <typename Quirks>
+        static bool Compare(ReferenceChip8<Quirks>& reference, const Chip8Core<Quirks>& core, unsigned short pc, unsigned short i,
+                            bool wholeMemory, std::string& difference) {
+            // true if they match. otherwise `difference` says what the first thing that doesn't is
+            std::ostringstream out;
+            out << std::hex;
+            auto check = [&](const char* what, int index, unsigned int got, unsigned int expected) {
+                if (got != expected) {
+                    out << what;
+                    if (index >= 0) {
+                        out << index;
+                    }
+                    out << " is 0x" << got << ", expected 0x" << expected;
+                    return false;
+                }
+                return true;
+            };
+
+            bool same = true;
+            for (int r = 0; r < 16 && same; r++) {
+                same = check("V", r, core.vRegister[r], reference.v[r]);
+            }
+            same = same && check("I", -1, core.indexRegister, reference.i);
+            same = same && check("pc", -1, core.programCounter, reference.pc);
+            same = same && check("stack pointer", -1, core.stackPointer, reference.sp);
+            for (int s = 0; s < 16 && same; s++) {
+                same = check("stack ", s, core.stack[s], reference.stack[s]);
+            }
+            same = same && check("delay timer", -1, core.delayTimer, reference.delay);
+            same = same && check("sound timer", -1, core.soundTimer, reference.sound);
+            same = same && check("hires", -1, core.hires, reference.hires);
+            same = same && check("plane mask", -1, core.planeMask, reference.planeMask);
+            same = same && check("pitch", -1, core.pitch, reference.pitch);
+            for (int k = 0; k < 16 && same; k++) {
+                same = check("rpl flag ", k, core.rplFlags[k], reference.rpl[k]) && check("audio byte ", k, core.audioPattern[k], reference.audio[k]);
+            }
+            for (int k = 0; k < 4 && same; k++) {
+                if (core.rngState[k] != reference.rng[k]) {
+                    out << "random number state differs";
+                    same = false;
+                }
+            }
+
+            const std::vector<uint64_t>& words = reference.DisplayWords();
+            for (unsigned int w = 0; w < Chip8Core<Quirks>::displayWords && same; w++) {
+                if (core.display[w] != words[w]) {
+                    unsigned int row = w / Chip8Core<Quirks>::displayWordsPerRow;
+                    out << "display differs on row " << std::dec << row % Chip8Core<Quirks>::displayHeight
+                        << " of plane " << row / Chip8Core<Quirks>::displayHeight << std::hex;
+                    same = false;
+                }
+            }
+
+            // instructions only write memory at I onwards (or at I + x for Fx55 and friends), so that's the place to look
+            auto checkMemory = [&](unsigned int start, unsigned int length) {
+                for (unsigned int k = 0; k < length && same; k++) {
+                    unsigned int address = (start + k) & Chip8Core<Quirks>::memoryMask;
+                    same = check("memory at 0x", address, core.memory[address], reference.memory[address]);
+                }
+            };
+            checkMemory(i, 32);
+            checkMemory(pc, 4);
+            if (wholeMemory) {
+                checkMemory(0, Chip8Core<Quirks>::memorySize);
+            }
+
+            difference = out.str();
+            return same;
+        };
+
+        template <typename Quirks>
+        static std::string Describe(const ReferenceChip8<Quirks>& reference, unsigned short opcode) {
+            // the inputs that matter most, for the report
+            std::ostringstream out;
+            out << std::hex << "opcode 0x" << std::setw(4) << std::setfill('0') << opcode << " at pc 0x" << reference.pc
+                << ", V" << ((opcode >> 8) & 0xF) << " = 0x" << static_cast<unsigned int>(reference.v[(opcode >> 8) & 0xF])
+                << ", V" << ((opcode >> 4) & 0xF) << " = 0x" << static_cast<unsigned int>(reference.v[(opcode >> 4) & 0xF])
+                << ", VF = 0x" << static_cast<unsigned int>(reference.v[0xF]) << ", I = 0x" << reference.i;
+            return out.str();
+        };
+};
@@ -0,0 +1,347 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <map>
+#include <iterator>
+#include <fstream>
+#include <iostream>
+#include <filesystem>
+#include <cstring>
+#include <cstdint>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define CHIP8_CORPUS_MMAP 1
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "chip8.h"
+#include "batch.h"
+#include "analyzer.h"
+#include "xxhash64.h"
+
+/*
+    A whole set of ROMs for a batch run, mapped into memory instead of being read one file at a time.
+
+    The quick way in is a pack file (--pack), every ROM in one file. Opening one is a single open and mmap however many
+    ROMs it has, and the pages of each ROM are only read off the disk when a machine copies it into its memory with
+    LoadProgram. A directory or manifest (like --batch takes) works too, with each ROM mapped on its own.
+
+    Every ROM is indexed by its xxHash64, and what --analyze knows about each one (profile, blocks, instructions per frame,
+    see RomMetadata) is cached against that hash in one file next to the corpus (CachePathFor). The first run over a corpus
+    analyses whatever isn't in the cache yet, or picks up the ROM's own .c8meta if it has one, and saves the lot. Every
+    run after that starts with one read of the cache and no per-ROM file I/O at all, and a ROM that's in the corpus twice
+    under different names only gets analysed once.
+
+    Pack files are little endian whatever machine wrote them:
+
+        "C8PACK\0\0"        8 byte magic
+        version             u32
+        count               u32
+        entries             count x 32 bytes: data offset u64, cycles u64 (0 for the run's --cycles), data size u32,
+                            name offset u32, name size u32, and 4 bytes of padding
+        names               the path each ROM was packed from, not null terminated
+        data                the ROMs, each starting on a 16 byte boundary
+
+    Offsets are from the start of the file.
+*/
+class RomCorpus
+{
+    public:
+
+        struct Rom {
+            std::string name; // the path it came from
+            const unsigned char* data = nullptr; // somewhere in a mapping, good for as long as the corpus is
+            size_t size = 0;
+            unsigned long long cycles = 0;
+            uint64_t hash = 0;
+            bool packed = false; // from a pack file, so there's no file of its own to look for a .c8meta next to
+        };
+
+        static constexpr uint32_t version = 1;
+
+        RomCorpus() = default;
+        RomCorpus(const RomCorpus&) = delete;
+        RomCorpus& operator=(const RomCorpus&) = delete;
+
+        ~RomCorpus() {
+#ifdef CHIP8_CORPUS_MMAP
+            for (const Mapping& mapping : mappings) {
+                munmap(mapping.address, mapping.length);
+            }
+#endif
+        };
+
+        bool Open(const std::string& source, unsigned long long defaultCycles) {
+            // a pack file, a directory or a manifest. false if it can't be read or there are no ROMs in it
+            openedWithCycles = defaultCycles;
+            std::error_code error;
+            if (std::filesystem::is_regular_file(source, error) && IsPack(source)) {
+                if (!OpenPack(source, defaultCycles)) {
+                    return false;
+                }
+            }
+            else {
+                for (const BatchRunner::Job& job : BatchRunner::LoadJobs(source, defaultCycles)) {
+                    Rom rom;
+                    rom.name = job.path;
+                    rom.cycles = job.cycles;
+                    // a ROM that won't open stays in the list with no data, and the batch reports it as load_failed
+                    Map(job.path, rom.data, rom.size);
+                    roms.push_back(rom);
+                }
+            }
+            for (size_t i = 0; i < roms.size(); i++) {
+                roms[i].hash = XxHash64::Hash(roms[i].data, roms[i].size);
+                index.emplace(roms[i].hash, i);
+            }
+            return !roms.empty();
+        };
+
+        const std::vector<Rom>& Roms() const {
+            return roms;
+        };
+
+        const Rom* Find(uint64_t hash) const {
+            auto found = index.find(hash);
+            return (found == index.end()) ? nullptr : &roms[found->second];
+        };
+
+        const RomMetadata* Metadata(uint64_t hash) const {
+            auto found = metadata.find(hash);
+            return (found == metadata.end()) ? nullptr : &found->second;
+        };
+
+        static std::string CachePathFor(const std::string& source) {
+            // inside a directory (.c8cache isn't a ROM extension, so the next --batch won't pick it up), next to anything else
+            std::error_code error;
+            if (std::filesystem::is_directory(source, error)) {
+                return (std::filesystem::path(source) / "corpus.c8cache").string();
+            }
+            return source + ".c8cache";
+        };
+
+        bool LoadCache(const std::string& path) {
+            // false if there isn't one (or it's from another version), which just means everything gets analysed again
+            std::ifstream input(path);
+            std::string line;
+            if (!std::getline(input, line) || line != "chip8-corpus-cache " + std::to_string(RomMetadata::version)) {
+                return false;
+            }
+            RomMetadata entry;
+            while (entry.ReadFrom(input)) {
+                metadata[entry.romHash] = entry;
+            }
+            return true;
+        };
+
+        bool SaveCache(const std::string& path) const {
+            // everything we know, including ROMs that aren't in this corpus any more. they cost a few lines and might be back
+            std::ofstream output(path);
+            output << "chip8-corpus-cache " << RomMetadata::version << "\n";
+            for (const auto& [hash, entry] : metadata) {
+                entry.WriteTo(output);
+                output << "end\n";
+            }
+            output.flush();
+            return static_cast<bool>(output);
+        };
+
+        unsigned int AnalyzeMissing() {
+            // fills in the metadata for every ROM the cache didn't have and returns how many that was. the profile is always
+            // the analyzer's own pick (from the instructions and the ROM's name), a batch with --quirks overrides it when it
+            // runs rather than having it stored
+            unsigned int added = 0;
+            for (const Rom& rom : roms) {
+                if (rom.data == nullptr || metadata.count(rom.hash) > 0) {
+                    continue;
+                }
+                RomMetadata found;
+                if (!rom.packed && found.LoadFor(rom.name)) {
+                    metadata[rom.hash] = found;
+                    added++;
+                    continue;
+                }
+                RomAnalyzer analyzer;
+                if (analyzer.Analyze(rom.data, rom.size, false, Chip8Profile::Vip, GuessChip8Profile(rom.name))) {
+                    metadata[rom.hash] = analyzer.metadata;
+                    added++;
+                }
+            }
+            return added;
+        };
+
+        std::vector<BatchRunner::Job> Jobs() const {
+            // one batch job per ROM, loading straight out of the mapping with whatever metadata we have for it
+            std::vector<BatchRunner::Job> jobs;
+            for (const Rom& rom : roms) {
+                BatchRunner::Job job{ rom.name, rom.cycles };
+                job.data = rom.data;
+                job.size = rom.size;
+                job.metadata = Metadata(rom.hash);
+                jobs.push_back(job);
+            }
+            return jobs;
+        };
+
+        bool SavePack(const std::string& path) const {
+            // every ROM that could be read, in the layout above. cycles are only kept when they aren't what Open was given
+            std::vector<const Rom*> packed;
+            for (const Rom& rom : roms) {
+                if (rom.data != nullptr) {
+                    packed.push_back(&rom);
+                }
+            }
+            uint64_t offset = headerSize + packed.size() * entrySize;
+            std::vector<uint32_t> nameOffsets;
+            for (const Rom* rom : packed) {
+                nameOffsets.push_back(static_cast<uint32_t>(offset));
+                offset += rom->name.size();
+            }
+            std::vector<uint64_t> dataOffsets;
+            for (const Rom* rom : packed) {
+                offset = (offset + 15) & ~static_cast<uint64_t>(15);
+                dataOffsets.push_back(offset);
+                offset += rom->size;
+            }
+
+            std::vector<unsigned char> out;
+            out.reserve(offset);
+            out.insert(out.end(), magic, magic + 8);
+            Put(out, version, 4);
+            Put(out, packed.size(), 4);
+            for (size_t i = 0; i < packed.size(); i++) {
+                Put(out, dataOffsets[i], 8);
+                Put(out, packed[i]->cycles == openedWithCycles ? 0 : packed[i]->cycles, 8);
+                Put(out, packed[i]->size, 4);
+                Put(out, nameOffsets[i], 4);
+                Put(out, packed[i]->name.size(), 4);
+                Put(out, 0, 4);
+            }
+            for (const Rom* rom : packed) {
+                out.insert(out.end(), rom->name.begin(), rom->name.end());
+            }
+            for (size_t i = 0; i < packed.size(); i++) {
+                out.resize(dataOffsets[i], 0);
+                out.insert(out.end(), packed[i]->data, packed[i]->data + packed[i]->size);
+            }
+
+            std::ofstream file(path, std::ios::binary);
+            file.write(reinterpret_cast<const char*>(out.data()), out.size());
+            return file.good();
+        };
+
+    private:
+
+        static constexpr unsigned char magic[8] = { 'C', '8', 'P', 'A', 'C', 'K', 0, 0 };
+        static constexpr size_t headerSize = 16;
+        static constexpr size_t entrySize = 32;
+
+        struct Mapping {
+            void* address;
+            size_t length;
+        };
+
+        std::vector<Rom> roms;
+        std::unordered_map<uint64_t, size_t> index; // hash to the first ROM with it
+        std::map<uint64_t, RomMetadata> metadata; // hash to what we know about it, from the cache or analysed now (sorted so the cache file is stable)
+        std::vector<Mapping> mappings;
+        std::vector<std::vector<unsigned char>> copies; // where there's no mmap the files are read in here instead
+        unsigned long long openedWithCycles = 0;
+
+        static bool IsPack(const std::string& path) {
+            std::ifstream file(path, std::ios::binary);
+            unsigned char start[8] = { 0 };
+            file.read(reinterpret_cast<char*>(start), sizeof(start));
+            return file.good() && std::memcmp(start, magic, sizeof(magic)) == 0;
+        };
+
+        bool Map(const std::string& path, const unsigned char*& data, size_t& size) {
+            // the whole file, read only. false (and no data) for a file that's missing or empty
+            data = nullptr;
+            size = 0;
+#ifdef CHIP8_CORPUS_MMAP
+            int file = open(path.c_str(), O_RDONLY);
+            if (file < 0) {
+                return false;
+            }
+            struct stat info;
+            if (fstat(file, &info) != 0 || info.st_size <= 0) {
+                close(file);
+                return false;
+            }
+            void* address = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+            // the mapping keeps the file open on its own
+            close(file);
+            if (address == MAP_FAILED) {
+                return false;
+            }
+            mappings.push_back({ address, static_cast<size_t>(info.st_size) });
+            data = static_cast<const unsigned char*>(address);
+            size = info.st_size;
+#else
+            std::ifstream file(path, std::ios::binary);
+            std::vector<unsigned char> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+            if (bytes.empty()) {
+                return false;
+            }
+            copies.push_back(std::move(bytes));
+            data = copies.back().data();
+            size = copies.back().size();
+#endif
+            return true;
+        };
+
+        bool OpenPack(const std::string& path, unsigned long long defaultCycles) {
+            const unsigned char* pack = nullptr;
+            size_t packSize = 0;
+            if (!Map(path, pack, packSize) || packSize < headerSize || Get(pack + 8, 4) != version) {
+                std::cerr << "not a pack file this build can read: " << path << std::endl;
+                return false;
+            }
+            uint64_t count = Get(pack + 12, 4);
+            if (headerSize + count * entrySize > packSize) {
+                std::cerr << "pack file is cut short: " << path << std::endl;
+                return false;
+            }
+            for (uint64_t i = 0; i < count; i++) {
+                const unsigned char* entry = pack + headerSize + i * entrySize;
+                uint64_t dataOffset = Get(entry, 8);
+                uint64_t cycles = Get(entry + 8, 8);
+                uint64_t dataSize = Get(entry + 16, 4);
+                uint64_t nameOffset = Get(entry + 20, 4);
+                uint64_t nameSize = Get(entry + 24, 4);
+                if (dataOffset > packSize || dataSize > packSize - dataOffset || nameOffset > packSize || nameSize > packSize - nameOffset) {
+                    std::cerr << "pack file entry " << i << " points outside the file: " << path << std::endl;
+                    roms.clear();
+                    return false;
+                }
+                Rom rom;
+                rom.name = std::string(reinterpret_cast<const char*>(pack + nameOffset), nameSize);
+                rom.data = pack + dataOffset;
+                rom.size = dataSize;
+                rom.cycles = (cycles == 0) ? defaultCycles : cycles;
+                rom.packed = true;
+                roms.push_back(rom);
+            }
+            return true;
+        };
+
+        static void Put(std::vector<unsigned char>& out, uint64_t value, int bytes) {
+            for (int i = 0; i < bytes; i++) {
+                out.push_back((value >> (8 * i)) & 0xFF);
+            }
+        };
+
+        static uint64_t Get(const unsigned char* in, int bytes) {
+            uint64_t value = 0;
+            for (int i = 0; i < bytes; i++) {
+                value |= static_cast<uint64_t>(in[i]) << (8 * i);
+            }
+            return value;
+        };
+};
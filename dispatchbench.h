@@ -0,0 +1,183 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <filesystem>
+#include <algorithm>
+#include <cctype>
+#include <memory>
+
+#include "chip8.h"
+#include "jit_x64.h"
+#include "batch.h"
+#include "perfcounters.h"
+
+/*
+    Runs the same ROMs through every way the core can get from one instruction to the next (see Chip8Dispatch) and the JIT,
+    and reports how long each one takes per chip8 instruction and how many branches the host CPU got wrong doing it.
+    Which one wins depends a lot on the host's branch predictor, so this is the thing to run on a new machine before
+    picking a --dispatch for it.
+
+    Idle loop skipping is turned off so every instruction really runs (otherwise a game waiting on its delay timer would look
+    impossibly fast), timers tick every `instructionsPerFrame` like the batch runner, and every run gets the same seed.
+    Each strategy runs `repeats` times and keeps its fastest, which keeps the odd slow run from a busy machine out of the numbers.
+    All of them have to finish in the same state (the jit only when it didn't run past the end of a block), and any that
+    don't get reported, so this doubles as a check that the strategies agree.
+*/
+class DispatchBenchmark
+{
+    public:
+
+        struct Result {
+            std::string path;
+            std::string profile;
+            std::string strategy;
+            bool loaded = false;
+            unsigned long long instructions = 0;
+            double nsPerInstruction = 0;
+            bool haveCounters = false;
+            uint64_t branches = 0;
+            uint64_t branchMisses = 0;
+            uint64_t stateHash = 0;
+        };
+
+        unsigned int instructionsPerFrame = 11;
+        unsigned int repeats = 3;
+        uint64_t seed = 0;
+        bool forceProfile = false;
+        Chip8Profile profile = Chip8Profile::Vip;
+
+        static std::vector<BatchRunner::Job> LoadJobs(const std::string& source, unsigned long long defaultCycles) {
+            // a single ROM, or a directory or manifest the same as --batch takes
+            std::error_code error;
+            if (std::filesystem::is_regular_file(source, error) && IsChip8RomPath(source)) {
+                return { { source, defaultCycles } };
+            }
+            return BatchRunner::LoadJobs(source, defaultCycles);
+        };
+
+        std::vector<Result> Run(const std::vector<BatchRunner::Job>& jobs) {
+            // one ROM at a time on this thread, so nothing else is fighting over the caches or the counters
+            std::vector<Result> results;
+            for (const BatchRunner::Job& job : jobs) {
+                AnyChip8 chip8 = CreateChip8(forceProfile ? profile : ProfileForRom(job.path));
+                std::visit([&](auto& core) { RunAllStrategies(*core, job, results); }, chip8);
+            }
+            return results;
+        };
+
+        static bool PrintResults(const std::vector<Result>& results) {
+            // comma separated like --batch. returns false if any ROM finished in different states depending on the strategy
+            std::cout << "rom,profile,dispatch,status,instructions,ns_per_instruction,branches,branch_misses,misses_per_1k_instructions,state_hash" << std::endl;
+            for (const Result& result : results) {
+                std::cout << result.path << "," << result.profile << "," << result.strategy << ","
+                          << (result.loaded ? "ok" : "load_failed") << ","
+                          << result.instructions << ","
+                          << std::fixed << std::setprecision(3) << result.nsPerInstruction << ",";
+                if (result.haveCounters) {
+                    double perThousand = result.instructions ? 1000.0 * result.branchMisses / result.instructions : 0;
+                    std::cout << result.branches << "," << result.branchMisses << "," << perThousand << ",";
+                }
+                else {
+                    std::cout << "n/a,n/a,n/a,";
+                }
+                std::cout << std::hex << std::setw(16) << std::setfill('0') << result.stateHash
+                          << std::dec << std::setfill(' ') << std::endl;
+            }
+
+            bool agreed = true;
+            for (size_t first = 0; first < results.size();) {
+                // results for one ROM are all next to each other. find the fastest and check they all match
+                size_t last = first;
+                const Result* fastest = &results[first];
+                while (last < results.size() && results[last].path == results[first].path) {
+                    // the jit always finishes the block it's in so it can run a few more, and then it can't be compared
+                    if (results[last].instructions == results[first].instructions && results[last].stateHash != results[first].stateHash) {
+                        std::cerr << results[first].path << ": " << results[last].strategy << " finished in a different state to "
+                                  << results[first].strategy << std::endl;
+                        agreed = false;
+                    }
+                    if (results[last].nsPerInstruction < fastest->nsPerInstruction) {
+                        fastest = &results[last];
+                    }
+                    last++;
+                }
+                if (fastest->loaded) {
+                    std::cerr << results[first].path << ": fastest is " << fastest->strategy << std::endl;
+                }
+                first = last;
+            }
+            return agreed;
+        };
+
+    private:
+
+        template <typename Core>
+        void RunAllStrategies(const Core&, const BatchRunner::Job& job, std::vector<Result>& results) const {
+            // the chip8 handed in is only there to say which profile to run, every run gets a fresh one
+            const Chip8Dispatch strategies[] = { Chip8Dispatch::Switch, Chip8Dispatch::DecodeCache, Chip8Dispatch::Table, Chip8Dispatch::Threaded };
+            for (Chip8Dispatch strategy : strategies) {
+                results.push_back(RunStrategy<Core>(job, Chip8DispatchName(strategy), strategy, nullptr));
+            }
+            Chip8Jit jit;
+            if (jit.Available()) {
+                // the jit's translation time counts against it, it's a real cost every time a ROM starts
+                results.push_back(RunStrategy<Core>(job, "jit", Chip8Dispatch::DecodeCache, &jit));
+            }
+        };
+
+        template <typename Core>
+        Result RunStrategy(const BatchRunner::Job& job, const char* name, Chip8Dispatch strategy, Chip8Jit* jit) const {
+            Result best;
+            best.path = job.path;
+            best.profile = Core::Quirks::name;
+            best.strategy = name;
+            PerfCounters counters;
+            for (unsigned int repeat = 0; repeat < std::max(1u, repeats); repeat++) {
+                // start from scratch every time so each repeat runs exactly the same instructions
+                // (on the heap, an XO-CHIP core is over a megabyte)
+                std::unique_ptr<Core> fresh = std::make_unique<Core>();
+                Core& chip8 = *fresh;
+                chip8.Initialize();
+                chip8.Seed(seed);
+                if (!chip8.LoadProgram(job.path)) {
+                    return best;
+                }
+                chip8.SetDispatch(strategy);
+                chip8.SetIdleSkipEnabled(false);
+                if (jit != nullptr) {
+                    jit->Flush();
+                }
+
+                unsigned long long instructions = 0;
+                unsigned long long nextTimerTick = instructionsPerFrame;
+                counters.Start();
+                auto start = std::chrono::steady_clock::now();
+                while (instructions < job.cycles) {
+                    unsigned long long chunk = std::min(nextTimerTick, job.cycles) - instructions;
+                    instructions += (jit != nullptr) ? jit->RunFor(chip8, chunk) : chip8.RunFor(chunk);
+                    while (instructions >= nextTimerTick) {
+                        chip8.TickTimers();
+                        nextTimerTick += instructionsPerFrame;
+                    }
+                }
+                auto end = std::chrono::steady_clock::now();
+                counters.Stop();
+
+                double ns = std::chrono::duration<double, std::nano>(end - start).count() / std::max(1ull, instructions);
+                if (!best.loaded || ns < best.nsPerInstruction) {
+                    best.loaded = true;
+                    best.instructions = instructions;
+                    best.nsPerInstruction = ns;
+                    best.haveCounters = counters.Available();
+                    best.branches = counters.Branches();
+                    best.branchMisses = counters.BranchMisses();
+                    best.stateHash = chip8.StateHash();
+                }
+            }
+            return best;
+        };
+};
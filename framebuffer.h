@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+    Helpers for turning the packed chip8 display (one uint64_t per row, leftmost pixel in the top bit) back into
+    ordinary pixels for whoever needs to show or save them. `on` and `off` are the colours to write, in whatever
+    32 bit pixel format the caller is using.
+*/
+
+// off, plane 0, plane 1, both planes as 0xAARRGGBB. plain chip8 and SUPER-CHIP only have the one plane so they're just black and white
+inline constexpr uint32_t displayPalette[4] = { 0xFF000000, 0xFFFFFFFF, 0xFF808080, 0xFFC0C0C0 };
+
+inline void UnpackRow(uint64_t row, uint32_t* out, uint32_t on, uint32_t off) {
+#if defined(__SSE2__)
+    // 4 pixels at a time: copy the nibble for those pixels into every lane, test a different bit in each lane
+    // and use the result as a mask to pick between the on and off colours
+    const __m128i bits = _mm_set_epi32(1, 2, 4, 8); // lane 0 is the leftmost pixel which is the top bit of the nibble
+    const __m128i onColour = _mm_set1_epi32(static_cast<int>(on));
+    const __m128i offColour = _mm_set1_epi32(static_cast<int>(off));
+    for (int i = 0; i < 64; i += 4) {
+        __m128i nibble = _mm_set1_epi32(static_cast<int>((row >> (60 - i)) & 0xF));
+        __m128i mask = _mm_cmpeq_epi32(_mm_and_si128(nibble, bits), bits);
+        __m128i pixels = _mm_or_si128(_mm_and_si128(mask, onColour), _mm_andnot_si128(mask, offColour));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), pixels);
+    }
+#else
+    for (int i = 0; i < 64; i++) {
+        out[i] = ((row >> (63 - i)) & 0x1) ? on : off;
+    }
+#endif
+}
+
+inline void UnpackDisplay(const uint64_t* rows, unsigned int rowCount, uint32_t* out, uint32_t on, uint32_t off) {
+    // rowCount rows of 64 pixels each, written out one after the other
+    for (unsigned int y = 0; y < rowCount; y++) {
+        UnpackRow(rows[y], out + y * 64, on, off);
+    }
+}
+
+inline void UnpackPlaneRow(uint64_t plane0, uint64_t plane1, uint32_t* out, const uint32_t* palette) {
+    // 64 pixels from two XO-CHIP bitplanes. plane 0 gives bit 0 of the colour number and plane 1 gives bit 1
+    for (int i = 0; i < 64; i++) {
+        unsigned int colour = ((plane0 >> (63 - i)) & 0x1) | (((plane1 >> (63 - i)) & 0x1) << 1);
+        out[i] = palette[colour];
+    }
+}
+
+inline void UnpackFrame(const uint64_t* words, unsigned int width, unsigned int height, unsigned int planes,
+                        uint32_t* out, unsigned int outStride, const uint32_t* palette) {
+    // any of the chip8 displays (see Chip8Core::GetDisplay), `outStride` pixels from the start of one output row to the next.
+    // the palette has 4 colours: off, plane 0 only, plane 1 only and both. with only one plane just the first two get used
+    const unsigned int wordsPerRow = width / 64;
+    const uint64_t* secondPlane = words + height * wordsPerRow;
+    for (unsigned int y = 0; y < height; y++) {
+        for (unsigned int word = 0; word < wordsPerRow; word++) {
+            unsigned int index = y * wordsPerRow + word;
+            uint32_t* pixels = out + y * outStride + word * 64;
+            if (planes > 1) {
+                UnpackPlaneRow(words[index], secondPlane[index], pixels, palette);
+            }
+            else {
+                UnpackRow(words[index], pixels, palette[1], palette[0]);
+            }
+        }
+    }
+}
+
+/*
+    Hands finished frames from one thread (the one running the chip8) to another (the one putting them on screen) without
+    either of them ever waiting for the other.
+
+    There are three copies of the frame. The writer always has one to itself to fill in and the reader always has one to
+    itself to draw from. The third sits in the middle: when the writer finishes a frame it swaps its copy with the middle one,
+    and when the reader wants something new it swaps its copy with the middle one. The swaps are a single atomic exchange on
+    one byte holding which copy is in the middle plus a bit saying whether it's newer than what the reader has.
+    If the writer gets ahead it just replaces the middle frame, so the reader always gets the newest one and old ones are dropped.
+*/
+template <typename T>
+class TripleBuffer
+{
+    T buffers[3] = {};
+    std::atomic<uint8_t> middle{ 1 }; // index of the middle copy, with freshBit set if the writer put it there since the reader last looked
+    uint8_t writing = 0; // only touched by the writer
+    uint8_t reading = 2; // only touched by the reader
+
+    static const uint8_t freshBit = 0x4;
+
+    public:
+
+        T& WriteBuffer() {
+            // the writer's own copy. fill it in then call Publish
+            return buffers[writing];
+        };
+
+        void Publish() {
+            writing = middle.exchange(writing | freshBit, std::memory_order_acq_rel) & ~freshBit;
+        };
+
+        bool Consume() {
+            // swap in the newest published frame if there is one. returns false (and leaves ReadBuffer alone) if nothing new
+            // has been published since last time
+            if ((middle.load(std::memory_order_relaxed) & freshBit) == 0) {
+                return false;
+            }
+            reading = middle.exchange(reading, std::memory_order_acq_rel) & ~freshBit;
+            return true;
+        };
+
+        const T& ReadBuffer() const {
+            // the reader's own copy, holding the newest frame as of the last Consume
+            return buffers[reading];
+        };
+};
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iterator>
+
+#include "chip8.h"
+
+/*
+    A recording of everything the player did, so a run can be played back exactly. Together with the random seed and the
+    number of instructions per frame that's all a chip8 needs to do the same thing again, because the only other thing that
+    changes what a game does is the keyboard.
+
+    The quirk profile has to match as well, so that's written down with them.
+
+    Keys are only written down when they change, along with the 60 Hz frame they changed on:
+
+        "C8IN"              4 byte magic
+        version             u16
+        seed                u64
+        instructionsPerFrame u32
+        profile             u8, the Chip8Profile it was played with (version 2 onwards, version 1 is always vip)
+        then events, each one:
+            frame delta     varint, frames since the previous event
+            type            u8, 0 = keys changed, 1 = end of the recording
+            keys            u16, bit n set if key n is held (type 0 only)
+
+    Everything is little endian like the savestates. A whole game is usually a few hundred bytes.
+*/
+class InputLog
+{
+    public:
+
+        static const uint16_t version = 2;
+
+        struct Event {
+            uint64_t frame = 0; // the keys are set to this before the frame's instructions run
+            uint16_t keys = 0;
+        };
+
+        uint64_t seed = 0;
+        uint32_t instructionsPerFrame = 11;
+        uint8_t profile = 0;
+        std::vector<Event> events;
+        uint64_t endFrame = 0; // how many frames the recording ran for
+
+        void Record(uint64_t frame, uint16_t keys) {
+            // called every frame with whatever is held. only changes get kept
+            uint16_t previous = events.empty() ? 0 : events.back().keys;
+            if (keys != previous) {
+                events.push_back({ frame, keys });
+            }
+            endFrame = frame + 1;
+        };
+
+        void RewindTo(uint64_t frame) {
+            // the player went back in time, so whatever they did from `frame` onwards never happened
+            while (!events.empty() && events.back().frame >= frame) {
+                events.pop_back();
+            }
+            endFrame = frame;
+        };
+
+        uint16_t KeysAt(uint64_t frame) const {
+            // the keys held during a frame. replays go front to back with a cursor instead, this is for poking around
+            uint16_t keys = 0;
+            for (const Event& event : events) {
+                if (event.frame > frame) {
+                    break;
+                }
+                keys = event.keys;
+            }
+            return keys;
+        };
+
+        bool SaveToFile(const std::string& path) const {
+            std::vector<unsigned char> out;
+            out.insert(out.end(), { 'C', '8', 'I', 'N' });
+            PutLittleEndian(out, version, 2);
+            PutLittleEndian(out, seed, 8);
+            PutLittleEndian(out, instructionsPerFrame, 4);
+            out.push_back(profile);
+            uint64_t lastFrame = 0;
+            for (const Event& event : events) {
+                PutVarint(out, event.frame - lastFrame);
+                out.push_back(0);
+                PutLittleEndian(out, event.keys, 2);
+                lastFrame = event.frame;
+            }
+            PutVarint(out, endFrame - lastFrame);
+            out.push_back(1);
+
+            std::ofstream file(path, std::ios::binary);
+            file.write(reinterpret_cast<const char*>(out.data()), out.size());
+            return file.good();
+        };
+
+        bool LoadFromFile(const std::string& path) {
+            // returns false (and leaves the log alone) if the file is missing, cut short, not an input log or for a profile
+            // this build doesn't have
+            std::ifstream file(path, std::ios::binary);
+            std::vector<unsigned char> in((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+            size_t position = 4 + 2 + 8 + 4;
+            if (in.size() < position || std::memcmp(in.data(), "C8IN", 4) != 0) {
+                return false;
+            }
+            uint64_t logVersion = GetLittleEndian(in, 4, 2);
+            if (logVersion == 0 || logVersion > version || (logVersion >= 2 && in.size() < position + 1)) {
+                return false;
+            }
+
+            InputLog log;
+            log.seed = GetLittleEndian(in, 6, 8);
+            log.instructionsPerFrame = static_cast<uint32_t>(GetLittleEndian(in, 14, 4));
+            if (logVersion >= 2) {
+                log.profile = in[position++];
+                if (log.profile > static_cast<uint8_t>(Chip8Profile::XoChip)) {
+                    // corrupt, or from a newer build with more machines. replaying it as anything else would be a different game
+                    return false;
+                }
+            }
+            uint64_t frame = 0;
+            while (true) {
+                uint64_t delta = 0;
+                if (!GetVarint(in, position, delta) || position >= in.size()) {
+                    return false;
+                }
+                frame += delta;
+                unsigned char type = in[position++];
+                if (type == 1) {
+                    log.endFrame = frame;
+                    break;
+                }
+                if (type != 0 || position + 2 > in.size()) {
+                    return false;
+                }
+                log.events.push_back({ frame, static_cast<uint16_t>(GetLittleEndian(in, position, 2)) });
+                position += 2;
+            }
+            *this = std::move(log);
+            return true;
+        };
+
+    private:
+
+        static void PutLittleEndian(std::vector<unsigned char>& out, uint64_t value, int bytes) {
+            for (int i = 0; i < bytes; i++) {
+                out.push_back((value >> (8 * i)) & 0xFF);
+            }
+        };
+
+        static uint64_t GetLittleEndian(const std::vector<unsigned char>& in, size_t position, int bytes) {
+            uint64_t value = 0;
+            for (int i = 0; i < bytes; i++) {
+                value |= static_cast<uint64_t>(in[position + i]) << (8 * i);
+            }
+            return value;
+        };
+
+        static void PutVarint(std::vector<unsigned char>& out, uint64_t value) {
+            while (value >= 0x80) {
+                out.push_back((value & 0x7F) | 0x80);
+                value >>= 7;
+            }
+            out.push_back(value);
+        };
+
+        static bool GetVarint(const std::vector<unsigned char>& in, size_t& position, uint64_t& value) {
+            value = 0;
+            for (int shift = 0; shift < 64; shift += 7) {
+                if (position >= in.size()) {
+                    return false;
+                }
+                unsigned char byte = in[position++];
+                value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+                if ((byte & 0x80) == 0) {
+                    return true;
+                }
+            }
+            return false;
+        };
+};
@@ -0,0 +1,430 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <ostream>
+#include <iomanip>
+#include <algorithm>
+
+/*
+    Instrumentation for the interpreter. Only built when CHIP8_INSTRUMENT is defined (-DCHIP8_INSTRUMENT), otherwise none of
+    this exists and Step is exactly what it was, so a normal build pays nothing for it.
+
+    When it is turned on every instruction the interpreter runs (Step, so RunFor and the windowed frontend too, but not the
+    jit or the lockstep engine which don't go through Step) gets:
+
+    - counted by what kind of instruction it is (all the 8xyN maths separately, all the Fx.. ones separately and so on)
+    - counted by address, so we know which bits of the program are hot (every address the machine has, so XO-CHIP's 64 KB too)
+    - written into a ring of the last few thousand instructions: where it was, what it was and which registers it changed
+
+    It also keeps a shadow call stack from the 2nnn and 00EE instructions so the address counts can be written out grouped by
+    subroutine, either as a callgrind file (open it in kcachegrind) or as collapsed stacks (feed it to flamegraph.pl).
+*/
+class Instrumentation
+{
+    public:
+
+        // what a step looked like before it ran, for working out what it changed afterwards
+        struct Before {
+            uint16_t programCounter = 0;
+            uint16_t indexRegister = 0;
+            uint8_t vRegister[16] = { 0 };
+        };
+
+        struct TraceRecord {
+            uint16_t programCounter = 0;
+            uint16_t opcode = 0;
+            uint16_t changedRegisters = 0; // bit n set if Vn changed
+            uint16_t indexRegister = 0; // I after the instruction
+            uint16_t values[4] = { 0 }; // new values of the first four changed registers, lowest numbered first
+        };
+
+        static const size_t traceCapacity = 4096; // must be a power of two
+        static const unsigned int classCount = 52;
+
+        explicit Instrumentation(unsigned int addressCount)
+            : addressMask(addressCount - 1), addressDigits(addressCount > 0x1000 ? 4 : 3), pcHits(addressCount, 0),
+              routineOf(addressCount, 0x200), callTargets(addressCount, 0), callCounts(addressCount, 0), callInclusive(addressCount, 0) {
+            // addressCount is the size of the chip8's memory (a power of two), so every address it can run from gets its own count
+            stackNodes.push_back({ 0x200, 0, 0, {} }); // the program itself is the root "subroutine"
+        };
+
+        static Before Capture(uint16_t programCounter, uint16_t indexRegister, const unsigned char* vRegister) {
+            Before before;
+            before.programCounter = programCounter;
+            before.indexRegister = indexRegister;
+            for (int i = 0; i < 16; i++) {
+                before.vRegister[i] = vRegister[i];
+            }
+            return before;
+        };
+
+        void Record(const Before& before, uint16_t opcode, uint16_t indexRegister, const unsigned char* vRegister) {
+            // called once the instruction has run. everything here is plain counting apart from the trace ring
+            uint16_t pc = before.programCounter & addressMask;
+            steps++;
+            classCounts[ClassOf(opcode)]++;
+            pcHits[pc]++;
+            routineOf[pc] = stackNodes[currentNode].routine;
+            stackNodes[currentNode].hits++;
+
+            TraceRecord record;
+            record.programCounter = before.programCounter;
+            record.opcode = opcode;
+            record.indexRegister = indexRegister;
+            int changed = 0;
+            for (int i = 0; i < 16; i++) {
+                if (vRegister[i] != before.vRegister[i]) {
+                    record.changedRegisters |= 1 << i;
+                    if (changed < 4) {
+                        record.values[changed++] = vRegister[i];
+                    }
+                }
+            }
+            PushTrace(record);
+
+            if ((opcode & 0xF000) == 0x2000) {
+                EnterSubroutine(pc, opcode & 0x0FFF);
+            }
+            else if (opcode == 0x00EE) {
+                LeaveSubroutine();
+            }
+        };
+
+        uint64_t Steps() const {
+            return steps;
+        };
+
+        uint64_t ClassCount(unsigned int index) const {
+            // how many of one kind of instruction ran, indexed by ClassOf
+            return classCounts[index];
+        };
+
+        uint64_t PcHits(uint16_t address) const {
+            // how many times the instruction at an address ran
+            return pcHits[address & addressMask];
+        };
+
+        std::vector<TraceRecord> RecentTrace(size_t count) const {
+            // the newest `count` records, oldest first. safe to call from another thread while the chip8 is running:
+            // the ring never locks, a record that gets overwritten while we're copying it is just left out
+            std::vector<TraceRecord> records;
+            uint64_t head = traceHead.load(std::memory_order_acquire);
+            count = std::min<uint64_t>({ count, head, traceCapacity });
+            for (uint64_t index = head - count; index < head; index++) {
+                const TraceSlot& slot = trace[index & (traceCapacity - 1)];
+                uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+                uint64_t first = slot.words[0].load(std::memory_order_relaxed);
+                uint64_t second = slot.words[1].load(std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (sequence != 2 * index + 2 || slot.sequence.load(std::memory_order_relaxed) != sequence) {
+                    continue;
+                }
+                TraceRecord record;
+                record.programCounter = first & 0xFFFF;
+                record.opcode = (first >> 16) & 0xFFFF;
+                record.changedRegisters = (first >> 32) & 0xFFFF;
+                record.indexRegister = (first >> 48) & 0xFFFF;
+                for (int i = 0; i < 4; i++) {
+                    record.values[i] = (second >> (16 * i)) & 0xFFFF;
+                }
+                records.push_back(record);
+            }
+            return records;
+        };
+
+        static unsigned int ClassOf(uint16_t opcode) {
+            // which row of ClassName an opcode counts towards
+            unsigned int x = opcode >> 12;
+            switch (x) {
+                case 0x0: {
+                    // the SUPER-CHIP and XO-CHIP screen instructions all live in 00xx too
+                    switch (opcode & 0xFFF0) {
+                        case 0x00C0: return 35;
+                        case 0x00D0: return 36;
+                    }
+                    switch (opcode) {
+                        case 0x00E0: return 0;
+                        case 0x00EE: return 1;
+                        case 0x00FB: return 37;
+                        case 0x00FC: return 38;
+                        case 0x00FD: return 39;
+                        case 0x00FE: return 40;
+                        case 0x00FF: return 41;
+                        default: return 2;
+                    }
+                }
+                case 0x5: return ((opcode & 0xF) == 0x2) ? 42 : ((opcode & 0xF) == 0x3) ? 43 : 7;
+                case 0x8: {
+                    static const unsigned char maths[16] = { 10, 11, 12, 13, 14, 15, 16, 17, 51, 51, 51, 51, 51, 51, 18, 51 };
+                    return maths[opcode & 0xF];
+                }
+                case 0xE: return ((opcode & 0xFF) == 0x9E) ? 24 : ((opcode & 0xFF) == 0xA1) ? 25 : 51;
+                case 0xF: {
+                    switch (opcode & 0xFF) {
+                        case 0x00: return 44;
+                        case 0x01: return 45;
+                        case 0x02: return 46;
+                        case 0x30: return 47;
+                        case 0x3A: return 48;
+                        case 0x75: return 49;
+                        case 0x85: return 50;
+                        case 0x07: return 26;
+                        case 0x0A: return 27;
+                        case 0x15: return 28;
+                        case 0x18: return 29;
+                        case 0x1E: return 30;
+                        case 0x29: return 31;
+                        case 0x33: return 32;
+                        case 0x55: return 33;
+                        case 0x65: return 34;
+                        default: return 51;
+                    }
+                }
+                case 0x9: return 19;
+                case 0xA: return 20;
+                case 0xB: return 21;
+                case 0xC: return 22;
+                case 0xD: return 23;
+                default: return x + 2; // 1nnn to 7xkk are 3 to 9
+            }
+        };
+
+        static const char* ClassName(unsigned int index) {
+            static const char* names[classCount] = {
+                "00E0 CLS", "00EE RET", "0nnn SYS", "1nnn JP", "2nnn CALL", "3xkk SE", "4xkk SNE", "5xy0 SE", "6xkk LD", "7xkk ADD",
+                "8xy0 LD", "8xy1 OR", "8xy2 AND", "8xy3 XOR", "8xy4 ADD", "8xy5 SUB", "8xy6 SHR", "8xy7 SUBN", "8xyE SHL",
+                "9xy0 SNE", "Annn LD I", "Bnnn JP V0", "Cxkk RND", "Dxyn DRW", "Ex9E SKP", "ExA1 SKNP",
+                "Fx07 LD DT", "Fx0A LD K", "Fx15 LD DT", "Fx18 LD ST", "Fx1E ADD I", "Fx29 LD F", "Fx33 BCD", "Fx55 LD [I]", "Fx65 LD [I]",
+                "00Cn SCD", "00Dn SCU", "00FB SCR", "00FC SCL", "00FD EXIT", "00FE LOW", "00FF HIGH", "5xy2 SAVE", "5xy3 LOAD",
+                "F000 LD I", "Fn01 PLANE", "F002 AUDIO", "Fx30 LD HF", "Fx3A PITCH", "Fx75 LD R", "Fx85 LD R",
+                "unknown"
+            };
+            return names[index];
+        };
+
+        void WriteCounters(std::ostream& out) const {
+            // one line per kind of instruction that ran at least once, busiest first
+            std::vector<unsigned int> order;
+            for (unsigned int i = 0; i < classCount; i++) {
+                if (classCounts[i] > 0) {
+                    order.push_back(i);
+                }
+            }
+            std::sort(order.begin(), order.end(), [this](unsigned int a, unsigned int b) { return classCounts[a] > classCounts[b]; });
+            for (unsigned int i : order) {
+                out << std::left << std::setw(14) << ClassName(i) << std::right << std::setw(14) << classCounts[i]
+                    << std::fixed << std::setprecision(2) << std::setw(8) << (100.0 * classCounts[i] / std::max<uint64_t>(steps, 1)) << "%" << std::endl;
+            }
+            out.unsetf(std::ios::fixed);
+        };
+
+        void WriteTrace(std::ostream& out, size_t count) const {
+            for (const TraceRecord& record : RecentTrace(count)) {
+                out << std::hex << std::setfill('0') << std::setw(addressDigits) << record.programCounter << "  " << std::setw(4) << record.opcode
+                    << "  I=" << std::setw(addressDigits) << record.indexRegister;
+                int written = 0;
+                for (int i = 0; i < 16; i++) {
+                    if (record.changedRegisters & (1 << i)) {
+                        out << "  V" << std::uppercase << i << std::nouppercase << "=";
+                        if (written < 4) {
+                            out << std::setw(2) << record.values[written];
+                        }
+                        else {
+                            out << "?"; // only the first four changes fit in a record
+                        }
+                        written++;
+                    }
+                }
+                out << std::dec << std::setfill(' ') << std::endl;
+            }
+        };
+
+        void WriteCallgrind(std::ostream& out, const std::string& programName) const {
+            /*
+                Callgrind's text format. Every subroutine is a function (named by its address), every address is a "line" with
+                the number of times it ran as its cost, and every 2nnn that ran is a call carrying the total number of
+                instructions spent inside the subroutine (and whatever it called) as its inclusive cost.
+            */
+            out << "# callgrind format" << std::endl;
+            out << "version: 1" << std::endl;
+            out << "creator: chip8" << std::endl;
+            out << "positions: instr" << std::endl;
+            out << "events: Instructions" << std::endl;
+            out << "summary: " << steps << std::endl << std::endl;
+            out << "fl=" << programName << std::endl;
+
+            std::vector<uint16_t> routines;
+            for (size_t pc = 0; pc < pcHits.size(); pc++) {
+                if (pcHits[pc] > 0 || callCounts[pc] > 0) {
+                    routines.push_back(routineOf[pc]);
+                }
+            }
+            std::sort(routines.begin(), routines.end());
+            routines.erase(std::unique(routines.begin(), routines.end()), routines.end());
+
+            out << std::hex;
+            for (uint16_t routine : routines) {
+                out << "fn=" << RoutineName(routine) << std::endl;
+                for (size_t pc = 0; pc < pcHits.size(); pc++) {
+                    if (routineOf[pc] != routine) {
+                        continue;
+                    }
+                    if (pcHits[pc] > 0) {
+                        out << "0x" << pc << " " << std::dec << pcHits[pc] << std::hex << std::endl;
+                    }
+                    if (callCounts[pc] > 0) {
+                        out << "cfn=" << RoutineName(callTargets[pc]) << std::endl;
+                        out << "calls=" << std::dec << callCounts[pc] << std::hex << " 0x" << callTargets[pc] << std::endl;
+                        out << "0x" << pc << " " << std::dec << callInclusive[pc] << std::hex << std::endl;
+                    }
+                }
+                out << std::endl;
+            }
+            out << std::dec;
+        };
+
+        void WriteCollapsed(std::ostream& out) const {
+            // one line per call stack that ever ran an instruction: the subroutines from the outside in, separated by ;
+            // and then how many instructions ran with exactly that stack. flamegraph.pl reads this directly
+            for (size_t node = 0; node < stackNodes.size(); node++) {
+                if (stackNodes[node].hits == 0) {
+                    continue;
+                }
+                std::vector<uint16_t> frames;
+                for (uint32_t at = static_cast<uint32_t>(node); ; at = stackNodes[at].parent) {
+                    frames.push_back(stackNodes[at].routine);
+                    if (at == 0) {
+                        break;
+                    }
+                }
+                for (size_t i = frames.size(); i-- > 0; ) {
+                    out << RoutineName(frames[i]) << (i > 0 ? ";" : " ");
+                }
+                out << stackNodes[node].hits << std::endl;
+            }
+        };
+
+    private:
+
+        uint16_t addressMask;
+        int addressDigits; // hex digits it takes to write an address: 3 for 4 KB, 4 for XO-CHIP's 64 KB
+        uint64_t classCounts[classCount] = { 0 };
+        std::vector<uint64_t> pcHits;
+        uint64_t steps = 0;
+
+        // a std::atomic that can still be copied (so a Chip8 with instrumentation in it can be), as long as nobody is
+        // writing to the one being copied at the time
+        struct AtomicWord : std::atomic<uint64_t> {
+            AtomicWord() : std::atomic<uint64_t>(0) {}
+            AtomicWord(const AtomicWord& other) : std::atomic<uint64_t>(other.load(std::memory_order_relaxed)) {}
+            AtomicWord& operator=(const AtomicWord& other) {
+                store(other.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                return *this;
+            }
+        };
+
+        /*
+            The trace ring. One thread (whichever one is running the chip8) writes, any number of threads can read. Each slot
+            has a sequence number that is odd while it's being written and 2 * (record number + 1) once it's done, so a reader
+            can tell whether the record it copied is the one it wanted and wasn't half overwritten (a seqlock).
+            The record itself is packed into two words so every access is a plain atomic load or store.
+        */
+        struct TraceSlot {
+            AtomicWord sequence;
+            AtomicWord words[2];
+        };
+
+        TraceSlot trace[traceCapacity];
+        AtomicWord traceHead; // how many records have ever been written
+
+        /*
+            Shadow call stack. Every distinct stack we've seen is a node in a tree (a node's parent is the stack it was called
+            from) so each step only has to bump the count on the current node. `frames` remembers how to get back out.
+        */
+        struct StackNode {
+            uint16_t routine = 0; // address of the subroutine
+            uint32_t parent = 0;
+            uint64_t hits = 0; // instructions run with exactly this stack
+            std::vector<uint32_t> children;
+        };
+
+        struct Frame {
+            uint32_t node = 0; // the node to go back to on return
+            uint16_t callSite = 0;
+            uint64_t enteredAt = 0; // `steps` when the call happened
+        };
+
+        static const unsigned int maxFrames = 64;
+
+        std::vector<StackNode> stackNodes;
+        uint32_t currentNode = 0;
+        Frame frames[maxFrames];
+        unsigned int frameCount = 0;
+
+        // all indexed by address, one entry for every byte of the chip8's memory
+        std::vector<uint16_t> routineOf; // the subroutine each address was last run as part of
+        std::vector<uint16_t> callTargets; // indexed by the address of the 2nnn
+        std::vector<uint64_t> callCounts;
+        std::vector<uint64_t> callInclusive;
+
+        void PushTrace(const TraceRecord& record) {
+            uint64_t index = traceHead.load(std::memory_order_relaxed);
+            TraceSlot& slot = trace[index & (traceCapacity - 1)];
+            uint64_t first = record.programCounter | (static_cast<uint64_t>(record.opcode) << 16)
+                | (static_cast<uint64_t>(record.changedRegisters) << 32) | (static_cast<uint64_t>(record.indexRegister) << 48);
+            uint64_t second = 0;
+            for (int i = 0; i < 4; i++) {
+                second |= static_cast<uint64_t>(record.values[i]) << (16 * i);
+            }
+            slot.sequence.store(2 * index + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            slot.words[0].store(first, std::memory_order_relaxed);
+            slot.words[1].store(second, std::memory_order_relaxed);
+            slot.sequence.store(2 * index + 2, std::memory_order_release);
+            traceHead.store(index + 1, std::memory_order_release);
+        };
+
+        void EnterSubroutine(uint16_t callSite, uint16_t target) {
+            callTargets[callSite] = target;
+            callCounts[callSite]++;
+            if (frameCount == maxFrames) {
+                // something is calling without ever returning. stop following it rather than growing forever
+                return;
+            }
+            frames[frameCount++] = { currentNode, callSite, steps };
+
+            StackNode& parent = stackNodes[currentNode];
+            for (uint32_t child : parent.children) {
+                if (stackNodes[child].routine == target) {
+                    currentNode = child;
+                    return;
+                }
+            }
+            uint32_t child = static_cast<uint32_t>(stackNodes.size());
+            stackNodes[currentNode].children.push_back(child);
+            stackNodes.push_back({ target, currentNode, 0, {} });
+            currentNode = child;
+        };
+
+        void LeaveSubroutine() {
+            if (frameCount == 0) {
+                return; // a return with no call we saw (the program was started from a savestate for example)
+            }
+            const Frame& frame = frames[--frameCount];
+            callInclusive[frame.callSite] += steps - frame.enteredAt;
+            currentNode = frame.node;
+        };
+
+        std::string RoutineName(uint16_t routine) const {
+            static const char digits[] = "0123456789abcdef";
+            std::string name = "0x";
+            for (int shift = 4 * (addressDigits - 1); shift >= 0; shift -= 4) {
+                name += digits[(routine >> shift) & 0xF];
+            }
+            return name;
+        };
+};
@@ -0,0 +1,449 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include <initializer_list>
+#include <vector>
+#include <iostream>
+
+#include "chip8.h"
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#define CHIP8_JIT_AVAILABLE 1
+#include <sys/mman.h>
+#else
+#define CHIP8_JIT_AVAILABLE 0
+#endif
+
+/*
+    A basic block recompiler for x86-64.
+
+    Starting from the program counter we read instructions until we hit one we can't (or don't want to) translate. Everything
+    before that is straight line code working on registers only (6xkk, 7xkk, the 8xyN maths, Annn, Fx07/15/18/1E/29) so it gets
+    turned into one native function that pokes vRegister, indexRegister and the timers directly. Jumps, calls, returns, skips,
+    drawing and anything that writes memory end the block and are left to the normal interpreter (Chip8::Step) to run.
+
+    Blocks are cached by start address (every address the profile's memory has, so all 64 KB on XO-CHIP) and remember the
+    code page versions of the pages they were read from, so if the program writes over itself the block is thrown away and
+    translated again. A block gets told how many instructions it's allowed to run and stops early if that's fewer than it
+    has, so RunFor runs exactly as many as it's asked to and the timers tick in the same places as in the interpreter.
+    The next frame then starts part way through the block, so every instruction in a block is also an entry point into
+    the same code rather than the start of another block that mostly repeats it.
+
+    On anything that isn't x86-64 (or on Windows where the calling convention is different) Available() is false and RunFor just
+    hands everything to the interpreter.
+*/
+class Chip8Jit
+{
+    // the generated code gets called like a normal function with a pointer to the chip8 in rdi and the most instructions it
+    // may run in esi. it runs that many or to the end of the block, whichever comes first
+    typedef void (*BlockFunction)(void* chip8, unsigned int budget);
+
+    struct Block {
+        BlockFunction function = nullptr; // nullptr means nothing compiled for this address yet
+        unsigned short length = 0; // how many chip8 instructions the block covers. 0 means the first one wasn't translatable
+        unsigned short lastOpcode = 0;
+        unsigned char firstPage = 0;
+        unsigned char lastPage = 0;
+        unsigned int pageVersion[2] = { 0 };
+        bool compiled = false;
+    };
+
+    std::vector<Block> blocks; // one for every address in memory, sized for the profile when RunFor first sees it
+
+    // one big chunk of executable memory that we hand out code from. when it fills up we throw everything away and start again
+    unsigned char* codeArena = nullptr;
+    size_t codeArenaSize = 1 << 20;
+    size_t codeUsed = 0;
+
+    // longest block we'll build. verify mode drops this to 1 so every instruction can be checked on its own
+    unsigned short maxBlockLength = 64;
+
+    // scratch buffer the emitter writes into before it gets copied into the arena, and where each instruction starts in it
+    std::vector<unsigned char> code;
+    std::vector<size_t> entryOffsets;
+
+    // the quirk profile the cached blocks were translated for. they bake the quirks in, so switching profile means starting again
+    const char* profile = nullptr;
+
+    public:
+
+        Chip8Jit() {
+#if CHIP8_JIT_AVAILABLE
+            void* arena = mmap(nullptr, codeArenaSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            codeArena = (arena == MAP_FAILED) ? nullptr : static_cast<unsigned char*>(arena);
+#endif
+        };
+
+        ~Chip8Jit() {
+#if CHIP8_JIT_AVAILABLE
+            if (codeArena != nullptr) {
+                munmap(codeArena, codeArenaSize);
+            }
+#endif
+        };
+
+        Chip8Jit(const Chip8Jit&) = delete;
+        Chip8Jit& operator=(const Chip8Jit&) = delete;
+
+        bool Available() const {
+            return codeArena != nullptr;
+        };
+
+        void SetMaxBlockLength(unsigned short length) {
+            maxBlockLength = (length == 0) ? 1 : length;
+            Flush();
+        };
+
+        void Flush() {
+            // forget every compiled block
+            std::fill(blocks.begin(), blocks.end(), Block());
+            codeUsed = 0;
+        };
+
+        template <typename Quirks>
+        unsigned long long RunFor(Chip8Core<Quirks>& chip8, unsigned long long cycles) {
+            // run exactly `cycles` chip8 instructions, natively where we can and through the interpreter where we can't
+            typedef Chip8Core<Quirks> Core;
+            if (!Available()) {
+                return chip8.RunFor(cycles);
+            }
+            if (profile != Quirks::name) {
+                blocks.assign(Core::memorySize, Block());
+                Flush();
+                profile = Quirks::name;
+            }
+
+            unsigned long long executed = 0;
+            while (executed < cycles) {
+                unsigned short pc = chip8.programCounter;
+                Block* block = (pc >= 0x200 && pc <= Core::memorySize - 2) ? &Lookup(chip8, pc) : nullptr;
+
+                if (block == nullptr || block->length == 0) {
+                    // not translatable so let the interpreter do this one
+                    chip8.Step();
+                    executed++;
+                    continue;
+                }
+
+                // the end of a frame can come part way through a block, in which case only the start of it runs
+                unsigned int ran = static_cast<unsigned int>(std::min<unsigned long long>(cycles - executed, block->length));
+                block->function(&chip8, ran);
+                unsigned int last = pc + 2 * (ran - 1);
+                chip8.programCounter = pc + 2 * ran;
+                chip8.currentOpcode = (ran == block->length) ? block->lastOpcode : (chip8.memory[last] << 8) | chip8.memory[last + 1];
+                executed += ran;
+            }
+            return executed;
+        };
+
+        template <typename Quirks>
+        bool Verify(const Chip8Core<Quirks>& start, unsigned long long cycles, unsigned int instructionsPerFrame) {
+            // differential test: run one copy through the JIT a single instruction at a time and another copy through the plain
+            // interpreter, and compare the whole machine after every instruction. reports the first place they disagree
+            typedef Chip8Core<Quirks> Core;
+            Core jitted = start;
+            Core reference = start;
+            reference.SetDecodeCacheEnabled(false);
+            unsigned short previousMaxBlockLength = maxBlockLength;
+            SetMaxBlockLength(1);
+
+            bool matched = true;
+            for (unsigned long long i = 0; i < cycles; i++) {
+                unsigned short pc = reference.GetProgramCounter();
+                unsigned short opcode = (reference.memory[pc & Core::memoryMask] << 8) | reference.memory[(pc + 1) & Core::memoryMask];
+                RunFor(jitted, 1);
+                reference.Step();
+                if (!jitted.StateEquals(reference)) {
+                    std::cout << "jit diverged from the interpreter after " << i << " instructions at pc 0x" << std::hex << pc
+                              << " running opcode 0x" << opcode << std::dec << std::endl;
+                    matched = false;
+                    break;
+                }
+                if ((i + 1) % instructionsPerFrame == 0) {
+                    jitted.TickTimers();
+                    reference.TickTimers();
+                }
+            }
+            if (matched) {
+                std::cout << "jit matched the interpreter for " << cycles << " instructions" << std::endl;
+            }
+            SetMaxBlockLength(previousMaxBlockLength);
+            return matched;
+        };
+
+    private:
+
+        template <typename Quirks>
+        static bool Fresh(const Chip8Core<Quirks>& chip8, const Block& block) {
+            // compiled, and nothing has written over the code it came from since
+            return block.compiled
+                && block.pageVersion[0] == chip8.codePageVersion[block.firstPage]
+                && block.pageVersion[1] == chip8.codePageVersion[block.lastPage];
+        };
+
+        template <typename Quirks>
+        Block& Lookup(Chip8Core<Quirks>& chip8, unsigned short pc) {
+            Block& block = blocks[pc];
+            if (Fresh(chip8, block)) {
+                return block;
+            }
+            Compile(chip8, pc, block);
+            return block;
+        };
+
+        template <typename Quirks>
+        void Compile(Chip8Core<Quirks>& chip8, unsigned short pc, Block& block) {
+            typedef Chip8Core<Quirks> Core;
+            code.clear();
+            unsigned short length = 0;
+            unsigned short lastOpcode = 0;
+            unsigned int address = pc;
+            entryOffsets.clear();
+            while (length < maxBlockLength && address <= Core::memorySize - 2) {
+                unsigned short opcode = (chip8.memory[address] << 8) | chip8.memory[address + 1];
+                size_t before = code.size();
+                if (length > 0) {
+                    // one more of the budget gone, and return if that was the last of it. it counts from wherever the block
+                    // was entered, so this works the same from every entry point
+                    Emit({ 0xFF, 0xCE }); // dec esi
+                    Emit({ 0x75, 0x01 }); // jnz past the ret
+                    Emit({ 0xC3 }); // ret
+                }
+                size_t entry = code.size();
+                if (!EmitInstruction<Quirks>(opcode)) {
+                    code.resize(before);
+                    break;
+                }
+                entryOffsets.push_back(entry);
+                lastOpcode = opcode;
+                length++;
+                address += 2;
+            }
+            Emit({ 0xC3 }); // ret
+
+            if (length > 0 && codeUsed + code.size() > codeArenaSize) {
+                // out of room so start again from scratch. the block we're building now is the only one we need right away
+                Flush();
+            }
+
+            block = Block();
+            block.compiled = true;
+            block.length = length;
+            block.lastOpcode = lastOpcode;
+            block.firstPage = pc >> 8;
+            block.lastPage = std::min<unsigned int>(Core::codePageCount - 1, ((length > 0) ? pc + 2 * length - 1 : pc + 1) >> 8);
+            block.pageVersion[0] = chip8.codePageVersion[block.firstPage];
+            block.pageVersion[1] = chip8.codePageVersion[block.lastPage];
+
+            if (length == 0) {
+                return;
+            }
+
+#if CHIP8_JIT_AVAILABLE
+            // keep the arena writable or executable but never both at once
+            mprotect(codeArena, codeArenaSize, PROT_READ | PROT_WRITE);
+            std::memcpy(codeArena + codeUsed, code.data(), code.size());
+            mprotect(codeArena, codeArenaSize, PROT_READ | PROT_EXEC);
+#endif
+            block.function = reinterpret_cast<BlockFunction>(codeArena + codeUsed);
+
+            // every later instruction in the block can be started from too, unless there's already something at least as
+            // long there that's still good
+            for (unsigned short k = 1; k < length; k++) {
+                Block& inner = blocks[pc + 2 * k];
+                if (Fresh(chip8, inner) && inner.length >= length - k) {
+                    continue;
+                }
+                inner = block;
+                inner.length = length - k;
+                inner.function = reinterpret_cast<BlockFunction>(codeArena + codeUsed + entryOffsets[k]);
+            }
+            codeUsed += code.size();
+        };
+
+        /*
+            Instruction emitters. Everything is addressed as [rdi + offset of the member] with a 32 bit displacement, eax/ecx/edx
+            are scratch. The registers are bytes, so they're loaded zero extended, the maths is done in 32 bit registers to match
+            the way C++ promotes them, and only the bottom byte gets stored back, which is where the wrap round at 256 comes from.
+            The order of reads and writes follows RunOpcode exactly (the flag is worked out from the old values and stored after
+            the result) so that x == F or y == F behave the same.
+            The quirks are known while translating so the generated code only ever does what the profile says.
+        */
+
+        template <typename Quirks>
+        bool EmitInstruction(unsigned short opcode) {
+            typedef Chip8Core<Quirks> Core;
+            auto V = [](unsigned char index) -> unsigned int {
+                return offsetof(Core, vRegister) + index;
+            };
+
+            unsigned char x = (opcode & 0x0F00) >> 8;
+            unsigned char y = (opcode & 0x00F0) >> 4;
+            unsigned char n = opcode & 0x000F;
+            unsigned char kk = opcode & 0x00FF;
+            unsigned short nnn = opcode & 0x0FFF;
+
+            switch (opcode >> 12) {
+                case 0x6: { // Vx = kk
+                    StoreImmediate8(V(x), kk);
+                    return true;
+                }
+                case 0x7: { // Vx += kk
+                    Emit({ 0x80, 0x87 }); Emit32(V(x)); Emit({ kk }); // add byte [rdi + Vx], kk
+                    return true;
+                }
+                case 0x8: {
+                    switch (n) {
+                        case 0x0: // Vx = Vy
+                            LoadByte(EAX, V(y));
+                            StoreByte(EAX, V(x));
+                            return true;
+                        case 0x1: // Vx |= Vy
+                        case 0x2: // Vx &= Vy
+                        case 0x3: { // Vx ^= Vy
+                            static const unsigned char aluOps[4] = { 0, 0x09, 0x21, 0x31 }; // or, and, xor eax, ecx
+                            LoadByte(EAX, V(x));
+                            LoadByte(ECX, V(y));
+                            Emit({ aluOps[n], 0xC8 });
+                            StoreByte(EAX, V(x));
+                            if constexpr (Quirks::logicResetsVf) {
+                                StoreImmediate8(V(0xF), 0);
+                            }
+                            return true;
+                        }
+                        case 0x4: { // sum = Vx + Vy, Vx = sum, VF = carry
+                            LoadByte(EAX, V(x));
+                            LoadByte(ECX, V(y));
+                            Emit({ 0x01, 0xC8 }); // add eax, ecx
+                            Emit({ 0x89, 0xC2 }); // mov edx, eax
+                            Emit({ 0xC1, 0xEA, 0x08 }); // shr edx, 8 (the carry, sum is at most 510)
+                            StoreByte(EAX, V(x));
+                            StoreByte(EDX, V(0xF));
+                            return true;
+                        }
+                        case 0x5: // Vx -= Vy, VF = Vx >= Vy
+                        case 0x7: { // Vx = Vy - Vx, VF = Vy >= Vx
+                            LoadByte(EAX, V(x));
+                            LoadByte(ECX, V(y));
+                            Emit({ 0x31, 0xD2 }); // xor edx, edx
+                            Emit({ 0x39, 0xC8 }); // cmp eax, ecx
+                            Emit({ 0x0F, static_cast<unsigned char>(n == 0x5 ? 0x93 : 0x96), 0xC2 }); // setae dl / setbe dl
+                            if (n == 0x5) {
+                                Emit({ 0x29, 0xC8 }); // sub eax, ecx
+                                StoreByte(EAX, V(x));
+                            }
+                            else {
+                                Emit({ 0x29, 0xC1 }); // sub ecx, eax
+                                StoreByte(ECX, V(x));
+                            }
+                            StoreByte(EDX, V(0xF));
+                            return true;
+                        }
+                        case 0x6: { // Vx = Vs >> 1, VF = Vs & 1 where s is x or y depending on the quirks
+                            const unsigned char source = Quirks::shiftUsesVy ? y : x;
+                            LoadByte(EAX, V(source));
+                            Emit({ 0x89, 0xC2 }); // mov edx, eax
+                            Emit({ 0x83, 0xE2, 0x01 }); // and edx, 1
+                            Emit({ 0xD1, 0xE8 }); // shr eax, 1
+                            StoreByte(EAX, V(x));
+                            StoreByte(EDX, V(0xF));
+                            return true;
+                        }
+                        case 0xE: { // Vx = Vs << 1, VF = Vs >> 7
+                            const unsigned char source = Quirks::shiftUsesVy ? y : x;
+                            LoadByte(EAX, V(source));
+                            Emit({ 0x89, 0xC2 }); // mov edx, eax
+                            Emit({ 0xC1, 0xEA, 0x07 }); // shr edx, 7
+                            Emit({ 0xD1, 0xE0 }); // shl eax, 1
+                            StoreByte(EAX, V(x));
+                            StoreByte(EDX, V(0xF));
+                            return true;
+                        }
+                    }
+                    return false;
+                }
+                case 0xA: { // I = nnn
+                    StoreImmediate16(offsetof(Core, indexRegister), nnn);
+                    return true;
+                }
+                case 0xF: {
+                    switch (kk) {
+                        case 0x07: // Vx = delay timer
+                            LoadByte(EAX, offsetof(Core, delayTimer));
+                            StoreByte(EAX, V(x));
+                            return true;
+                        case 0x15: // delay timer = Vx
+                        case 0x18: // sound timer = Vx
+                            LoadByte(EAX, V(x));
+                            StoreByte(EAX, kk == 0x15 ? offsetof(Core, delayTimer) : offsetof(Core, soundTimer));
+                            return true;
+                        case 0x1E: // I += Vx
+                            LoadByte(EAX, V(x));
+                            Emit({ 0x66, 0x01, 0x87 }); Emit32(offsetof(Core, indexRegister)); // add word [rdi + I], ax
+                            return true;
+                        case 0x29: // I = 0x50 + Vx * 5
+                            LoadByte(EAX, V(x));
+                            Emit({ 0x6B, 0xC0, 0x05 }); // imul eax, eax, 5
+                            Emit({ 0x05 }); Emit32(0x050); // add eax, 0x50
+                            StoreWord(EAX, offsetof(Core, indexRegister));
+                            return true;
+                    }
+                    return false;
+                }
+            }
+            // jumps, calls, returns, skips, drawing, random numbers, keys and memory writes are all left to the interpreter
+            return false;
+        };
+
+        // the reg field of the modrm byte for the scratch registers we use
+        enum ScratchRegister : unsigned char { EAX = 0, ECX = 1, EDX = 2 };
+
+        void LoadByte(ScratchRegister reg, unsigned int offset) {
+            // movzx reg, byte [rdi + offset]
+            Emit({ 0x0F, 0xB6, static_cast<unsigned char>(0x87 | (reg << 3)) });
+            Emit32(offset);
+        };
+
+        void StoreByte(ScratchRegister reg, unsigned int offset) {
+            // mov byte [rdi + offset], al / cl / dl
+            Emit({ 0x88, static_cast<unsigned char>(0x87 | (reg << 3)) });
+            Emit32(offset);
+        };
+
+        void StoreWord(ScratchRegister reg, unsigned int offset) {
+            // mov word [rdi + offset], reg
+            Emit({ 0x66, 0x89, static_cast<unsigned char>(0x87 | (reg << 3)) });
+            Emit32(offset);
+        };
+
+        void StoreImmediate8(unsigned int offset, unsigned char value) {
+            // mov byte [rdi + offset], value
+            Emit({ 0xC6, 0x87 });
+            Emit32(offset);
+            Emit({ value });
+        };
+
+        void StoreImmediate16(unsigned int offset, unsigned short value) {
+            // mov word [rdi + offset], value
+            Emit({ 0x66, 0xC7, 0x87 });
+            Emit32(offset);
+            Emit16(value);
+        };
+
+        void Emit(std::initializer_list<unsigned char> bytes) {
+            code.insert(code.end(), bytes);
+        };
+
+        void Emit16(unsigned short value) {
+            code.push_back(value & 0xFF);
+            code.push_back(value >> 8);
+        };
+
+        void Emit32(unsigned int value) {
+            for (int i = 0; i < 4; i++) {
+                code.push_back((value >> (8 * i)) & 0xFF);
+            }
+        };
+};
@@ -0,0 +1,457 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
+
+#include "chip8.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/*
+    Lots of copies of the same program stepped together.
+
+    For fuzzing and searching input sequences we want thousands of machines running the same ROM that only differ in their
+    keys and random numbers. Most of the time most of them are at the same place in the program, so instead of stepping
+    thousands of separate Chip8s we keep their registers in structure of arrays form (all the V0s next to each other, then
+    all the V1s, and so on) and step every lane that shares a program counter at once.
+
+    The register maths (6xkk, 7xkk and the 8xyN group) is done 16 lanes at a time with AVX2 when the compiler is allowed to use
+    it (-mavx2 or -march=native), and with a plain loop over the lanes otherwise. Jumps, Annn and the register compare skips are
+    shared the same way since each lane just ends up with its own program counter. Anything else, and any lane that has
+    wandered off somewhere on its own, gets copied into its own Chip8 and run through the normal interpreter for that one instruction.
+
+    Each lane still has its own Chip8 underneath for the things that are too big to be worth spreading out (memory, the
+    display and the stack). The copies of the registers in those Chip8s are only up to date while a lane is being run on its own.
+*/
+class LockstepEngine
+{
+    unsigned int laneCount = 0;
+    unsigned int stride = 0; // laneCount rounded up to a whole number of 16 lane vectors
+
+    std::vector<std::unique_ptr<Chip8>> lanes;
+
+    // structure of arrays register file. register r of lane l is registers[r * stride + l]. the registers are only 8 bits but
+    // they're kept in 16 bit lanes so each row lines up with the program counters and the masks, and anything that can carry
+    // past 255 gets cut back down to a byte before it's stored
+    std::vector<uint16_t> registers;
+    std::vector<uint16_t> programCounter;
+    std::vector<uint16_t> indexRegister;
+    std::vector<uint8_t> delayTimer;
+    std::vector<uint8_t> soundTimer;
+
+    // scratch for each step: which lanes are in the group being run together, and which lanes have already had their turn
+    std::vector<uint16_t> groupMask;
+    std::vector<uint16_t> stepped; // 0xFFFF once a lane has run this step, same shape as groupMask so they can be combined 16 at a time
+
+    /*
+        The program as it was loaded, which is what every lane's code looks like until it writes over it. Each lane has a bit per
+        256 byte page of memory that it has written to since. Only if the instruction we're about to run is on one of those pages
+        do we have to go and look in that lane's own memory to see whether it still matches.
+    */
+    std::vector<unsigned char> sharedMemory = std::vector<unsigned char>(4096, 0);
+    std::vector<uint16_t> dirtyPages;
+
+    // after this many shared groups in one step everything left over just runs lane by lane
+    static const unsigned int maxGroupsPerStep = 4;
+
+    public:
+
+        // how many lane instructions went down the shared (vector) path and how many went lane by lane
+        unsigned long long vectorLaneSteps = 0;
+        unsigned long long scalarLaneSteps = 0;
+
+        explicit LockstepEngine(unsigned int count) {
+            laneCount = std::max(1u, count);
+            stride = (laneCount + 15) & ~15u;
+            for (unsigned int i = 0; i < laneCount; i++) {
+                lanes.push_back(std::make_unique<Chip8>());
+                lanes.back()->Initialize();
+            }
+            registers.assign(16 * stride, 0);
+            programCounter.assign(stride, 0);
+            indexRegister.assign(stride, 0);
+            delayTimer.assign(stride, 0);
+            soundTimer.assign(stride, 0);
+            groupMask.assign(stride, 0);
+            stepped.assign(stride, 0);
+            dirtyPages.assign(stride, 0);
+            for (unsigned int i = 0; i < laneCount; i++) {
+                Gather(i);
+            }
+        };
+
+        unsigned int LaneCount() const {
+            return laneCount;
+        };
+
+        bool LoadProgram(const std::string& path) {
+            for (unsigned int i = 0; i < laneCount; i++) {
+                if (!lanes[i]->LoadProgram(path)) {
+                    return false;
+                }
+                Gather(i);
+                dirtyPages[i] = 0;
+            }
+            std::copy(std::begin(lanes[0]->memory), std::end(lanes[0]->memory), sharedMemory.begin());
+            return true;
+        };
+
+        void Seed(unsigned int lane, uint64_t seed) {
+            // random numbers are made lane by lane (Cxkk never runs shared) so the generator just lives in the lane's own Chip8
+            lanes[lane]->Seed(seed);
+        };
+
+        void SetKey(unsigned int lane, unsigned char keyIndex, bool isPressed) {
+            lanes[lane]->SetKey(keyIndex, isPressed);
+        };
+
+        void TickTimers() {
+            for (unsigned int i = 0; i < stride; i++) {
+                delayTimer[i] = (delayTimer[i] > 0) ? delayTimer[i] - 1 : 0;
+                soundTimer[i] = (soundTimer[i] > 0) ? soundTimer[i] - 1 : 0;
+            }
+        };
+
+        const Chip8& Lane(unsigned int lane) {
+            // bring the lane's own Chip8 up to date so it can be looked at
+            Scatter(lane);
+            return *lanes[lane];
+        };
+
+        void Step() {
+            // every lane runs exactly one instruction
+            std::fill(stepped.begin(), stepped.end(), 0);
+            unsigned int groups = 0;
+            for (unsigned int lane = 0; lane < laneCount; lane++) {
+                if (stepped[lane]) {
+                    continue;
+                }
+                unsigned short pc = programCounter[lane];
+                unsigned short opcode = FetchOpcode(lane, pc);
+                if (groups < maxGroupsPerStep && IsShareable(opcode)) {
+                    // gather up every lane that's about to run the same instruction and do them all at once
+                    groups++;
+                    BuildGroup(pc, opcode);
+                    RunShared(opcode);
+                }
+                else {
+                    RunAlone(lane, opcode);
+                    stepped[lane] = 0xFFFF;
+                }
+            }
+        };
+
+        void RunFor(unsigned long long steps) {
+            for (unsigned long long i = 0; i < steps; i++) {
+                Step();
+            }
+        };
+
+    private:
+
+        unsigned short FetchOpcode(unsigned int lane, unsigned short pc) const {
+            // lanes can end up with different code if the program writes over itself, so if this lane has written anywhere
+            // near the instruction we read it from the lane's own memory instead of the shared copy
+            unsigned short pages = (1 << ((pc & 0xFFF) >> 8)) | (1 << (((pc + 1) & 0xFFF) >> 8));
+            const unsigned char* memory = (dirtyPages[lane] & pages) ? lanes[lane]->memory : sharedMemory.data();
+            return (memory[pc & 0xFFF] << 8) | memory[(pc + 1) & 0xFFF];
+        };
+
+        void BuildGroup(unsigned short pc, unsigned short opcode) {
+            // groupMask = every lane that hasn't run yet, is at pc and (if it has written to its own code) still has the same
+            // instruction there. those lanes are marked as stepped
+            unsigned short pages = (1 << ((pc & 0xFFF) >> 8)) | (1 << (((pc + 1) & 0xFFF) >> 8));
+#if defined(__AVX2__)
+            const __m256i target = _mm256_set1_epi16(pc);
+            const __m256i pageBits = _mm256_set1_epi16(pages);
+            const __m256i zero = _mm256_setzero_si256();
+            for (unsigned int i = 0; i < stride; i += 16) {
+                __m256i candidates = _mm256_andnot_si256(Load(&stepped[i]), _mm256_cmpeq_epi16(Load(&programCounter[i]), target));
+                // lanes with their own writes near pc need checking one by one, which almost never happens
+                __m256i ownCode = _mm256_andnot_si256(_mm256_cmpeq_epi16(_mm256_and_si256(Load(&dirtyPages[i]), pageBits), zero), candidates);
+                if (!_mm256_testz_si256(ownCode, ownCode)) {
+                    alignas(32) uint16_t check[16];
+                    _mm256_store_si256(reinterpret_cast<__m256i*>(check), ownCode);
+                    for (int j = 0; j < 16; j++) {
+                        if (check[j] != 0 && FetchOpcode(i + j, pc) != opcode) {
+                            candidates = _mm256_andnot_si256(LaneBit(j), candidates);
+                        }
+                    }
+                }
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(&groupMask[i]), candidates);
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(&stepped[i]), _mm256_or_si256(Load(&stepped[i]), candidates));
+                vectorLaneSteps += __builtin_popcount(_mm256_movemask_epi8(candidates)) / 2;
+            }
+#else
+            for (unsigned int i = 0; i < laneCount; i++) {
+                bool inGroup = !stepped[i] && programCounter[i] == pc && ((dirtyPages[i] & pages) == 0 || FetchOpcode(i, pc) == opcode);
+                groupMask[i] = inGroup ? 0xFFFF : 0;
+                if (inGroup) {
+                    stepped[i] = 0xFFFF;
+                    vectorLaneSteps++;
+                }
+            }
+#endif
+        };
+
+        static bool IsShareable(unsigned short opcode) {
+            switch (opcode >> 12) {
+                case 0x1:
+                case 0x3:
+                case 0x4:
+                case 0x6:
+                case 0x7:
+                case 0xA:
+                    return true;
+                case 0x5:
+                case 0x9:
+                    return (opcode & 0xF) == 0;
+                case 0x8: {
+                    unsigned char n = opcode & 0xF;
+                    return n <= 0x7 || n == 0xE;
+                }
+            }
+            return false;
+        };
+
+        void Gather(unsigned int lane) {
+            // copy a lane's registers out of its Chip8 into the shared arrays
+            const Chip8& chip8 = *lanes[lane];
+            for (int r = 0; r < 16; r++) {
+                registers[r * stride + lane] = chip8.vRegister[r];
+            }
+            programCounter[lane] = chip8.programCounter;
+            indexRegister[lane] = chip8.indexRegister;
+            delayTimer[lane] = chip8.delayTimer;
+            soundTimer[lane] = chip8.soundTimer;
+        };
+
+        void Scatter(unsigned int lane) {
+            // and back the other way
+            Chip8& chip8 = *lanes[lane];
+            for (int r = 0; r < 16; r++) {
+                chip8.vRegister[r] = registers[r * stride + lane];
+            }
+            chip8.programCounter = programCounter[lane];
+            chip8.indexRegister = indexRegister[lane];
+            chip8.delayTimer = delayTimer[lane];
+            chip8.soundTimer = soundTimer[lane];
+        };
+
+        void RunAlone(unsigned int lane, unsigned short opcode) {
+            Scatter(lane);
+            Chip8& chip8 = *lanes[lane];
+            if ((opcode >> 12) == 0xF) {
+                // Fx33 and Fx55 write to memory, so watch the code page versions to see which pages this lane has touched
+                unsigned int before[16];
+                std::copy(std::begin(chip8.codePageVersion), std::end(chip8.codePageVersion), before);
+                chip8.Step();
+                for (int page = 0; page < 16; page++) {
+                    if (chip8.codePageVersion[page] != before[page]) {
+                        dirtyPages[lane] |= 1 << page;
+                    }
+                }
+            }
+            else {
+                chip8.Step();
+            }
+            Gather(lane);
+            scalarLaneSteps++;
+        };
+
+        uint16_t* Row(unsigned char r) {
+            return &registers[r * stride];
+        };
+
+        void RunShared(unsigned short opcode) {
+            // run one shared instruction on every lane in groupMask. the order of reads and writes is the same as
+            // RunOpcode (the flag comes from the old values and is written after the result) so x == F or y == F still match
+            unsigned char x = (opcode & 0x0F00) >> 8;
+            unsigned char y = (opcode & 0x00F0) >> 4;
+            unsigned char n = opcode & 0x000F;
+            uint16_t kk = opcode & 0x00FF;
+            uint16_t nnn = opcode & 0x0FFF;
+            uint16_t* vx = Row(x);
+            uint16_t* vy = Row(y);
+            uint16_t* vf = Row(0xF);
+            // the shifts read Vy or Vx depending on the quirks, same as the interpreter
+            uint16_t* vs = Row(Chip8::Quirks::shiftUsesVy ? y : x);
+            constexpr bool logicResetsVf = Chip8::Quirks::logicResetsVf;
+
+#if defined(__AVX2__)
+            const __m256i one = _mm256_set1_epi16(1);
+            const __m256i two = _mm256_set1_epi16(2);
+            const __m256i byte = _mm256_set1_epi16(0xFF);
+            for (unsigned int i = 0; i < stride; i += 16) {
+                const __m256i mask = Load(&groupMask[i]);
+                if (_mm256_testz_si256(mask, mask)) {
+                    continue;
+                }
+                __m256i nextPc = _mm256_add_epi16(Load(&programCounter[i]), two);
+                switch (opcode >> 12) {
+                    case 0x1:
+                        nextPc = _mm256_set1_epi16(nnn);
+                        break;
+                    case 0x3: // skip if Vx == kk: lanes where it's equal move on 4 instead of 2
+                        nextPc = _mm256_add_epi16(nextPc, _mm256_and_si256(_mm256_cmpeq_epi16(Load(vx + i), _mm256_set1_epi16(kk)), two));
+                        break;
+                    case 0x4:
+                        nextPc = _mm256_add_epi16(nextPc, _mm256_andnot_si256(_mm256_cmpeq_epi16(Load(vx + i), _mm256_set1_epi16(kk)), two));
+                        break;
+                    case 0x5:
+                        nextPc = _mm256_add_epi16(nextPc, _mm256_and_si256(_mm256_cmpeq_epi16(Load(vx + i), Load(vy + i)), two));
+                        break;
+                    case 0x9:
+                        nextPc = _mm256_add_epi16(nextPc, _mm256_andnot_si256(_mm256_cmpeq_epi16(Load(vx + i), Load(vy + i)), two));
+                        break;
+                    case 0xA:
+                        Store(&indexRegister[i], mask, _mm256_set1_epi16(nnn));
+                        break;
+                    case 0x6:
+                        Store(vx + i, mask, _mm256_set1_epi16(kk));
+                        break;
+                    case 0x7:
+                        Store(vx + i, mask, _mm256_and_si256(_mm256_add_epi16(Load(vx + i), _mm256_set1_epi16(kk)), byte));
+                        break;
+                    case 0x8: {
+                        switch (n) {
+                            case 0x0:
+                                Store(vx + i, mask, Load(vy + i));
+                                break;
+                            case 0x1:
+                                Store(vx + i, mask, _mm256_or_si256(Load(vx + i), Load(vy + i)));
+                                if constexpr (logicResetsVf) {
+                                    Store(vf + i, mask, _mm256_setzero_si256());
+                                }
+                                break;
+                            case 0x2:
+                                Store(vx + i, mask, _mm256_and_si256(Load(vx + i), Load(vy + i)));
+                                if constexpr (logicResetsVf) {
+                                    Store(vf + i, mask, _mm256_setzero_si256());
+                                }
+                                break;
+                            case 0x3:
+                                Store(vx + i, mask, _mm256_xor_si256(Load(vx + i), Load(vy + i)));
+                                if constexpr (logicResetsVf) {
+                                    Store(vf + i, mask, _mm256_setzero_si256());
+                                }
+                                break;
+                            case 0x4: {
+                                // the sum is at most 510 so the carry is just bit 8
+                                __m256i sum = _mm256_add_epi16(Load(vx + i), Load(vy + i));
+                                Store(vx + i, mask, _mm256_and_si256(sum, byte));
+                                Store(vf + i, mask, _mm256_srli_epi16(sum, 8));
+                                break;
+                            }
+                            case 0x5:
+                            case 0x7: {
+                                // there's no unsigned 16 bit greater or equal in AVX2 so a >= b is worked out as max(a, b) == a
+                                __m256i a = (n == 0x5) ? Load(vx + i) : Load(vy + i);
+                                __m256i b = (n == 0x5) ? Load(vy + i) : Load(vx + i);
+                                __m256i notBorrow = _mm256_and_si256(_mm256_cmpeq_epi16(_mm256_max_epu16(a, b), a), one);
+                                Store(vx + i, mask, _mm256_and_si256(_mm256_sub_epi16(a, b), byte));
+                                Store(vf + i, mask, notBorrow);
+                                break;
+                            }
+                            case 0x6: {
+                                __m256i shiftedOut = _mm256_and_si256(Load(vs + i), one);
+                                Store(vx + i, mask, _mm256_srli_epi16(Load(vs + i), 1));
+                                Store(vf + i, mask, shiftedOut);
+                                break;
+                            }
+                            case 0xE: {
+                                __m256i shiftedOut = _mm256_srli_epi16(Load(vs + i), 7);
+                                Store(vx + i, mask, _mm256_and_si256(_mm256_slli_epi16(Load(vs + i), 1), byte));
+                                Store(vf + i, mask, shiftedOut);
+                                break;
+                            }
+                        }
+                        break;
+                    }
+                }
+                Store(&programCounter[i], mask, nextPc);
+            }
+#else
+            for (unsigned int i = 0; i < laneCount; i++) {
+                if (groupMask[i] == 0) {
+                    continue;
+                }
+                unsigned short nextPc = programCounter[i] + 2;
+                switch (opcode >> 12) {
+                    case 0x1: nextPc = nnn; break;
+                    case 0x3: nextPc += (vx[i] == kk) ? 2 : 0; break;
+                    case 0x4: nextPc += (vx[i] != kk) ? 2 : 0; break;
+                    case 0x5: nextPc += (vx[i] == vy[i]) ? 2 : 0; break;
+                    case 0x9: nextPc += (vx[i] != vy[i]) ? 2 : 0; break;
+                    case 0xA: indexRegister[i] = nnn; break;
+                    case 0x6: vx[i] = kk; break;
+                    case 0x7: vx[i] = (vx[i] + kk) & 0xFF; break;
+                    case 0x8: {
+                        switch (n) {
+                            case 0x0: vx[i] = vy[i]; break;
+                            case 0x1: vx[i] |= vy[i]; if constexpr (logicResetsVf) { vf[i] = 0; } break;
+                            case 0x2: vx[i] &= vy[i]; if constexpr (logicResetsVf) { vf[i] = 0; } break;
+                            case 0x3: vx[i] ^= vy[i]; if constexpr (logicResetsVf) { vf[i] = 0; } break;
+                            case 0x4: {
+                                uint16_t sum = vx[i] + vy[i];
+                                vx[i] = sum & 0xFF;
+                                vf[i] = sum >> 8;
+                                break;
+                            }
+                            case 0x5: {
+                                uint16_t notBorrow = (vx[i] >= vy[i]) ? 1 : 0;
+                                vx[i] = (vx[i] - vy[i]) & 0xFF;
+                                vf[i] = notBorrow;
+                                break;
+                            }
+                            case 0x6: {
+                                uint16_t shiftedOut = vs[i] & 0x1;
+                                vx[i] = vs[i] >> 1;
+                                vf[i] = shiftedOut;
+                                break;
+                            }
+                            case 0x7: {
+                                uint16_t notBorrow = (vy[i] >= vx[i]) ? 1 : 0;
+                                vx[i] = (vy[i] - vx[i]) & 0xFF;
+                                vf[i] = notBorrow;
+                                break;
+                            }
+                            case 0xE: {
+                                uint16_t shiftedOut = vs[i] >> 7;
+                                vx[i] = (vs[i] << 1) & 0xFF;
+                                vf[i] = shiftedOut;
+                                break;
+                            }
+                        }
+                        break;
+                    }
+                }
+                programCounter[i] = nextPc;
+            }
+#endif
+        };
+
+#if defined(__AVX2__)
+        static __m256i LaneBit(int lane) {
+            // all ones in one 16 bit lane, zeros everywhere else
+            alignas(32) uint16_t bits[16] = { 0 };
+            bits[lane] = 0xFFFF;
+            return _mm256_load_si256(reinterpret_cast<const __m256i*>(bits));
+        };
+
+        static __m256i Load(const uint16_t* values) {
+            return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values));
+        };
+
+        static void Store(uint16_t* values, __m256i mask, __m256i value) {
+            // only the lanes in the mask get the new value, everything else keeps what it had
+            __m256i old = Load(values);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(values), _mm256_blendv_epi8(old, value, mask));
+        };
+#endif
+};
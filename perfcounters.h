@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstdint>
+
+#if defined(__linux__)
+#include <cstring>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+/*
+    The CPU's own branch counters for whichever thread makes one of these, through Linux's perf_event_open. Only the two the
+    dispatch benchmark wants: how many branches the host ran and how many of them it guessed wrong.
+
+    Plenty of machines won't hand them out (anything that isn't Linux, most VMs and containers, or kernel.perf_event_paranoid
+    turned up) so check Available() before believing the numbers. Everything still works without them, there's just less to look at.
+*/
+class PerfCounters
+{
+    int branchesFd = -1; // the group leader, starting and stopping it starts and stops both
+    int missesFd = -1;
+
+    public:
+
+        PerfCounters() {
+#if defined(__linux__)
+            branchesFd = Open(PERF_COUNT_HW_BRANCH_INSTRUCTIONS, -1);
+            missesFd = (branchesFd >= 0) ? Open(PERF_COUNT_HW_BRANCH_MISSES, branchesFd) : -1;
+            if (missesFd < 0) {
+                Close();
+            }
+#endif
+        };
+
+        ~PerfCounters() {
+            Close();
+        };
+
+        PerfCounters(const PerfCounters&) = delete;
+        PerfCounters& operator=(const PerfCounters&) = delete;
+
+        bool Available() const {
+            return branchesFd >= 0 && missesFd >= 0;
+        };
+
+        void Start() {
+            // zero both and start counting
+#if defined(__linux__)
+            if (Available()) {
+                ioctl(branchesFd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+                ioctl(branchesFd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+            }
+#endif
+        };
+
+        void Stop() {
+#if defined(__linux__)
+            if (Available()) {
+                ioctl(branchesFd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+            }
+#endif
+        };
+
+        uint64_t Branches() const {
+            return Read(branchesFd);
+        };
+
+        uint64_t BranchMisses() const {
+            return Read(missesFd);
+        };
+
+    private:
+
+#if defined(__linux__)
+        static int Open(uint64_t counter, int groupFd) {
+            // user space only and starts off disabled so Start decides exactly what gets measured
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.size = sizeof(attr);
+            attr.config = counter;
+            attr.disabled = (groupFd < 0) ? 1 : 0;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, groupFd, 0));
+        };
+#endif
+
+        static uint64_t Read(int fd) {
+            uint64_t value = 0;
+#if defined(__linux__)
+            if (fd >= 0 && read(fd, &value, sizeof(value)) != sizeof(value)) {
+                value = 0;
+            }
+#endif
+            return value;
+        };
+
+        void Close() {
+#if defined(__linux__)
+            if (missesFd >= 0) {
+                close(missesFd);
+            }
+            if (branchesFd >= 0) {
+                close(branchesFd);
+            }
+#endif
+            branchesFd = -1;
+            missesFd = -1;
+        };
+};
@@ -0,0 +1,51 @@
+#pragma once
+
+/*
+    Quirk profiles. The original COSMAC VIP interpreter, SUPER-CHIP on the HP48 calculators and XO-CHIP all disagree about
+    a handful of instructions, and games written for one of them often break on the others. Each profile is just a set of
+    compile time constants that Chip8Core is built with, so picking one costs nothing while the program runs.
+
+        shiftUsesVy             8xy6 / 8xyE shift Vy and put the result in Vx (otherwise they shift Vx in place)
+        loadStoreIncrementsI    Fx55 / Fx65 leave I pointing just past the last register they touched
+        jumpUsesVx              Bnnn jumps to nnn + Vx where x is the top nibble of nnn (Bxnn) instead of nnn + V0
+        spritesWrap             sprites going off the right or bottom come back in on the left or top instead of being clipped
+        logicResetsVf           8xy1 / 8xy2 / 8xy3 set VF to 0 afterwards
+
+    The later machines also added instructions, which each profile turns on as well:
+
+        hasSuperChip            128 x 64 high resolution mode, scrolling, 16 x 16 sprites, the big font and the RPL flags
+        hasXoChip               64 KB of memory, two bitplanes, F000 nnnn, 5xy2 / 5xy3 and the audio pattern buffer
+*/
+
+struct VipQuirks {
+    static constexpr const char* name = "vip";
+    static constexpr bool shiftUsesVy = true;
+    static constexpr bool loadStoreIncrementsI = true;
+    static constexpr bool jumpUsesVx = false;
+    static constexpr bool spritesWrap = false;
+    static constexpr bool logicResetsVf = true;
+    static constexpr bool hasSuperChip = false;
+    static constexpr bool hasXoChip = false;
+};
+
+struct SuperChipQuirks {
+    static constexpr const char* name = "schip";
+    static constexpr bool shiftUsesVy = false;
+    static constexpr bool loadStoreIncrementsI = false;
+    static constexpr bool jumpUsesVx = true;
+    static constexpr bool spritesWrap = false;
+    static constexpr bool logicResetsVf = false;
+    static constexpr bool hasSuperChip = true;
+    static constexpr bool hasXoChip = false;
+};
+
+struct XoChipQuirks {
+    static constexpr const char* name = "xochip";
+    static constexpr bool shiftUsesVy = true;
+    static constexpr bool loadStoreIncrementsI = true;
+    static constexpr bool jumpUsesVx = false;
+    static constexpr bool spritesWrap = true;
+    static constexpr bool logicResetsVf = false;
+    static constexpr bool hasSuperChip = true;
+    static constexpr bool hasXoChip = true;
+};
@@ -0,0 +1,388 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iterator>
+
+#include "chip8.h"
+
+/*
+    Savestates. The whole machine (memory, display, registers, stack, timers and keys) written out as one fixed size block:
+
+        "C8SS"              4 byte magic
+        version             u16
+        memorySize          u32 (version 3 onwards, before that it was always 4096)
+        displayWords        u16 (version 3 onwards, before that it was always 32)
+        memory              memorySize bytes
+        display             displayWords x u64, laid out the same as Chip8Core::display
+        programCounter      u16
+        indexRegister       u16
+        vRegister           16 x u8 (16 x u16 before version 4, when the registers were wider than they should have been)
+        stack               16 x u16
+        stackPointer        u16
+        currentOpcode       u16
+        delayTimer          u8
+        soundTimer          u8
+        keys                u16, bit n set if key n is held
+        rngState            4 x u64 (version 2 onwards)
+        hires               u8 (version 3 onwards, this and everything after it is for SUPER-CHIP and XO-CHIP)
+        planeMask           u8
+        rplFlags            16 bytes
+        audioPattern        16 bytes
+        pitch               u8
+
+    Everything is little endian no matter what machine wrote it, so states can be passed between machines.
+    Bump the version whenever the layout changes and keep reading the old ones where we can. A state only loads into a core
+    of the same shape, so a SUPER-CHIP state can't be loaded into a plain chip8 for example.
+*/
+class Savestate
+{
+    public:
+
+        static const uint16_t version = 4;
+        static const size_t sizeVersion1 = 4 + 2 + 4096 + 32 * 8 + 2 + 2 + 16 * 2 + 16 * 2 + 2 + 2 + 1 + 1 + 2;
+        static const size_t sizeVersion2 = sizeVersion1 + 4 * 8;
+
+        template <typename Quirks>
+        static constexpr size_t Size(uint16_t stateVersion = version) {
+            // how many bytes a state for this kind of core takes (version 3 onwards)
+            typedef Chip8Core<Quirks> Core;
+            return 4 + 2 + 4 + 2 + Core::memorySize + Core::displayWords * 8 + 2 + 2 + 16 * (stateVersion >= 4 ? 1 : 2) + 16 * 2
+                + 2 + 2 + 1 + 1 + 2 + 4 * 8 + 1 + 1 + 16 + 16 + 1;
+        };
+
+        template <typename Quirks>
+        static void Write(const Chip8Core<Quirks>& chip8, unsigned char* out) {
+            // `out` must have room for Size<Quirks>() bytes. doesn't allocate so it's fine to call every frame
+            Writer writer{ out };
+            writer.Bytes("C8SS", 4);
+            writer.U16(version);
+            writer.U32(Chip8Core<Quirks>::memorySize);
+            writer.U16(Chip8Core<Quirks>::displayWords);
+            writer.Bytes(chip8.memory, sizeof(chip8.memory));
+            for (uint64_t row : chip8.display) {
+                writer.U64(row);
+            }
+            writer.U16(chip8.programCounter);
+            writer.U16(chip8.indexRegister);
+            writer.Bytes(chip8.vRegister, sizeof(chip8.vRegister));
+            for (unsigned short value : chip8.stack) {
+                writer.U16(value);
+            }
+            writer.U16(chip8.stackPointer);
+            writer.U16(chip8.currentOpcode);
+            writer.U8(chip8.delayTimer);
+            writer.U8(chip8.soundTimer);
+            writer.U16(chip8.GetKeyMask());
+            for (uint64_t word : chip8.rngState) {
+                writer.U64(word);
+            }
+            writer.U8(chip8.hires ? 1 : 0);
+            writer.U8(chip8.planeMask);
+            writer.Bytes(chip8.rplFlags, sizeof(chip8.rplFlags));
+            writer.Bytes(chip8.audioPattern, sizeof(chip8.audioPattern));
+            writer.U8(chip8.pitch);
+        };
+
+        template <typename Quirks>
+        static bool Read(Chip8Core<Quirks>& chip8, const unsigned char* in, size_t length) {
+            // returns false (and leaves the chip8 alone) if this isn't a savestate we understand
+            if (length < 6 || std::memcmp(in, "C8SS", 4) != 0) {
+                return false;
+            }
+            typedef Chip8Core<Quirks> Core;
+            Reader reader{ in + 4 };
+            uint16_t stateVersion = reader.U16();
+            if (stateVersion == 0 || stateVersion > version) {
+                return false;
+            }
+            if (stateVersion < 3) {
+                // the old layouts were only ever written by the plain 4 KB, 64 x 32 chip8
+                if (Core::memorySize != 4096 || Core::displayWords != 32
+                    || length < (stateVersion == 1 ? sizeVersion1 : sizeVersion2)) {
+                    return false;
+                }
+            }
+            else if (length < Size<Quirks>(stateVersion) || reader.U32() != Core::memorySize || reader.U16() != Core::displayWords) {
+                return false;
+            }
+            reader.Bytes(chip8.memory, sizeof(chip8.memory));
+            for (uint64_t& row : chip8.display) {
+                row = reader.U64();
+            }
+            chip8.programCounter = reader.U16();
+            chip8.indexRegister = reader.U16();
+            if (stateVersion >= 4) {
+                reader.Bytes(chip8.vRegister, sizeof(chip8.vRegister));
+            }
+            else {
+                // older states kept 16 bits, but only the bottom 8 ever meant anything
+                for (unsigned char& value : chip8.vRegister) {
+                    value = reader.U16() & 0xFF;
+                }
+            }
+            for (unsigned short& value : chip8.stack) {
+                value = reader.U16();
+            }
+            chip8.stackPointer = reader.U16() & 0xF; // it wraps round now, older versions could leave it one below zero
+            chip8.currentOpcode = reader.U16();
+            chip8.delayTimer = reader.U8();
+            chip8.soundTimer = reader.U8();
+            chip8.SetKeyMask(reader.U16());
+            if (stateVersion >= 2) {
+                // version 1 states came from before the chip8 had its own generator, so they just keep whatever it has now
+                for (uint64_t& word : chip8.rngState) {
+                    word = reader.U64();
+                }
+            }
+            if (stateVersion >= 3) {
+                chip8.hires = reader.U8() != 0;
+                chip8.planeMask = reader.U8();
+                reader.Bytes(chip8.rplFlags, sizeof(chip8.rplFlags));
+                reader.Bytes(chip8.audioPattern, sizeof(chip8.audioPattern));
+                chip8.pitch = reader.U8();
+            }
+
+            // all of memory just changed underneath anything that was caching decoded or translated code
+            chip8.InvalidateDecodeCache(0, sizeof(chip8.memory));
+            chip8.displayDirty = true;
+            return true;
+        };
+
+        template <typename Quirks>
+        static std::vector<unsigned char> Save(const Chip8Core<Quirks>& chip8) {
+            std::vector<unsigned char> state(Size<Quirks>());
+            Write(chip8, state.data());
+            return state;
+        };
+
+        template <typename Quirks>
+        static bool SaveToFile(const Chip8Core<Quirks>& chip8, const std::string& path) {
+            std::vector<unsigned char> state = Save(chip8);
+            std::ofstream file(path, std::ios::binary);
+            file.write(reinterpret_cast<const char*>(state.data()), state.size());
+            return file.good();
+        };
+
+        template <typename Quirks>
+        static bool LoadFromFile(Chip8Core<Quirks>& chip8, const std::string& path) {
+            std::ifstream file(path, std::ios::binary);
+            std::vector<unsigned char> state((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+            return Read(chip8, state.data(), state.size());
+        };
+
+    private:
+
+        struct Writer {
+            unsigned char* out;
+            void Bytes(const void* data, size_t length) { std::memcpy(out, data, length); out += length; }
+            void U8(uint8_t value) { *out++ = value; }
+            void U16(uint16_t value) { U8(value & 0xFF); U8(value >> 8); }
+            void U32(uint32_t value) { U16(value & 0xFFFF); U16(value >> 16); }
+            void U64(uint64_t value) { for (int i = 0; i < 8; i++) { U8((value >> (8 * i)) & 0xFF); } }
+        };
+
+        struct Reader {
+            const unsigned char* in;
+            void Bytes(void* data, size_t length) { std::memcpy(data, in, length); in += length; }
+            uint8_t U8() { return *in++; }
+            uint16_t U16() { uint16_t low = U8(); return low | (U8() << 8); }
+            uint32_t U32() { uint32_t low = U16(); return low | (static_cast<uint32_t>(U16()) << 16); }
+            uint64_t U64() { uint64_t value = 0; for (int i = 0; i < 8; i++) { value |= static_cast<uint64_t>(U8()) << (8 * i); } return value; }
+        };
+};
+
+/*
+    Rewind history. Keeps a savestate for every frame, but only the newest one in full: every older frame is stored as the
+    difference from the frame after it. The difference is the two states XORed together, which is almost all zeros from one
+    frame to the next, with the runs of zeros squashed down (run length encoding):
+
+        zero run length     varint
+        literal length      varint
+        literal bytes
+
+    repeated until the whole state is covered. A typical frame comes out at a few dozen bytes instead of 4.4 KB.
+
+    All of the memory is allocated up front: one byte arena that the deltas are written into round and round, and a ring of
+    records saying where each delta lives. When either fills up the oldest frames are dropped. The scratch buffers depend on how
+    big a state is, which depends on the core, so they're sized by the first Push. After that pushing and rewinding a frame
+    never touch the heap.
+*/
+class RewindBuffer
+{
+    struct Record {
+        size_t offset = 0;
+        size_t length = 0;
+    };
+
+    std::vector<unsigned char> arena;
+    std::vector<Record> records; // ring of deltas, oldest at recordStart
+    size_t recordStart = 0;
+    size_t recordCount = 0;
+    size_t writeOffset = 0; // where the next delta goes in the arena
+
+    std::vector<unsigned char> latest; // the newest frame in full
+    std::vector<unsigned char> current; // scratch for the frame being pushed or rebuilt
+    std::vector<unsigned char> encoded; // scratch for the encoded delta before it goes in the arena
+    size_t stateSize = 0; // savestate size of the core being pushed, 0 until the first Push
+    bool haveLatest = false;
+
+    public:
+
+        RewindBuffer(size_t arenaBytes = 4 << 20, size_t maxFrames = 60 * 60 * 10)
+            : arena(arenaBytes), records(maxFrames) {
+        };
+
+        size_t FrameCount() const {
+            return haveLatest ? recordCount + 1 : 0;
+        };
+
+        size_t BytesUsed() const {
+            size_t used = 0;
+            for (size_t i = 0; i < recordCount; i++) {
+                used += records[(recordStart + i) % records.size()].length;
+            }
+            return used;
+        };
+
+        template <typename Quirks>
+        void Push(const Chip8Core<Quirks>& chip8) {
+            // remember this frame. the previous newest frame becomes a delta against it
+            if (stateSize != Savestate::Size<Quirks>()) {
+                // first frame (or a different kind of core) so there's no history to keep
+                Clear();
+                stateSize = Savestate::Size<Quirks>();
+                latest.resize(stateSize);
+                current.resize(stateSize);
+                // worst case is every other byte changing: a two byte run header for every literal byte (and 16 spare)
+                encoded.resize(3 * stateSize + 16);
+            }
+            Savestate::Write(chip8, current.data());
+            if (haveLatest) {
+                size_t length = Encode(latest.data(), current.data());
+                Store(length);
+            }
+            std::swap(latest, current);
+            haveLatest = true;
+        };
+
+        template <typename Quirks>
+        bool Rewind(Chip8Core<Quirks>& chip8) {
+            // step back one frame: the chip8 is put back how it was when the frame before the newest one was pushed,
+            // and that frame becomes the newest. returns false if there's nothing older to go back to
+            if (!haveLatest || recordCount == 0) {
+                return false;
+            }
+            size_t newest = (recordStart + recordCount - 1) % records.size();
+            Decode(arena.data() + records[newest].offset, records[newest].length, latest.data());
+            recordCount--;
+            writeOffset = records[newest].offset;
+            return Savestate::Read(chip8, latest.data(), latest.size());
+        };
+
+        void Clear() {
+            recordStart = 0;
+            recordCount = 0;
+            writeOffset = 0;
+            haveLatest = false;
+        };
+
+    private:
+
+        size_t Encode(const unsigned char* previous, const unsigned char* next) {
+            // XOR the two states and run length encode the result into `encoded`
+            size_t in = 0;
+            size_t out = 0;
+            const size_t length = stateSize;
+            while (in < length) {
+                size_t zeros = 0;
+                while (in + zeros < length && previous[in + zeros] == next[in + zeros]) {
+                    zeros++;
+                }
+                in += zeros;
+                size_t literals = 0;
+                while (in + literals < length && previous[in + literals] != next[in + literals]) {
+                    literals++;
+                }
+                out += PutVarint(encoded.data() + out, zeros);
+                out += PutVarint(encoded.data() + out, literals);
+                for (size_t i = 0; i < literals; i++) {
+                    encoded[out++] = previous[in + i] ^ next[in + i];
+                }
+                in += literals;
+            }
+            return out;
+        };
+
+        static void Decode(const unsigned char* delta, size_t deltaLength, unsigned char* state) {
+            // XOR a delta back into a state, turning the newer frame into the older one in place
+            size_t in = 0;
+            size_t position = 0;
+            while (in < deltaLength) {
+                position += GetVarint(delta, in);
+                size_t literals = GetVarint(delta, in);
+                for (size_t i = 0; i < literals; i++) {
+                    state[position++] ^= delta[in++];
+                }
+            }
+        };
+
+        void Store(size_t length) {
+            // copy the encoded delta into the arena, wrapping round to the start and dropping the oldest frames as needed
+            if (length > arena.size()) {
+                Clear();
+                return;
+            }
+            if (writeOffset + length > arena.size()) {
+                // the end of the arena gets skipped this time round, so anything still in it from the last time round is
+                // the oldest there is and goes first. otherwise it stays "oldest" while the newer frames at the start
+                // get written over underneath it
+                while (recordCount > 0 && records[recordStart].offset >= writeOffset) {
+                    recordStart = (recordStart + 1) % records.size();
+                    recordCount--;
+                }
+                writeOffset = 0;
+            }
+            // the frames left are in arena order from here on, so it's always the oldest one this can run into.
+            // drop anything old that overlaps where this one is going, and the oldest frame if the record ring is full
+            while (recordCount > 0) {
+                const Record& oldest = records[recordStart];
+                bool overlaps = oldest.offset < writeOffset + length && writeOffset < oldest.offset + oldest.length;
+                if (!overlaps && recordCount < records.size()) {
+                    break;
+                }
+                recordStart = (recordStart + 1) % records.size();
+                recordCount--;
+            }
+            std::memcpy(arena.data() + writeOffset, encoded.data(), length);
+            Record& record = records[(recordStart + recordCount) % records.size()];
+            record.offset = writeOffset;
+            record.length = length;
+            recordCount++;
+            writeOffset += length;
+        };
+
+        static size_t PutVarint(unsigned char* out, size_t value) {
+            size_t written = 0;
+            while (value >= 0x80) {
+                out[written++] = (value & 0x7F) | 0x80;
+                value >>= 7;
+            }
+            out[written++] = value;
+            return written;
+        };
+
+        static size_t GetVarint(const unsigned char* in, size_t& position) {
+            size_t value = 0;
+            int shift = 0;
+            while (in[position] & 0x80) {
+                value |= static_cast<size_t>(in[position++] & 0x7F) << shift;
+                shift += 7;
+            }
+            value |= static_cast<size_t>(in[position++]) << shift;
+            return value;
+        };
+};
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <chrono>
+#include <thread>
+#include <cmath>
+#include <algorithm>
+#include <iostream>
+
+/*
+    Keeps the emulator running at the chip8's real speed.
+
+    The chip8 timers count down at 60 Hz so everything is done in 60 Hz frames: each frame the caller runs a fixed number of
+    instructions, ticks the timers once and draws, then asks the scheduler to wait. The scheduler sleeps (rather than spinning)
+    until the next frame is due, using steady_clock so the deadlines don't drift the way adding up millisecond deltas did.
+
+    It also keeps track of how long the frames actually took so we can see how steady the timing is.
+*/
+class FrameScheduler
+{
+    typedef std::chrono::steady_clock Clock;
+
+    Clock::duration framePeriod = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / 60.0));
+    Clock::time_point nextFrame;
+    Clock::time_point lastFrame;
+    bool started = false;
+
+    // running frame time statistics (Welford's method so we don't have to keep every sample)
+    unsigned long long frameCount = 0;
+    unsigned long long lateFrames = 0;
+    double meanMs = 0;
+    double m2 = 0;
+    double minMs = 0;
+    double maxMs = 0;
+
+    public:
+
+        struct Stats {
+            unsigned long long frames = 0;
+            unsigned long long lateFrames = 0; // frames where we missed the deadline by more than a whole frame
+            double meanMs = 0; // average time from one frame to the next
+            double minMs = 0;
+            double maxMs = 0;
+            double jitterMs = 0; // standard deviation of the frame time
+        };
+
+        void Start() {
+            lastFrame = Clock::now();
+            nextFrame = lastFrame + framePeriod;
+            started = true;
+        };
+
+        void WaitForNextFrame() {
+            // sleep until the next frame is due and record how long this one really took
+            if (!started) {
+                Start();
+            }
+
+            Clock::time_point now = Clock::now();
+            if (now < nextFrame) {
+                std::this_thread::sleep_until(nextFrame);
+                now = Clock::now();
+                nextFrame += framePeriod;
+            }
+            else if (now - nextFrame > framePeriod) {
+                // we've fallen more than a frame behind (the window got dragged, the machine was busy...). don't try to
+                // catch up with a burst of frames, just start counting again from now
+                lateFrames++;
+                nextFrame = now + framePeriod;
+            }
+            else {
+                nextFrame += framePeriod;
+            }
+
+            RecordFrame(std::chrono::duration<double, std::milli>(now - lastFrame).count());
+            lastFrame = now;
+        };
+
+        void FrameFinished() {
+            // for when something else decides when frames happen (the audio device does with --audio-sync).
+            // doesn't wait at all, just records how long this frame took
+            if (!started) {
+                Start();
+            }
+            Clock::time_point now = Clock::now();
+            RecordFrame(std::chrono::duration<double, std::milli>(now - lastFrame).count());
+            lastFrame = now;
+            nextFrame = now + framePeriod;
+        };
+
+        Stats GetStats() const {
+            Stats stats;
+            stats.frames = frameCount;
+            stats.lateFrames = lateFrames;
+            stats.meanMs = meanMs;
+            stats.minMs = minMs;
+            stats.maxMs = maxMs;
+            stats.jitterMs = (frameCount > 1) ? std::sqrt(m2 / (frameCount - 1)) : 0;
+            return stats;
+        };
+
+        void PrintStats() const {
+            Stats stats = GetStats();
+            std::cout << "frames: " << stats.frames << " (" << stats.lateFrames << " late)"
+                      << ", frame time mean " << stats.meanMs << " ms, min " << stats.minMs << " ms, max " << stats.maxMs
+                      << " ms, jitter " << stats.jitterMs << " ms" << std::endl;
+        };
+
+    private:
+
+        void RecordFrame(double ms) {
+            frameCount++;
+            if (frameCount == 1) {
+                minMs = ms;
+                maxMs = ms;
+            }
+            minMs = std::min(minMs, ms);
+            maxMs = std::max(maxMs, ms);
+            double delta = ms - meanMs;
+            meanMs += delta / frameCount;
+            m2 += delta * (ms - meanMs);
+        };
+};
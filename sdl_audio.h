@@ -0,0 +1,215 @@
+#pragma once
+
+#include <SDL2/SDL.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+
+#include "chip8.h"
+
+/*
+    The chip8's buzzer, through an SDL audio device. SDL calls Fill on its own audio thread whenever it wants more samples and
+    we work them out right there: a square wave while the sound timer is running, or on XO-CHIP the program's own 128 sample
+    pattern (F002) played at its pitch (Fx3A) once it has set one.
+
+    The chip8 thread tells the audio thread what to play once a frame (PublishFrame) and the two only share atomics, so
+    neither ever waits on a lock. The sound of each frame goes into a little ring of the last few frames, tagged by frame
+    number, so the audio thread can play each frame's sound for exactly its 1/60th of a second of samples instead of
+    whatever happens to be newest. The pattern itself changes so rarely it's just the latest one (a pattern that changes
+    halfway through a buffer just starts a buffer early).
+
+    Normally the chip8 keeps time with the FrameScheduler and the audio just follows along. The two clocks never quite agree
+    though, so over a long session the audio either runs dry (a crackle) or falls further and further behind. With `synced`
+    (--audio-sync) the audio device is the clock instead: WaitForAudio holds the chip8 back until the device has played all
+    but the last buffer's worth of the frames it has run, so the two can't drift apart.
+
+    Turning the buzzer on and off fades over a couple of milliseconds, which is what stops it clicking.
+*/
+class SdlAudio
+{
+    public:
+
+        unsigned int toneHz = 440; // pitch of the plain buzzer
+        int volume = 3000; // out of 32767
+
+        SdlAudio() {
+            for (std::atomic<uint16_t>& sound : frameSound) {
+                sound.store(0, std::memory_order_relaxed);
+            }
+            for (std::atomic<uint32_t>& word : pattern) {
+                word.store(0, std::memory_order_relaxed);
+            }
+        };
+
+        SdlAudio(const SdlAudio&) = delete;
+        SdlAudio& operator=(const SdlAudio&) = delete;
+
+        ~SdlAudio() {
+            Close();
+        };
+
+        bool Open(unsigned int bufferSamples, bool syncToAudio) {
+            // bufferSamples is how many samples SDL asks for at once, which is most of the latency: 512 at 48 kHz is about 11 ms.
+            // false (and no sound, and the scheduler keeps time) if there's no audio device
+            if (SDL_InitSubSystem(SDL_INIT_AUDIO) != 0) {
+                std::cerr << "no audio: " << SDL_GetError() << std::endl;
+                return false;
+            }
+            SDL_AudioSpec wanted = {};
+            wanted.freq = 48000;
+            wanted.format = AUDIO_S16SYS;
+            wanted.channels = 1;
+            wanted.samples = static_cast<Uint16>(bufferSamples);
+            wanted.callback = Fill;
+            wanted.userdata = this;
+            SDL_AudioSpec obtained = {};
+            device = SDL_OpenAudioDevice(nullptr, 0, &wanted, &obtained, 0);
+            if (device == 0) {
+                std::cerr << "no audio: " << SDL_GetError() << std::endl;
+                return false;
+            }
+            // we asked for 16 bit mono and SDL converts if the device wants something else, only the rate and size can change
+            sampleRate = obtained.freq;
+            bufferLength = obtained.samples;
+            synced = syncToAudio;
+            // far enough ahead that a whole buffer's worth of frames is always ready, plus one being worked on
+            leadFrames = 1 + (bufferLength * 60 + sampleRate - 1) / sampleRate;
+            SDL_PauseAudioDevice(device, 0);
+            return true;
+        };
+
+        void Close() {
+            if (device != 0) {
+                SDL_CloseAudioDevice(device);
+                device = 0;
+            }
+        };
+
+        bool IsOpen() const {
+            return device != 0;
+        };
+
+        bool IsSynced() const {
+            return device != 0 && synced;
+        };
+
+        template <typename Quirks>
+        void PublishFrame(const Chip8Core<Quirks>& chip8) {
+            // chip8 thread, once at the end of every frame (rewound ones too, time still moves forward for the speaker)
+            uint16_t sound = (chip8.GetSoundTimer() > 0 ? soundOnBit : 0) | chip8.GetPitch();
+            if constexpr (Quirks::hasXoChip) {
+                const unsigned char* bytes = chip8.GetAudioPattern();
+                bool anyPattern = false;
+                for (int word = 0; word < 4; word++) {
+                    uint32_t value = static_cast<uint32_t>(bytes[word * 4]) << 24 | bytes[word * 4 + 1] << 16 | bytes[word * 4 + 2] << 8 | bytes[word * 4 + 3];
+                    pattern[word].store(value, std::memory_order_relaxed);
+                    anyPattern = anyPattern || value != 0;
+                }
+                // an empty pattern would be silence, so until the program sets one it gets the plain buzzer like everyone else
+                sound |= anyPattern ? patternBit : 0;
+            }
+            uint64_t frame = framesPublished.load(std::memory_order_relaxed);
+            frameSound[frame % historyLength].store(sound, std::memory_order_relaxed);
+            framesPublished.store(frame + 1, std::memory_order_release);
+        };
+
+        void WaitForAudio() {
+            // chip8 thread, with --audio-sync, instead of the scheduler. returns once the device has played all but leadFrames
+            // of the frames published. gives up after a tenth of a second so a stalled device can't freeze the game
+            uint64_t published = framesPublished.load(std::memory_order_relaxed);
+            uint64_t speakerFrame = samplesPlayed.load(std::memory_order_acquire) * 60 / sampleRate;
+            if (speakerFrame > published + 2) {
+                // the chip8 has fallen behind the speaker (the machine was busy, or it's only just started). like the scheduler,
+                // don't race through the missed frames to catch up, carry the current sound on up to where the speaker is now
+                uint16_t sound = (published > 0) ? frameSound[(published - 1) % historyLength].load(std::memory_order_relaxed) : 0;
+                for (; published < speakerFrame + leadFrames; published++) {
+                    frameSound[published % historyLength].store(sound, std::memory_order_relaxed);
+                }
+                framesPublished.store(published, std::memory_order_release);
+                return;
+            }
+            if (published <= leadFrames) {
+                return;
+            }
+            uint64_t samplesWanted = (published - leadFrames) * sampleRate / 60;
+            auto giveUp = std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
+            while (samplesPlayed.load(std::memory_order_acquire) < samplesWanted && std::chrono::steady_clock::now() < giveUp) {
+                // the callback can't signal anything without a lock, so check back often. a millisecond is well under a frame
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        };
+
+    private:
+
+        static constexpr unsigned int historyLength = 64; // frames of sound kept, over a second
+        static constexpr uint16_t soundOnBit = 0x100;
+        static constexpr uint16_t patternBit = 0x200;
+
+        SDL_AudioDeviceID device = 0;
+        int sampleRate = 48000;
+        unsigned int bufferLength = 512;
+        unsigned int leadFrames = 2;
+        bool synced = false;
+
+        // written by the chip8 thread, read by the audio thread
+        std::atomic<uint16_t> frameSound[historyLength]; // soundOnBit, patternBit and the pitch in the low byte
+        std::atomic<uint64_t> framesPublished{ 0 };
+        std::atomic<uint32_t> pattern[4]; // the 128 pattern samples, the first in the top bit of the first word
+
+        // written by the audio thread, read by the chip8 thread
+        std::atomic<uint64_t> samplesPlayed{ 0 };
+
+        // only touched by the audio thread
+        double squarePhase = 0; // how far through one cycle of the buzzer, 0 to 1
+        double patternPosition = 0; // which of the 128 pattern samples we're on, with the fraction
+        float level = 0; // fades between 0 and 1 when the sound goes on or off
+
+        static void Fill(void* userdata, Uint8* stream, int length) {
+            static_cast<SdlAudio*>(userdata)->Fill(reinterpret_cast<int16_t*>(stream), length / sizeof(int16_t));
+        };
+
+        void Fill(int16_t* out, unsigned int count) {
+            uint64_t published = framesPublished.load(std::memory_order_acquire);
+            uint64_t played = samplesPlayed.load(std::memory_order_relaxed);
+            const float fadeStep = 1.0f / (0.002f * sampleRate);
+            for (unsigned int i = 0; i < count; i++) {
+                uint16_t sound = SoundAt(played + i, published);
+                float target = (sound & soundOnBit) ? 1.0f : 0.0f;
+                level = (level < target) ? std::min(target, level + fadeStep) : std::max(target, level - fadeStep);
+
+                float value = 0;
+                if (sound & patternBit) {
+                    // 4000 samples a second at pitch 64, an octave up or down for every 48 either side
+                    double patternRate = 4000.0 * std::pow(2.0, ((sound & 0xFF) - 64) / 48.0);
+                    unsigned int bit = static_cast<unsigned int>(patternPosition) % 128;
+                    value = ((pattern[bit / 32].load(std::memory_order_relaxed) >> (31 - bit % 32)) & 0x1) ? 1.0f : -1.0f;
+                    patternPosition = std::fmod(patternPosition + patternRate / sampleRate, 128.0);
+                }
+                else {
+                    value = (squarePhase < 0.5) ? 1.0f : -1.0f;
+                    squarePhase = std::fmod(squarePhase + static_cast<double>(toneHz) / sampleRate, 1.0);
+                }
+                out[i] = static_cast<int16_t>(value * level * volume);
+            }
+            samplesPlayed.store(played + count, std::memory_order_release);
+        };
+
+        uint16_t SoundAt(uint64_t sample, uint64_t published) const {
+            // synced, each sample belongs to one frame and plays that frame's sound. otherwise (or if the chip8 has fallen
+            // behind, or so far ahead that frame is gone from the ring) the newest frame there is
+            if (published == 0) {
+                return 0;
+            }
+            uint64_t frame = published - 1;
+            if (synced) {
+                uint64_t sampleFrame = sample * 60 / sampleRate;
+                if (sampleFrame < published && published - sampleFrame < historyLength) {
+                    frame = sampleFrame;
+                }
+            }
+            return frameSound[frame % historyLength].load(std::memory_order_relaxed);
+        };
+};
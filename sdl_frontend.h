@@ -0,0 +1,310 @@
+#pragma once
+
+#include <SDL2/SDL.h>
+#include <iostream>
+#include <thread>
+#include <atomic>
+
+#include "chip8.h"
+#include "framebuffer.h"
+#include "scheduler.h"
+#include "savestate.h"
+#include "inputlog.h"
+#include "sdl_audio.h"
+
+/*
+    The interactive frontend. This owns the window, the renderer and the keyboard and drives a Chip8 core in real time.
+    All of the SDL bits that used to live inside the Chip8 class live here now so the core can be built without SDL at all.
+
+    It runs on two threads. The chip8 gets a thread of its own that does nothing but run frames on time, and the thread that
+    called Run looks after the window: reading the keyboard and putting frames on the screen. That way a slow present
+    (waiting for vsync, the compositor having a moment) can't make the game run slow or stutter. The two only talk through
+    atomics and a triple buffer so neither ever waits for the other:
+
+        window thread -> chip8 thread: which keys are held, plus requests to rewind, save and load
+        chip8 thread -> window thread: the display, every time it changes
+*/
+class SdlFrontend
+{
+    SDL_Window* window = nullptr; // window to draw to
+    SDL_Renderer* renderer = nullptr; // renderer to draw with
+
+    /*
+        The whole display lives in one streaming texture. Each frame that something changed we unpack the display
+        straight into it in one lock/copy and let the renderer scale it up to the window, instead of drawing every pixel as a point.
+        The texture is big enough for the 128 x 64 SUPER-CHIP screen and the 64 x 32 one just uses the top left corner of it.
+    */
+    SDL_Texture* texture = nullptr;
+
+    // set when the window needs repainting even though the chip8 display didn't change (it got uncovered or resized for example)
+    bool forceRedraw = true;
+
+    // the display as it was at the end of a chip8 frame, passed from the chip8 thread to the window thread.
+    // big enough for the biggest display there is (two planes of 128 x 64)
+    struct Frame {
+        uint64_t words[2 * 64 * 2] = { 0 };
+        unsigned int width = 64;
+        unsigned int height = 32;
+        unsigned int planes = 1;
+    };
+    TripleBuffer<Frame> frames;
+
+    // set by the window thread, picked up by the chip8 thread at the start of every frame
+    std::atomic<uint16_t> heldKeys{ 0 };
+    std::atomic<bool> running{ false };
+    std::atomic<bool> rewinding{ false };
+    std::atomic<bool> saveRequested{ false };
+    std::atomic<bool> loadRequested{ false };
+
+    // everything from here down belongs to the chip8 thread while it's running
+
+    // every frame goes into the rewind history. holding backspace plays it backwards. F5 saves a state, F9 loads it back
+    RewindBuffer rewind;
+    std::string quickSavePath; // next to the ROM, see SetQuickSavePath
+
+    // when recording, the keys held every frame go in here so the run can be replayed headless later (see InputLog)
+    InputLog* recording = nullptr;
+    uint64_t frame = 0; // frames run so far, which goes backwards while rewinding
+
+    FrameScheduler emulationScheduler;
+
+    // the buzzer. with --audio-sync it's also what decides when the next frame runs instead of emulationScheduler
+    SdlAudio audio;
+
+    public:
+
+        ~SdlFrontend() {
+            audio.Close();
+            if (texture != nullptr) {
+                SDL_DestroyTexture(texture);
+            }
+            if (renderer != nullptr) {
+                SDL_DestroyRenderer(renderer);
+            }
+            if (window != nullptr) {
+                SDL_DestroyWindow(window);
+            }
+            SDL_Quit();
+        };
+
+        void InitialiseGraphics() {
+            // draw empty display to the screen            
+            // initialise graphics and events
+            SDL_Init(SDL_INIT_VIDEO | SDL_INIT_EVENTS);
+            SDL_CreateWindowAndRenderer(64 * 10, 32 * 10, 0, &window, &renderer);
+            // draw everything at the chip8's own resolution and let the renderer scale it to fit the window
+            SDL_RenderSetLogicalSize(renderer, 128, 64);
+            texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, 128, 64);
+
+            // set draw color to black to clear screen
+            SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+            SDL_RenderClear(renderer);
+        };
+
+        void InitialiseAudio(unsigned int bufferSamples, bool syncToAudio) {
+            // optional, without it there's just no sound. if there's no audio device the game still runs (silently, on the scheduler)
+            audio.Open(bufferSamples, syncToAudio);
+        };
+
+        void SetQuickSavePath(const std::string& path) {
+            // where F5 saves and F9 loads. each ROM gets its own (<rom>.c8s) so they don't end up wherever it was run from
+            quickSavePath = path;
+        };
+
+        template <typename Quirks>
+        void Run(Chip8Core<Quirks>& chip8, unsigned int instructionsPerFrame, InputLog* inputLog = nullptr) {
+            // start the chip8 on its own thread then look after the window until it gets closed.
+            // the chip8 belongs to the other thread until Run returns so nothing in here touches it
+            recording = inputLog;
+            frame = 0;
+            heldKeys = chip8.GetKeyMask();
+            Publish(chip8);
+            running = true;
+            std::thread emulation([this, &chip8, instructionsPerFrame]() { Emulate(chip8, instructionsPerFrame); });
+
+            // there's no point drawing faster than the chip8 makes frames, so the window side runs at 60 Hz too
+            FrameScheduler presentationScheduler;
+            presentationScheduler.Start();
+            while (HandleInput()) {
+                DrawGraphics();
+                presentationScheduler.WaitForNextFrame();
+            }
+            running = false;
+            emulation.join();
+
+            std::cout << "emulation ";
+            emulationScheduler.PrintStats();
+            std::cout << "presentation ";
+            presentationScheduler.PrintStats();
+        };
+
+    private:
+
+        template <typename Quirks>
+        void Emulate(Chip8Core<Quirks>& chip8, unsigned int instructionsPerFrame) {
+            // the chip8 thread. everything happens in 60 Hz frames: pick up the keys, run this frame's worth of instructions,
+            // tick the timers once, hand the display over if it changed and then sleep until the next frame is due
+            emulationScheduler.Start();
+            rewind.Push(chip8);
+            while (running) {
+                HandleRequests(chip8);
+                if (rewinding) {
+                    // go back a frame instead of forward. once we run out of history we just sit on the oldest frame
+                    if (rewind.Rewind(chip8) && frame > 0) {
+                        frame--;
+                        if (recording != nullptr) {
+                            recording->RewindTo(frame);
+                        }
+                    }
+                }
+                else {
+                    // the keys only change on a frame boundary, which is what makes a recording replay exactly
+                    chip8.SetKeyMask(heldKeys);
+                    if (recording != nullptr) {
+                        recording->Record(frame, chip8.GetKeyMask());
+                    }
+                    frame++;
+                    chip8.RunFor(instructionsPerFrame);
+                    chip8.TickTimers();
+                    rewind.Push(chip8);
+                }
+                if (chip8.TakeDisplayDirty()) {
+                    Publish(chip8);
+                }
+                audio.PublishFrame(chip8);
+                if (audio.IsSynced()) {
+                    audio.WaitForAudio();
+                    emulationScheduler.FrameFinished();
+                }
+                else {
+                    emulationScheduler.WaitForNextFrame();
+                }
+            }
+        };
+
+        template <typename Quirks>
+        void HandleRequests(Chip8Core<Quirks>& chip8) {
+            // savestates asked for by the window thread since the last frame
+            if (saveRequested.exchange(false)) {
+                Savestate::SaveToFile(chip8, quickSavePath);
+            }
+            if (loadRequested.exchange(false)) {
+                if (recording != nullptr) {
+                    // a replay always starts from the beginning of the program, so it can't follow a jump to a savestate
+                    std::cerr << "can't load a savestate while recording input" << std::endl;
+                }
+                else if (Savestate::LoadFromFile(chip8, quickSavePath)) {
+                    // the history doesn't lead to this state any more
+                    rewind.Clear();
+                    rewind.Push(chip8);
+                }
+            }
+        };
+
+        template <typename Quirks>
+        void Publish(const Chip8Core<Quirks>& chip8) {
+            typedef Chip8Core<Quirks> Core;
+            static_assert(Core::displayWords <= sizeof(Frame::words) / sizeof(uint64_t), "Frame is too small for this display");
+            Frame& out = frames.WriteBuffer();
+            std::copy(chip8.GetDisplay(), chip8.GetDisplay() + Core::displayWords, out.words);
+            out.width = Core::displayWidth;
+            out.height = Core::displayHeight;
+            out.planes = Core::displayPlanes;
+            frames.Publish();
+        };
+
+        void SetHeldKey(unsigned char keyIndex, bool isPressed) {
+            uint16_t bit = 1 << keyIndex;
+            if (isPressed) {
+                heldKeys.fetch_or(bit);
+            }
+            else {
+                heldKeys.fetch_and(~bit);
+            }
+        };
+
+        bool HandleInput() {
+            // returns false once the window has been closed so the caller can stop
+            SDL_Event event;
+            while (SDL_PollEvent(&event)) {
+                if (event.type == SDL_QUIT) {
+                    return false;
+                }
+                else if (event.type == SDL_WINDOWEVENT) {
+                    // whatever was on screen might be gone so paint it again next frame
+                    forceRedraw = true;
+                }
+                else if (event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) {
+                    bool isPressed = (event.type == SDL_KEYDOWN);
+                    switch (event.key.keysym.sym) {
+                                    case SDLK_BACKSPACE: rewinding = isPressed; break;
+                                    case SDLK_F5:
+                                        if (isPressed) {
+                                            saveRequested = true;
+                                        }
+                                        break;
+                                    case SDLK_F9:
+                                        if (isPressed) {
+                                            loadRequested = true;
+                                        }
+                                        break;
+                                    case SDLK_1: SetHeldKey(0x1, isPressed); break;
+                                    case SDLK_2: SetHeldKey(0x2, isPressed); break;
+                                    case SDLK_3: SetHeldKey(0x3, isPressed); break;
+                                    case SDLK_4: SetHeldKey(0xC, isPressed); break;
+                                    case SDLK_q: SetHeldKey(0x4, isPressed); break;
+                                    case SDLK_w: SetHeldKey(0x5, isPressed); break;
+                                    case SDLK_e: SetHeldKey(0x6, isPressed); break;
+                                    case SDLK_r: SetHeldKey(0xD, isPressed); break;
+                                    case SDLK_a: SetHeldKey(0x7, isPressed); break;
+                                    case SDLK_s: SetHeldKey(0x8, isPressed); break;
+                                    case SDLK_d: SetHeldKey(0x9, isPressed); break;
+                                    case SDLK_f: SetHeldKey(0xE, isPressed); break;
+                                    case SDLK_z: SetHeldKey(0xA, isPressed); break;
+                                    case SDLK_x: SetHeldKey(0x0, isPressed); break;
+                                    case SDLK_c: SetHeldKey(0xB, isPressed); break;
+                                    case SDLK_v: SetHeldKey(0xF, isPressed); break;
+                    }
+                }
+#ifdef CHIP8_INSTRUMENT
+                if (event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) {
+                    // debug print the current key status, only in instrumented builds and only when a key changes
+                    char output[17];
+                    uint16_t held = heldKeys;
+                    for (int i = 0; i < 16; i++) {
+                        output[i] = ((held >> i) & 0x1) ? '1' : '0';
+                    }
+                    output[16] = '\0'; // null terminate the string so we don't get random crap   
+                    std::cerr << output << '\n';
+                }
+#endif
+            }
+            return true;
+        }
+
+        void DrawGraphics() {
+            // if the chip8 thread hasn't handed over a new frame there is nothing to upload and nothing new to present,
+            // which is most frames for most games
+            bool fresh = frames.Consume();
+            if (!fresh && !forceRedraw) {
+                return;
+            }
+            forceRedraw = false;
+
+            // copy the display into the texture a row at a time (the texture rows might be padded so go by pitch)
+            void* pixels = nullptr;
+            int pitch = 0;
+            const Frame& shown = frames.ReadBuffer();
+            if (SDL_LockTexture(texture, nullptr, &pixels, &pitch) == 0) {
+                UnpackFrame(shown.words, shown.width, shown.height, shown.planes, static_cast<uint32_t*>(pixels), pitch / 4, displayPalette);
+                SDL_UnlockTexture(texture);
+            }
+
+            // only the part of the texture the display filled, stretched over the whole window
+            SDL_Rect source = { 0, 0, static_cast<int>(shown.width), static_cast<int>(shown.height) };
+            SDL_RenderClear(renderer);
+            SDL_RenderCopy(renderer, texture, &source, nullptr);
+            SDL_RenderPresent(renderer);
+        };
+
+};
@@ -0,0 +1,367 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <filesystem>
+#include <algorithm>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <csignal>
+#endif
+
+#include "chip8.h"
+#include "framebuffer.h"
+
+/*
+    Writes the display out as video with no window, for recording attract mode demos and for comparing runs on machines
+    with no screen. Two formats:
+
+        Y4M  one uncompressed stream (4:4:4, 60 fps) to a file, a named pipe or stdout, which ffmpeg reads as it is
+        PNG  one numbered file a frame in a directory (frame_000000.png, frame_000001.png, ...), for image diffing
+
+    There's one video frame per 60 Hz chip8 frame, so the video runs at the speed the game would have. The colours are the
+    same as the window's (see displayPalette) and the size is the chip8's own, scale it up afterwards if you want.
+
+    All the encoding and writing happens on a thread of its own. Once a frame all the chip8 side does is copy the packed
+    display (2 KB at most) onto a queue, and if nothing was drawn it doesn't even do that, it just adds one to the repeat count
+    of the last frame queued. The writer puts a repeated frame out again from the bytes it already made for it instead of
+    unpacking and encoding it again. The queue is bounded so a slow disk or a full pipe can't use up all the memory: if the
+    writer gets `queueLimit` frames behind, Submit waits for it (which gets counted) rather than dropping frames from the video.
+*/
+class VideoWriter
+{
+    public:
+
+        enum class Format { Y4m, PngSequence };
+
+        // frames the chip8 can get ahead of the writer before it has to wait for it
+        size_t queueLimit = 256;
+
+        VideoWriter() = default;
+        VideoWriter(const VideoWriter&) = delete;
+        VideoWriter& operator=(const VideoWriter&) = delete;
+
+        ~VideoWriter() {
+            Close();
+        };
+
+        template <typename Quirks>
+        bool Open(Format outputFormat, const std::string& outputPath) {
+            // path is a file or pipe for Y4M ("-" is stdout) and a directory for PNG. false if it can't be opened
+            typedef Chip8Core<Quirks> Core;
+            static_assert(Core::displayWords <= maxWords, "QueuedFrame is too small for this display");
+            format = outputFormat;
+            path = outputPath;
+            width = Core::displayWidth;
+            height = Core::displayHeight;
+            planes = Core::displayPlanes;
+            words = Core::displayWords;
+
+#if defined(__unix__) || defined(__APPLE__)
+            // if whatever is reading the pipe goes away we want a failed write, not to be killed
+            std::signal(SIGPIPE, SIG_IGN);
+#endif
+            if (format == Format::Y4m) {
+                file = (path == "-") ? stdout : std::fopen(path.c_str(), "wb");
+                if (file == nullptr) {
+                    return false;
+                }
+                std::string header = "YUV4MPEG2 W" + std::to_string(width) + " H" + std::to_string(height) + " F60:1 Ip A1:1 C444\n";
+                Write(header.data(), header.size());
+            }
+            else {
+                std::error_code error;
+                std::filesystem::create_directories(path, error);
+                if (!std::filesystem::is_directory(path, error)) {
+                    return false;
+                }
+            }
+            writer = std::thread([this]() { WriterLoop(); });
+            return true;
+        };
+
+        template <typename Quirks>
+        void Submit(Chip8Core<Quirks>& chip8) {
+            // call once at the end of every chip8 frame
+            bool changed = chip8.TakeDisplayDirty() || !anySubmitted;
+            anySubmitted = true;
+            std::unique_lock<std::mutex> lock(queueLock);
+            if (!changed) {
+                // the same picture again. tack it on to whatever is waiting, or queue a repeat of what went out last
+                if (queue.empty()) {
+                    queue.emplace_back();
+                    queue.back().repeatOnly = true;
+                }
+                queue.back().repeats++;
+                wake.notify_one();
+                return;
+            }
+            if (queue.size() >= queueLimit) {
+                waits++;
+                room.wait(lock, [this]() { return queue.size() < queueLimit; });
+            }
+            queue.emplace_back();
+            std::copy(chip8.GetDisplay(), chip8.GetDisplay() + words, queue.back().words);
+            wake.notify_one();
+        };
+
+        bool Close() {
+            // writes out everything still queued and finishes the file. false if anything couldn't be written
+            if (writer.joinable()) {
+                {
+                    std::lock_guard<std::mutex> guard(queueLock);
+                    closing = true;
+                }
+                wake.notify_one();
+                writer.join();
+            }
+            if (file != nullptr) {
+                if (std::fflush(file) != 0) {
+                    failed = true;
+                }
+                if (file != stdout) {
+                    std::fclose(file);
+                }
+                file = nullptr;
+            }
+            return !failed;
+        };
+
+        unsigned long long FramesWritten() const {
+            return framesWritten;
+        };
+
+        unsigned long long RepeatsWritten() const {
+            // how many of FramesWritten were repeats of the frame before
+            return repeatsWritten;
+        };
+
+        unsigned long long Waits() const {
+            // how many times the chip8 had to wait for the writer to catch up
+            return waits;
+        };
+
+    private:
+
+        static constexpr unsigned int maxWords = 2 * 64 * 2; // two planes of 128 x 64
+
+        struct QueuedFrame {
+            uint64_t words[maxWords];
+            bool repeatOnly = false; // no picture of its own, just more repeats of the last one
+            unsigned int repeats = 0; // times it shows again after the first
+        };
+
+        Format format = Format::Y4m;
+        std::string path;
+        unsigned int width = 64;
+        unsigned int height = 32;
+        unsigned int planes = 1;
+        unsigned int words = 32;
+
+        // only touched by the chip8 thread
+        bool anySubmitted = false;
+        unsigned long long waits = 0;
+
+        std::mutex queueLock;
+        std::condition_variable wake; // the writer waits on this for frames
+        std::condition_variable room; // the chip8 waits on this when the queue is full
+        std::deque<QueuedFrame> queue;
+        bool closing = false;
+        std::thread writer;
+
+        // only touched by the writer thread (and by Close once it has finished)
+        std::FILE* file = nullptr;
+        bool failed = false;
+        std::vector<unsigned char> encoded; // the last frame ready to go, for repeating
+        unsigned long long framesWritten = 0;
+        unsigned long long repeatsWritten = 0;
+
+        void WriterLoop() {
+            std::unique_lock<std::mutex> lock(queueLock);
+            while (true) {
+                wake.wait(lock, [this]() { return !queue.empty() || closing; });
+                if (queue.empty()) {
+                    return;
+                }
+                // take the frame and let go of the lock while encoding it, so the chip8 can keep queueing
+                QueuedFrame frame = queue.front();
+                queue.pop_front();
+                room.notify_one();
+                lock.unlock();
+
+                if (!frame.repeatOnly) {
+                    Encode(frame.words);
+                    Output();
+                }
+                for (unsigned int r = 0; r < frame.repeats && !encoded.empty() && !failed; r++) {
+                    Output();
+                    repeatsWritten += failed ? 0 : 1;
+                }
+                lock.lock();
+            }
+        };
+
+        void Encode(const uint64_t* frameWords) {
+            // unpack to colour numbers (0 to 3) with a palette that maps each one to itself, then turn those into the format
+            static const uint32_t colourNumbers[4] = { 0, 1, 2, 3 };
+            std::vector<uint32_t> pixels(width * height);
+            UnpackFrame(frameWords, width, height, planes, pixels.data(), width, colourNumbers);
+            encoded.clear();
+            if (format == Format::Y4m) {
+                EncodeY4m(pixels);
+            }
+            else {
+                EncodePng(pixels);
+            }
+        };
+
+        void Output() {
+            // the last frame encoded, once more. only counted if it all got written
+            if (failed) {
+                return; // keep emptying the queue so the chip8 never waits on a writer that's given up
+            }
+            if (format == Format::Y4m) {
+                Write(encoded.data(), encoded.size());
+            }
+            else {
+                char name[32];
+                std::snprintf(name, sizeof(name), "frame_%06llu.png", framesWritten);
+                std::string filePath = (std::filesystem::path(path) / name).string();
+                std::FILE* png = std::fopen(filePath.c_str(), "wb");
+                if (png == nullptr) {
+                    failed = true;
+                    return;
+                }
+                if (std::fwrite(encoded.data(), 1, encoded.size(), png) != encoded.size()) {
+                    failed = true;
+                }
+                if (std::fclose(png) != 0) {
+                    failed = true;
+                }
+            }
+            framesWritten += failed ? 0 : 1;
+        };
+
+        void Write(const void* data, size_t length) {
+            if (!failed && std::fwrite(data, 1, length, file) != length) {
+                failed = true;
+            }
+        };
+
+        void EncodeY4m(const std::vector<uint32_t>& pixels) {
+            // "FRAME", then a full size Y plane, U plane and V plane. studio range BT.601, which is what ffmpeg assumes
+            unsigned char y[4], u[4], v[4];
+            for (int c = 0; c < 4; c++) {
+                int r = (displayPalette[c] >> 16) & 0xFF;
+                int g = (displayPalette[c] >> 8) & 0xFF;
+                int b = displayPalette[c] & 0xFF;
+                y[c] = static_cast<unsigned char>(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+                u[c] = static_cast<unsigned char>(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+                v[c] = static_cast<unsigned char>(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+            }
+            static const char frameHeader[] = "FRAME\n";
+            encoded.insert(encoded.end(), frameHeader, frameHeader + 6);
+            for (const unsigned char* plane : { y, u, v }) {
+                for (uint32_t pixel : pixels) {
+                    encoded.push_back(plane[pixel]);
+                }
+            }
+        };
+
+        void EncodePng(const std::vector<uint32_t>& pixels) {
+            // an 8 bit paletted PNG. the pixel data is stored in the zlib stream without compressing it, which keeps zlib out of
+            // the build. at 8 KB a frame at most it's not worth more than that
+            static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+            encoded.insert(encoded.end(), signature, signature + 8);
+
+            std::vector<unsigned char> chunk;
+            Put32(chunk, width);
+            Put32(chunk, height);
+            chunk.insert(chunk.end(), { 8, 3, 0, 0, 0 }); // bit depth, colour type (paletted), compression, filter, interlace
+            PutChunk("IHDR", chunk);
+
+            chunk.clear();
+            unsigned int colours = (planes > 1) ? 4 : 2;
+            for (unsigned int c = 0; c < colours; c++) {
+                chunk.insert(chunk.end(), { static_cast<unsigned char>(displayPalette[c] >> 16),
+                                            static_cast<unsigned char>(displayPalette[c] >> 8),
+                                            static_cast<unsigned char>(displayPalette[c]) });
+            }
+            PutChunk("PLTE", chunk);
+
+            // every row starts with filter type 0 (none)
+            std::vector<unsigned char> raw;
+            raw.reserve(height * (width + 1));
+            for (unsigned int y = 0; y < height; y++) {
+                raw.push_back(0);
+                for (unsigned int x = 0; x < width; x++) {
+                    raw.push_back(static_cast<unsigned char>(pixels[y * width + x]));
+                }
+            }
+            chunk.clear();
+            chunk.insert(chunk.end(), { 0x78, 0x01 }); // zlib header, no dictionary
+            for (size_t start = 0; start < raw.size(); start += 65535) {
+                // stored deflate blocks hold up to 65535 bytes each, the last one has its first bit set
+                size_t length = std::min<size_t>(65535, raw.size() - start);
+                chunk.push_back((start + length == raw.size()) ? 1 : 0);
+                chunk.insert(chunk.end(), { static_cast<unsigned char>(length), static_cast<unsigned char>(length >> 8),
+                                            static_cast<unsigned char>(~length), static_cast<unsigned char>(~length >> 8) });
+                chunk.insert(chunk.end(), raw.begin() + start, raw.begin() + start + length);
+            }
+            Put32(chunk, Adler32(raw));
+            PutChunk("IDAT", chunk);
+
+            chunk.clear();
+            PutChunk("IEND", chunk);
+        };
+
+        void PutChunk(const char* type, const std::vector<unsigned char>& data) {
+            // length, type, data, then the CRC of the type and data
+            Put32(encoded, static_cast<uint32_t>(data.size()));
+            size_t crcStart = encoded.size();
+            encoded.insert(encoded.end(), type, type + 4);
+            encoded.insert(encoded.end(), data.begin(), data.end());
+            Put32(encoded, Crc32(encoded.data() + crcStart, encoded.size() - crcStart));
+        };
+
+        static void Put32(std::vector<unsigned char>& out, uint32_t value) {
+            // PNG is big endian
+            out.insert(out.end(), { static_cast<unsigned char>(value >> 24), static_cast<unsigned char>(value >> 16),
+                                    static_cast<unsigned char>(value >> 8), static_cast<unsigned char>(value) });
+        };
+
+        static uint32_t Crc32(const unsigned char* data, size_t length) {
+            static const std::vector<uint32_t> table = [] {
+                std::vector<uint32_t> entries(256);
+                for (uint32_t n = 0; n < 256; n++) {
+                    uint32_t c = n;
+                    for (int k = 0; k < 8; k++) {
+                        c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                    }
+                    entries[n] = c;
+                }
+                return entries;
+            }();
+            uint32_t crc = 0xFFFFFFFFu;
+            for (size_t i = 0; i < length; i++) {
+                crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+            }
+            return crc ^ 0xFFFFFFFFu;
+        };
+
+        static uint32_t Adler32(const std::vector<unsigned char>& data) {
+            uint32_t a = 1;
+            uint32_t b = 0;
+            for (unsigned char byte : data) {
+                a = (a + byte) % 65521;
+                b = (b + a) % 65521;
+            }
+            return (b << 16) | a;
+        };
+};
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+/*
+    xxHash64, Yann Collet's fast non-cryptographic hash (https://github.com/Cyan4973/xxHash). ROMs are indexed by it (see
+    corpus.h and RomMetadata in analyzer.h). It gets through memory at several GB a second, so hashing a whole corpus of
+    ROMs costs next to nothing, and at 64 bits two different ROMs aren't going to end up with the same hash by accident.
+
+    It works through the input 32 bytes at a time in four independent lanes (which is where the speed comes from), then
+    folds whatever's left in 8, 4 and 1 bytes at a time and mixes the bits up at the end. Same answers as the reference
+    version, on any machine: the input is read as little endian whatever the host is.
+*/
+class XxHash64
+{
+    public:
+
+        static uint64_t Hash(const void* data, size_t length, uint64_t seed = 0) {
+            const unsigned char* in = static_cast<const unsigned char*>(data);
+            const unsigned char* end = in + length;
+            uint64_t hash;
+
+            if (length >= 32) {
+                uint64_t lane1 = seed + prime1 + prime2;
+                uint64_t lane2 = seed + prime2;
+                uint64_t lane3 = seed;
+                uint64_t lane4 = seed - prime1;
+                for (; end - in >= 32; in += 32) {
+                    lane1 = Round(lane1, Read64(in));
+                    lane2 = Round(lane2, Read64(in + 8));
+                    lane3 = Round(lane3, Read64(in + 16));
+                    lane4 = Round(lane4, Read64(in + 24));
+                }
+                hash = RotateLeft(lane1, 1) + RotateLeft(lane2, 7) + RotateLeft(lane3, 12) + RotateLeft(lane4, 18);
+                hash = Merge(hash, lane1);
+                hash = Merge(hash, lane2);
+                hash = Merge(hash, lane3);
+                hash = Merge(hash, lane4);
+            }
+            else {
+                hash = seed + prime5;
+            }
+            hash += length;
+
+            for (; end - in >= 8; in += 8) {
+                hash ^= Round(0, Read64(in));
+                hash = RotateLeft(hash, 27) * prime1 + prime4;
+            }
+            if (end - in >= 4) {
+                hash ^= Read32(in) * prime1;
+                hash = RotateLeft(hash, 23) * prime2 + prime3;
+                in += 4;
+            }
+            for (; in < end; in++) {
+                hash ^= *in * prime5;
+                hash = RotateLeft(hash, 11) * prime1;
+            }
+
+            hash ^= hash >> 33;
+            hash *= prime2;
+            hash ^= hash >> 29;
+            hash *= prime3;
+            hash ^= hash >> 32;
+            return hash;
+        };
+
+    private:
+
+        static constexpr uint64_t prime1 = 0x9E3779B185EBCA87ull;
+        static constexpr uint64_t prime2 = 0xC2B2AE3D27D4EB4Full;
+        static constexpr uint64_t prime3 = 0x165667B19E3779F9ull;
+        static constexpr uint64_t prime4 = 0x85EBCA77C2B2AE63ull;
+        static constexpr uint64_t prime5 = 0x27D4EB2F165667C5ull;
+
+        static uint64_t RotateLeft(uint64_t value, int amount) {
+            return (value << amount) | (value >> (64 - amount));
+        };
+
+        static uint64_t Read64(const unsigned char* in) {
+            // the compiler turns this into one load on a little endian machine
+            uint64_t value = 0;
+            for (int i = 0; i < 8; i++) {
+                value |= static_cast<uint64_t>(in[i]) << (8 * i);
+            }
+            return value;
+        };
+
+        static uint64_t Read32(const unsigned char* in) {
+            return static_cast<uint64_t>(in[0]) | static_cast<uint64_t>(in[1]) << 8 | static_cast<uint64_t>(in[2]) << 16
+                 | static_cast<uint64_t>(in[3]) << 24;
+        };
+
+        static uint64_t Round(uint64_t lane, uint64_t input) {
+            lane += input * prime2;
+            lane = RotateLeft(lane, 31);
+            return lane * prime1;
+        };
+
+        static uint64_t Merge(uint64_t hash, uint64_t lane) {
+            hash ^= Round(0, lane);
+            return hash * prime1 + prime4;
+        };
+};